@@ -0,0 +1,38 @@
+#ifndef COMMANDS_H
+#define COMMANDS_H
+
+#include <stdio.h>
+#include "image.h"
+
+typedef struct ImageCache ImageCache;
+typedef struct ThumbCache ThumbCache;
+typedef struct MemoCache MemoCache;
+typedef struct History History;
+
+// State of one interactive session (the REPL or a server connection)
+typedef struct {
+    imgctx *ctx;        // context used for every operation
+    BMPImage *img;      // current image, NULL until something is loaded
+    ImageCache *cache;  // decoded-image cache for "load", may be NULL
+    ThumbCache *thumbs; // thumbnail cache for "thumb", may be NULL
+    MemoCache *memo;    // result cache for rotate/scale/resize/crop, may be NULL
+    History *history;   // undo/redo history, may be NULL
+    int dirty[4];       // x, y, width, height the last command changed, when dirty_set
+    int dirty_set;
+    int peer_fd;        // Unix socket of a server client, -1 in the REPL
+} Session;
+
+// Longest command line accepted
+#define SESSION_LINE_MAX 4096
+
+void session_init(Session *s, imgctx *ctx, ImageCache *cache);
+void session_free(Session *s);
+
+// Prints the command list
+void session_print_menu(FILE *out);
+
+// Executes one command line (modified in place), writing all output to out.
+// Returns 1 when the command asks to end the session, 0 otherwise.
+int session_execute(Session *s, char *line, FILE *out);
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stddef.h>
+#include "image.h"
+
+// Undo/redo history of a session's image. Every version is a grid of
+// IMG_TILE x IMG_TILE pixel tiles, reference counted: a new version shares
+// each tile that did not change with the version before it, so an edit
+// costs memory in proportion to the area it touched. When the tiles held
+// exceed the limit the oldest versions are dropped. Not thread safe; one
+// history belongs to one session.
+typedef struct History History;
+
+History *history_create(size_t limit_bytes);
+void history_destroy(History *h);
+
+// Records image (24 or 32-bit) as the newest version and drops the redo
+// versions. region (x, y, width, height, rows in stored order) may bound
+// the pixels changed since the last version when the geometry is the same;
+// tiles outside it are shared without being compared. Nothing is recorded
+// when no tile changed. An image larger than the limit clears the history.
+img_status history_record(History *h, imgctx *ctx, const BMPImage *image, const int *region);
+
+// Rebuilds the version before (undo) or after (redo) the current one in *out
+// and makes it current. IMG_ERR_ARG when there is no such version.
+img_status history_undo(History *h, imgctx *ctx, BMPImage **out);
+img_status history_redo(History *h, imgctx *ctx, BMPImage **out);
+
+// Drops every version
+void history_clear(History *h);
+
+// Steps available each way and the bytes of tiles held
+void history_stats(const History *h, int *undo_steps, int *redo_steps, size_t *bytes);
+
+#endif
@@ -1,6 +1,7 @@
 #ifndef IMAGE_H
 #define IMAGE_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 // BMP header (14 bytes)
@@ -33,9 +34,177 @@ typedef struct {
     BMPHeader header;
     DIBHeader dib;
     unsigned char* data;  // pixel data
+    void* mapping;        // memory mapping holding data, NULL when data is on the heap
+    size_t mapping_size;  // length of the mapping
+    int mapping_fd;       // shared-memory descriptor of the mapping, or -1
+    uint64_t hash;        // content identity (see img_content_hash), 0 when unknown
 } BMPImage;
 
-// Function prototypes
+// Status codes returned by the context API
+typedef enum {
+    IMG_OK = 0,
+    IMG_ERR_ARG,         // invalid argument
+    IMG_ERR_IO,          // file could not be opened, read or written
+    IMG_ERR_FORMAT,      // not a BMP file or malformed headers
+    IMG_ERR_UNSUPPORTED, // valid BMP the operation cannot handle
+    IMG_ERR_NOMEM,       // allocation failed
+    IMG_ERR_CAPACITY,    // message does not fit in the image
+    IMG_ERR_BOUNDS       // region outside the image
+} img_status;
+
+// Memory hooks used for every image and message buffer of a context
+typedef struct {
+    void* (*alloc)(void* user, size_t size);
+    void (*release)(void* user, void* ptr);
+    void* user;
+} img_allocator;
+
+typedef struct ThreadPool ThreadPool;
+
+// Library context: allocator, optional thread pool and the last error.
+// A context must only be used by one thread at a time; use one context per
+// worker thread (they may share a pool). Functions taking a context never
+// write to stdout/stderr.
+typedef struct imgctx imgctx;
+
+// allocator == NULL selects malloc/free, pool == NULL runs kernels serially
+imgctx* img_ctx_create(const img_allocator* allocator, ThreadPool* pool);
+void img_ctx_destroy(imgctx* ctx);
+ThreadPool* img_ctx_pool(const imgctx* ctx);
+img_status img_ctx_status(const imgctx* ctx);
+const char* img_ctx_error(const imgctx* ctx);   // details of the last failure
+void img_ctx_clear_error(imgctx* ctx);
+const char* img_status_str(img_status status);
+
+// Context API. Images and messages returned through out-parameters belong
+// to the context's allocator and must be released with img_free/img_free_message.
+img_status img_load(imgctx* ctx, const char* filename, BMPImage** out);
+img_status img_save(imgctx* ctx, const char* filename, const BMPImage* image);
+
+// Output options for img_save_ex. PALETTE writes an 8-bit palettized file
+// when a 24/32-bit image has at most 256 colours (and no translucent
+// pixels); QUANTIZE does so for any such image, reducing it to 256
+// colours if needed; RLE adds RLE8 compression when it makes the file
+// smaller. V5 writes a BITMAPV5HEADER (sRGB, with an alpha mask for
+// 32-bit pixels) instead of the 40-byte BITMAPINFOHEADER. Images that do
+// not qualify are written as img_save does.
+enum {
+    IMG_SAVE_PALETTE = 1,
+    IMG_SAVE_QUANTIZE = 2,
+    IMG_SAVE_RLE = 4,
+    IMG_SAVE_V5 = 8
+};
+img_status img_save_ex(imgctx* ctx, const char* filename, const BMPImage* image, int flags);
+void img_free(imgctx* ctx, BMPImage* image);
+img_status img_clone(imgctx* ctx, const BMPImage* src, BMPImage** out);
+img_status img_fill(imgctx* ctx, BMPImage* image, const unsigned char color[3]);
+// Fills width x height pixels from column x and row y (rows in stored
+// order, as for img_crop); the rectangle must lie inside the image
+img_status img_fill_rect(imgctx* ctx, BMPImage* image, const unsigned char color[3], int x, int y, int width,
+                         int height);
+img_status img_rotate(imgctx* ctx, const BMPImage* src, double angle_degrees, BMPImage** out);
+// Nearest-neighbour affine resampling to an image of the size of src:
+// destination pixel (x, y) takes the source pixel nearest to
+// (m[0] * x + m[1] * y + m[2], m[3] * x + m[4] * y + m[5]), evaluated in that
+// order and rounded as round() does, black when that falls outside src.
+// Coordinates are pixel indices, rows in stored order.
+img_status img_affine(imgctx* ctx, const BMPImage* src, const double m[6], BMPImage** out);
+img_status img_scale(imgctx* ctx, const BMPImage* src, double factor, BMPImage** out);
+img_status img_resize(imgctx* ctx, const BMPImage* src, int new_width, int new_height, BMPImage** out);
+img_status img_crop(imgctx* ctx, const BMPImage* src, int x, int y, int crop_width, int crop_height, BMPImage** out);
+img_status img_embed(imgctx* ctx, BMPImage* image, const char* message, int use_msb);
+img_status img_extract(imgctx* ctx, const BMPImage* image, int use_msb, char** out);
+void img_free_message(imgctx* ctx, char* msg);
+
+// Tone curves: one 256-entry table per colour channel (0 = blue, 1 = green,
+// 2 = red); alpha is never changed. Start from img_lut_identity; each
+// img_lut_* call applies its curve after those already in the table, so a
+// whole chain costs a single pass of img_apply_lut.
+typedef struct {
+    unsigned char table[3][256];
+} img_lut;
+
+void img_lut_identity(img_lut* lut);
+void img_lut_brightness(img_lut* lut, int delta);        // v + delta
+void img_lut_contrast(img_lut* lut, double factor);      // (v - 128) * factor + 128
+void img_lut_gamma(img_lut* lut, double gamma);          // 255 * (v / 255)^(1 / gamma)
+void img_lut_levels(img_lut* lut, int in_black, int in_white, int out_black, int out_white);
+img_status img_apply_lut(imgctx* ctx, BMPImage* image, const img_lut* lut);
+
+// Replaces colours with their BT.601 luma
+img_status img_grayscale(imgctx* ctx, BMPImage* image);
+
+// Per-channel statistics. Channels are in pixel byte order: 0 = blue,
+// 1 = green, 2 = red, 3 = alpha (32-bit images only). Row padding is not
+// counted.
+typedef struct {
+    int channels;                 // 3 or 4
+    uint64_t pixels;
+    uint64_t histogram[4][256];
+    unsigned char min[4];
+    unsigned char max[4];
+    double mean[4];
+    double stddev[4];
+} img_stats;
+
+img_status img_compute_stats(imgctx* ctx, const BMPImage* image, img_stats* out);
+
+// Filters. Each returns a new image of the same size; pixels beyond the
+// edges repeat the edge pixel and all channels (alpha too) are filtered.
+// img_convolve applies kx along rows and ky along columns, centered on tap
+// n / 2; taps are rounded to 1/16384, must each be below 2 in magnitude and
+// sum to at most 3 in absolute value, up to 255 per kernel.
+img_status img_convolve(imgctx* ctx, const BMPImage* src, const float* kx, int nx, const float* ky, int ny,
+                        BMPImage** out);
+img_status img_box_blur(imgctx* ctx, const BMPImage* src, int radius, BMPImage** out); // radius 0..1000
+img_status img_gaussian_blur(imgctx* ctx, const BMPImage* src, double sigma, BMPImage** out);
+// src + amount * (src - gaussian(src)), leaving differences below threshold alone
+img_status img_unsharp_mask(imgctx* ctx, const BMPImage* src, double sigma, double amount, int threshold,
+                            BMPImage** out);
+
+// Draws src over dst with its first pixel at column x and row y of dst
+// (rows in stored order, as for img_crop), clipped to dst; x and y may be
+// negative.
+// A 32-bit src blends by its alpha times opacity / 255; a 24-bit src by
+// opacity alone (0..255). Rows are matched visually when the two images
+// are stored in opposite row orders.
+img_status img_overlay(imgctx* ctx, BMPImage* dst, const BMPImage* src, int x, int y, int opacity);
+
+// Tiled pixel storage for 24/32-bit images: IMG_TILE x IMG_TILE pixel
+// tiles, each contiguous (tile rows back to back, unpadded), tiles in
+// row-major order and rows in the stored order of the image. Tiles on the
+// right and bottom edges are padded with black to full size. Every pixel's
+// neighbours then lie within a few pages, which arbitrary-angle resampling
+// of large images needs; convert once, run any number of tiled operations
+// and convert back.
+#define IMG_TILE 64
+
+typedef struct {
+    BMPHeader header;
+    DIBHeader dib;        // headers of the row-major image
+    int tiles_x;          // tile columns
+    int tiles_y;          // tile rows
+    unsigned char* data;  // tiles_x * tiles_y tiles
+} img_tiled;
+
+img_status img_to_tiled(imgctx* ctx, const BMPImage* src, img_tiled** out);
+img_status img_from_tiled(imgctx* ctx, const img_tiled* src, BMPImage** out);
+void img_free_tiled(imgctx* ctx, img_tiled* tiled);
+// img_affine and img_rotate on tiled images, one output tile at a time;
+// results are identical to the row-major versions
+img_status img_tiled_affine(imgctx* ctx, const img_tiled* src, const double m[6], img_tiled** out);
+img_status img_tiled_rotate(imgctx* ctx, const img_tiled* src, double angle_degrees, img_tiled** out);
+
+// Content identity: image->hash holds a 64-bit hash of the pixels and
+// geometry once something has needed it (img_load leaves it 0; the first
+// memo lookup fills it in); results of memoized operations (memo.h) carry
+// a hash derived from their source and recipe. In-place operations reset
+// it to 0; code writing pixels directly must do the same.
+// img_content_hash returns image->hash, hashing the pixels when it is 0.
+uint64_t img_content_hash(const BMPImage* image);
+uint64_t img_hash_bytes(const void* data, size_t len, uint64_t seed);
+
+// Legacy API: malloc-backed, serial, reports failures on stderr
 BMPImage* load_bmp(const char* filename);
 void free_bmp(BMPImage* image);
 void fill_bmp(BMPImage* image, unsigned char color[3]);
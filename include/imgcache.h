@@ -0,0 +1,48 @@
+#ifndef IMGCACHE_H
+#define IMGCACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "image.h"
+
+// In-memory cache of decoded images keyed by canonical path (see
+// imgcache_canonical_path) and the file's modification time, size and
+// inode. Safe to share between threads.
+typedef struct ImageCache ImageCache;
+
+// Keeps at most budget_bytes of pixel data, evicting least recently used images
+ImageCache *imgcache_create(size_t budget_bytes);
+void imgcache_destroy(ImageCache *cache);
+
+// Loads filename through the cache. *out is a private copy allocated from
+// ctx, so the caller may modify and must free it with img_free.
+img_status imgcache_load(ImageCache *cache, imgctx *ctx, const char *filename, BMPImage **out);
+
+// Hit/miss counters and bytes currently held
+void imgcache_stats(ImageCache *cache, uint64_t *hits, uint64_t *misses, size_t *bytes);
+
+// What stat tells about a file's contents: a rewrite that keeps the size
+// within the same second still changes mtime_ns, a replacement by rename
+// changes inode
+typedef struct {
+    int64_t mtime_ns; // modification time in nanoseconds
+    uint64_t size;
+    uint64_t inode;   // 0 on Windows
+} FileIdentity;
+
+// Longest canonical path the caches keep
+#define IMGCACHE_PATH_MAX 4096
+
+// Resolves ".", ".." and links (realpath; _fullpath on Windows) into buf,
+// so a.bmp, ./a.bmp and /abs/a.bmp give one key. Returns 0 on success.
+int imgcache_canonical_path(const char *path, char *buf, size_t len);
+
+// Reads the identity of a file. Returns 0 on success.
+int imgcache_file_identity(const char *filename, FileIdentity *id);
+
+static inline int imgcache_same_file(const FileIdentity *a, const FileIdentity *b)
+{
+    return a->mtime_ns == b->mtime_ns && a->size == b->size && a->inode == b->inode;
+}
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef MEMO_H
+#define MEMO_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "image.h"
+
+// Result cache for transform recipes. A result is keyed by the content
+// hash of its source (img_content_hash) and a canonical encoding of the
+// operation and its parameters; the result's own hash is that key, so a
+// chain of operations is cached step by step. Results live in memory under
+// a byte budget, least recently used first out, and optionally in a disk
+// directory that survives restarts. Safe to share between threads.
+typedef struct MemoCache MemoCache;
+
+typedef enum {
+    MEMO_ROTATE, // value = angle in degrees
+    MEMO_SCALE,  // value = factor
+    MEMO_RESIZE, // args = width, height
+    MEMO_CROP    // args = x, y, width, height
+} MemoOpKind;
+
+typedef struct {
+    MemoOpKind kind;
+    int args[4];
+    double value;
+} MemoOp;
+
+// disk_dir names an existing directory, or NULL for a memory-only cache.
+// The directory is not trimmed; delete its files to reclaim space.
+MemoCache *memo_create(size_t budget_bytes, const char *disk_dir);
+void memo_destroy(MemoCache *cache);
+
+// Applies op to src (like img_rotate/img_scale/img_resize/img_crop) unless
+// the result is cached. src->hash is filled in if it was unknown. *out is
+// allocated from ctx; *hit (may be NULL) tells whether the result came
+// from the cache. cache may be NULL to just run the operation.
+img_status memo_apply(MemoCache *cache, imgctx *ctx, BMPImage *src, const MemoOp *op,
+                      BMPImage **out, int *hit);
+
+// Applies ops in order, starting from the longest cached prefix of the chain
+img_status memo_apply_chain(MemoCache *cache, imgctx *ctx, BMPImage *src, const MemoOp *ops, int count,
+                            BMPImage **out);
+
+// Counters and bytes held in memory
+void memo_stats(MemoCache *cache, uint64_t *hits, uint64_t *disk_hits, uint64_t *misses, size_t *bytes);
+
+#endif
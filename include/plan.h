@@ -0,0 +1,48 @@
+#ifndef PLAN_H
+#define PLAN_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "image.h"
+#include "memo.h"
+
+// Runs a transform chain (see memo.h) from one BMP file to another within
+// a memory budget. plan_make reads only the file's headers, estimates the
+// peak memory of each way of running the chain and picks the fastest one
+// that fits; plan_run runs it. Every strategy writes the same file.
+typedef enum {
+    PLAN_MEMORY, // whole images in memory, one after another
+    PLAN_MAPPED, // the source mapped from its file, results in memory
+    PLAN_STREAM, // one pass over the rows, a few rows in memory; no rotate
+    PLAN_TILED,  // every image in a temporary file; rotations run on tiles
+    PLAN_COUNT
+} PlanStrategy;
+
+// Estimate of a strategy that cannot run the chain on this file
+#define PLAN_UNAVAILABLE UINT64_MAX
+
+typedef struct {
+    PlanStrategy strategy;     // fastest strategy within the budget
+    uint64_t peak[PLAN_COUNT]; // estimated peak bytes of each strategy
+    uint64_t budget;
+    int width, height;         // result
+} Plan;
+
+const char *plan_strategy_name(PlanStrategy strategy);
+
+// Prints the chosen strategy and the estimate of each
+void plan_print(const Plan *plan, FILE *out);
+
+// Fills *out for running ops on the file src_path. IMG_ERR_NOMEM (with
+// *out still filled in) when no strategy fits in budget_bytes.
+img_status plan_make(imgctx *ctx, const char *src_path, const MemoOp *ops, int count, uint64_t budget_bytes,
+                     Plan *out);
+
+// Runs the chain with plan->strategy and saves the result to dst_path.
+// PLAN_TILED keeps its images in unlinked files in temp_dir (NULL: the
+// directory of dst_path), so their pages can go back to disk under
+// memory pressure.
+img_status plan_run(imgctx *ctx, const Plan *plan, const char *src_path, const MemoOp *ops, int count,
+                    const char *dst_path, const char *temp_dir);
+
+#endif
@@ -0,0 +1,132 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Lightweight per-operation instrumentation for the image API.
+// Everything is a no-op (a single flag test) until profiling is enabled.
+
+// Instrumented operations
+typedef enum {
+    PROF_LOAD,
+    PROF_SAVE,
+    PROF_FILL,
+    PROF_ROTATE,
+    PROF_SCALE,
+    PROF_RESIZE,
+    PROF_CROP,
+    PROF_EMBED,
+    PROF_EXTRACT,
+    PROF_CLONE,
+    PROF_SHM,
+    PROF_THUMB,
+    PROF_STATS,
+    PROF_TONE,
+    PROF_FILTER,
+    PROF_OVERLAY,
+    PROF_AFFINE,
+    PROF_TILE,
+    PROF_HISTORY,
+    PROF_SCAN,
+    PROF_OP_COUNT
+} ProfOp;
+
+// Counters accumulated for one operation
+typedef struct {
+    uint64_t calls;           // number of calls
+    uint64_t wall_ns;         // total wall time
+    uint64_t bytes_read;      // bytes read from files
+    uint64_t bytes_written;   // bytes written to files
+    uint64_t bytes_allocated; // bytes of pixel buffers allocated
+    uint64_t peak_live;       // highest live pixel-buffer bytes seen during a call
+    uint64_t pixels;          // pixels processed
+} ProfRecord;
+
+// Timing state of one running call
+typedef struct {
+    ProfOp op;
+    uint64_t start_ns;
+} ProfScope;
+
+// Non-zero while instrumentation is recording. Pool threads read it while
+// the REPL or server writes it, so it is accessed atomically (relaxed):
+// C11 atomics, or on MSVC a volatile long, whose aligned loads and stores
+// are atomic there.
+#if defined(_MSC_VER) && !defined(__clang__)
+extern volatile long prof_enabled;
+static inline int prof_is_enabled(void)
+{
+    return prof_enabled != 0;
+}
+#else
+#include <stdatomic.h>
+extern _Atomic int prof_enabled;
+static inline int prof_is_enabled(void)
+{
+    return atomic_load_explicit(&prof_enabled, memory_order_relaxed);
+}
+#endif
+
+void prof_enable(int on);
+void prof_reset(void);
+uint64_t prof_now_ns(void);
+
+// Slow paths, only reached while enabled
+void prof_record_call(ProfOp op, uint64_t wall_ns);
+void prof_record_io(ProfOp op, uint64_t read, uint64_t written);
+void prof_record_alloc(ProfOp op, uint64_t bytes);
+void prof_record_free(uint64_t bytes);
+void prof_record_pixels(ProfOp op, uint64_t pixels);
+
+const ProfRecord *prof_get(ProfOp op);
+const char *prof_op_name(ProfOp op);
+
+// Prints a per-operation table (REPL "stats" command)
+void prof_print_table(FILE *out);
+// Writes all counters as a JSON object
+void prof_write_json(FILE *out);
+
+// Reads IMAGETOOL_STATS / IMAGETOOL_STATS_JSON from the environment.
+// With IMAGETOOL_STATS_JSON=<file> the counters are dumped there on exit.
+void prof_init_from_env(void);
+
+// Inline wrappers used inside the API functions
+static inline void prof_begin(ProfScope *scope, ProfOp op)
+{
+    scope->op = op;
+    scope->start_ns = prof_is_enabled() ? prof_now_ns() : 0;
+}
+
+static inline void prof_end(const ProfScope *scope)
+{
+    if (prof_is_enabled())
+        prof_record_call(scope->op, scope->start_ns ? prof_now_ns() - scope->start_ns : 0);
+}
+
+static inline void prof_io(ProfOp op, uint64_t read, uint64_t written)
+{
+    if (prof_is_enabled())
+        prof_record_io(op, read, written);
+}
+
+static inline void prof_alloc(ProfOp op, uint64_t bytes)
+{
+    if (prof_is_enabled())
+        prof_record_alloc(op, bytes);
+}
+
+static inline void prof_free(uint64_t bytes)
+{
+    if (prof_is_enabled())
+        prof_record_free(bytes);
+}
+
+static inline void prof_pixels(ProfOp op, uint64_t pixels)
+{
+    if (prof_is_enabled())
+        prof_record_pixels(op, pixels);
+}
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stdint.h>
+#include "image.h"
+
+typedef struct ThreadPool ThreadPool;
+
+// Finds messages hidden by img_embed without loading images. A scan reads
+// the headers and the 32 carrier bytes of the length prefix, checks the
+// length against the capacity as img_extract does, and reads the payload's
+// carrier bytes only when asked for the message, so the cost per file is
+// a few small reads whatever its size.
+
+// Scans one file. IMG_OK with *length (and, when message is not NULL, a
+// message allocated from ctx; free with img_free_message) for a prefix
+// that fits, IMG_ERR_CAPACITY for one that does not, IMG_ERR_UNSUPPORTED
+// for files whose pixels are not stored as 24/32-bit bytes.
+img_status scan_file(imgctx *ctx, const char *path, int use_msb, uint32_t *length, char **message);
+
+typedef struct {
+    const char *path;   // set by the caller
+    img_status status;  // as for scan_file
+    uint32_t length;    // payload length when status is IMG_OK
+    char *message;      // malloc'ed when messages were requested and status is IMG_OK
+} ScanResult;
+
+// Scans count files on pool (NULL: serially), one task per file. Only
+// paths need to be set on entry.
+void scan_files(ThreadPool *pool, ScanResult *results, int count, int use_msb, int read_messages);
+
+// Frees the messages of results
+void scan_free_results(ScanResult *results, int count);
+
+#endif
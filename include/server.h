@@ -0,0 +1,20 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stddef.h>
+
+typedef struct ThumbCache ThumbCache;
+typedef struct MemoCache MemoCache;
+
+// Resident server: accepts the REPL command language on a Unix domain
+// socket, one session per connection, with decoded images shared through
+// an in-memory cache. Commands execute on a worker pool of nthreads
+// threads (<= 0 means one per CPU). thumbs and memo (may be NULL) are
+// shared by every connection and stay owned by the caller.
+//
+// Blocks until SIGINT/SIGTERM. Returns 0 on clean shutdown, 1 on error.
+// Not available on Windows.
+int server_run(const char *socket_path, int nthreads, size_t cache_bytes, ThumbCache *thumbs,
+               MemoCache *memo);
+
+#endif
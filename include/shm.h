@@ -0,0 +1,43 @@
+#ifndef SHM_H
+#define SHM_H
+
+#include "image.h"
+
+// Zero-copy image handoff between processes.
+//
+// A shared image lives in an anonymous memory segment (memfd on Linux,
+// POSIX shm elsewhere) laid out exactly like a BMP file, with the pixels
+// at IMG_SHM_PIXEL_OFFSET. The segment's descriptor can be passed to
+// another process over a Unix socket (SCM_RIGHTS), which maps the same
+// pages: both sides see each other's pixel writes. Use img_clone for a
+// private copy. Not available on Windows (IMG_ERR_UNSUPPORTED).
+
+// Pixels start here in the segment (cache-line aligned)
+#define IMG_SHM_PIXEL_OFFSET 64
+
+// Creates a black image directly in a new segment
+img_status img_shm_create(imgctx* ctx, int width, int height, int bits_per_pixel, BMPImage** out);
+
+// Moves image's pixels into a segment (one copy, skipped if already shared)
+// and returns a new descriptor for it in *fd; the caller closes *fd.
+// fd may be NULL when the image's own descriptor is enough.
+img_status img_shm_export(imgctx* ctx, BMPImage* image, int* fd);
+
+// Maps a segment received from another process. Takes ownership of fd.
+// An ordinary BMP file is mapped privately instead: writes stay local.
+img_status img_shm_import(imgctx* ctx, int fd, BMPImage** out);
+
+// Opens and maps a segment by path, e.g. /proc/<pid>/fd/<n> printed by
+// img_shm_path in the exporting process, or a file under /dev/shm
+img_status img_shm_open(imgctx* ctx, const char* path, BMPImage** out);
+
+// Path under which other processes of the same user can open the
+// segment of a shared image. Returns 0 on success.
+int img_shm_path(const BMPImage* image, char* buf, size_t len);
+
+// Passes a descriptor over a connected Unix socket with a short data
+// payload. Return 0 on success, -1 on failure.
+int img_shm_send_fd(int sock, int fd, const char* payload);
+int img_shm_recv_fd(int sock, int* fd);
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#ifdef _WIN32
+#include <windows.h>
+typedef SRWLOCK tp_mutex;
+#define TP_MUTEX_INIT SRWLOCK_INIT
+#else
+#include <pthread.h>
+typedef pthread_mutex_t tp_mutex;
+#define TP_MUTEX_INIT PTHREAD_MUTEX_INITIALIZER
+#endif
+
+// Fixed-size pool of worker threads shared by image contexts.
+// A pool may be used from several threads at once.
+typedef struct ThreadPool ThreadPool;
+
+// Creates a pool with nthreads workers (<= 0 means one per online CPU)
+ThreadPool *tp_create(int nthreads);
+// Runs any queued tasks, stops the workers and frees the pool
+void tp_destroy(ThreadPool *pool);
+// Number of worker threads (0 for a NULL pool)
+int tp_size(const ThreadPool *pool);
+
+// Queues fn(arg) to run on a worker. Returns 0 on success, -1 on failure.
+int tp_submit(ThreadPool *pool, void (*fn)(void *arg), void *arg);
+
+// Runs fn(arg) on a worker and waits for it to return. Bounds the number
+// of concurrently executing requests to the pool size. With a NULL pool
+// fn runs on the caller.
+void tp_call(ThreadPool *pool, void (*fn)(void *arg), void *arg);
+
+// Splits [0, count) into chunks of at least grain items and calls
+// fn(arg, begin, end) for each of them, on the workers and the calling
+// thread. Returns when every chunk has finished. With a NULL pool the
+// whole range runs on the caller.
+void tp_parallel_for(ThreadPool *pool, int count, int grain,
+                     void (*fn)(void *arg, int begin, int end), void *arg);
+
+// Small portable mutex, statically initialisable with TP_MUTEX_INIT
+void tp_mutex_init(tp_mutex *m);
+void tp_mutex_destroy(tp_mutex *m);
+void tp_mutex_lock(tp_mutex *m);
+void tp_mutex_unlock(tp_mutex *m);
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef THUMBCACHE_H
+#define THUMBCACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "image.h"
+
+// Persistent thumbnail cache: a directory of small BMP files plus an index
+// file mapping (path, file identity, max side) to them. Paths are resolved
+// with realpath first, so every spelling of a file shares its thumbnail.
+// The index survives restarts; a hit costs one read of the small file
+// instead of decoding the full image. Safe to share between threads;
+// thumbnails are written outside the cache lock and a changed index at
+// most every few seconds.
+typedef struct ThumbCache ThumbCache;
+
+// Opens the cache in dir (created on the first store), keeping at most
+// budget_bytes of thumbnail files and evicting least recently used ones.
+// Returns NULL when out of memory; a missing or damaged index starts empty.
+ThumbCache *thumbcache_open(const char *dir, size_t budget_bytes);
+
+// Writes the index and frees the cache
+void thumbcache_close(ThumbCache *cache);
+
+// Thumbnail of filename whose longer side is at most max_side pixels.
+// Smaller images are returned at their own size. *out is allocated from
+// ctx and released with img_free. *hit (may be NULL) tells whether the
+// thumbnail came from the cache.
+img_status thumbcache_get(ThumbCache *cache, imgctx *ctx, const char *filename, int max_side,
+                          BMPImage **out, int *hit);
+
+// Hit/miss counters, bytes of thumbnail files and number of entries
+void thumbcache_stats(ThumbCache *cache, uint64_t *hits, uint64_t *misses, size_t *bytes, size_t *entries);
+
+#endif
@@ -0,0 +1,28 @@
+#!/bin/bash
+echo "Building Image Utility library (static and shared) on Linux..."
+
+mkdir -p lib/obj/static lib/obj/shared
+
+SOURCES="src/image.c src/profile.c src/threadpool.c src/imgcache.c src/shm.c src/thumbcache.c src/hash.c src/memo.c src/stats.c src/tone.c src/convolve.c src/composite.c src/decode.c src/encode.c src/tiled.c src/history.c src/plan.c src/scan.c"
+CFLAGS="-Wall -Wextra -std=c11 -O2 -Iinclude"
+
+for src in $SOURCES; do
+    obj=$(basename "$src" .c).o
+    gcc $CFLAGS -c "$src" -o "lib/obj/static/$obj" || { echo "Compilation failed."; exit 1; }
+    gcc $CFLAGS -fPIC -c "$src" -o "lib/obj/shared/$obj" || { echo "Compilation failed."; exit 1; }
+done
+
+ar rcs lib/libimage.a lib/obj/static/*.o &&
+gcc -shared -o lib/libimage.so lib/obj/shared/*.o -lm -pthread
+
+if [ $? -eq 0 ]; then
+    echo "Built lib/libimage.a and lib/libimage.so"
+else
+    echo "Linking failed."
+    exit 1
+fi
+
+#Usage
+#chmod +x build_lib_linux.sh
+#./build_lib_linux.sh
+#gcc -Iinclude app.c -Llib -limage -lm -pthread
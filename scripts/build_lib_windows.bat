@@ -0,0 +1,25 @@
+@echo off
+echo Building Image Utility static library on Windows...
+
+:: set project root (parent of script folder)
+set "ROOT=%~dp0.."
+
+:: ensure lib\obj exists
+if not exist "%ROOT%\lib\obj" mkdir "%ROOT%\lib\obj"
+
+:: compile objects into lib\obj
+cl /nologo /W3 /TC /O2 /c /I "%ROOT%\include" "%ROOT%\src\image.c" "%ROOT%\src\profile.c" "%ROOT%\src\threadpool.c" "%ROOT%\src\imgcache.c" "%ROOT%\src\shm.c" "%ROOT%\src\thumbcache.c" "%ROOT%\src\hash.c" "%ROOT%\src\memo.c" "%ROOT%\src\stats.c" "%ROOT%\src\tone.c" "%ROOT%\src\convolve.c" "%ROOT%\src\composite.c" "%ROOT%\src\decode.c" "%ROOT%\src\encode.c" "%ROOT%\src\tiled.c" "%ROOT%\src\history.c" "%ROOT%\src\plan.c" "%ROOT%\src\scan.c" /Fo"%ROOT%\lib\obj\\"
+if %ERRORLEVEL% NEQ 0 (
+    echo Compilation failed.
+    exit /b 1
+)
+
+:: archive into lib\image.lib
+lib /nologo /OUT:"%ROOT%\lib\image.lib" "%ROOT%\lib\obj\*.obj"
+
+if %ERRORLEVEL% EQU 0 (
+    echo Built lib\image.lib
+) else (
+    echo Archiving failed.
+    exit /b 1
+)
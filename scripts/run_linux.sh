@@ -4,7 +4,7 @@ echo "Compiling and running Image Utility (interactive CLI) on Linux..."
 
 mkdir -p bin/linux
 
-gcc -Wall -Wextra -std=c11 -Iinclude src/image.c src/main.c -o bin/linux/imagetool_script_main -lm
+gcc -Wall -Wextra -std=c11 -Iinclude src/image.c src/profile.c src/threadpool.c src/imgcache.c src/shm.c src/thumbcache.c src/hash.c src/memo.c src/stats.c src/tone.c src/convolve.c src/composite.c src/decode.c src/encode.c src/tiled.c src/history.c src/plan.c src/scan.c src/commands.c src/server.c src/main.c -o bin/linux/imagetool_script_main -lm -pthread
 
 if [ $? -eq 0 ]; then
     echo "Compilation successful."
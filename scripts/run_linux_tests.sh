@@ -3,11 +3,14 @@ echo "Compiling and running Image Utility tests on Linux..."
 
 mkdir -p bin/linux
 
-gcc -Wall -Wextra -std=c11 -Iinclude src/image.c src/test.c -o bin/linux/test_all -lm
+gcc -Wall -Wextra -std=c11 -Iinclude src/image.c src/profile.c src/threadpool.c src/imgcache.c src/shm.c src/thumbcache.c src/hash.c src/memo.c src/stats.c src/tone.c src/convolve.c src/composite.c src/decode.c src/encode.c src/tiled.c src/history.c src/plan.c src/scan.c src/reference.c src/test.c -o bin/linux/test_all -lm -pthread
+built=$?
+# Same tests without the SSE2 kernels
+gcc -DIMG_NO_SIMD -Wall -Wextra -std=c11 -Iinclude src/image.c src/profile.c src/threadpool.c src/imgcache.c src/shm.c src/thumbcache.c src/hash.c src/memo.c src/stats.c src/tone.c src/convolve.c src/composite.c src/decode.c src/encode.c src/tiled.c src/history.c src/plan.c src/scan.c src/reference.c src/test.c -o bin/linux/test_all_scalar -lm -pthread
 
-if [ $? -eq 0 ]; then
+if [ $? -eq 0 ] && [ $built -eq 0 ]; then
     echo "Compilation successful."
-    ./bin/linux/test_all
+    ./bin/linux/test_all && ./bin/linux/test_all_scalar
 else
     echo "Compilation failed."
     exit 1
@@ -8,7 +8,7 @@ set "ROOT=%~dp0.."
 if not exist "%ROOT%\bin\windows" mkdir "%ROOT%\bin\windows"
 
 :: compile into bin\windows
-cl /nologo /W3 /TC /I "%ROOT%\include" "%ROOT%\src\image.c" "%ROOT%\src\main.c" /Fe"%ROOT%\bin\windows\imagetool_script.exe"
+cl /nologo /W3 /TC /I "%ROOT%\include" "%ROOT%\src\image.c" "%ROOT%\src\profile.c" "%ROOT%\src\threadpool.c" "%ROOT%\src\imgcache.c" "%ROOT%\src\shm.c" "%ROOT%\src\thumbcache.c" "%ROOT%\src\hash.c" "%ROOT%\src\memo.c" "%ROOT%\src\stats.c" "%ROOT%\src\tone.c" "%ROOT%\src\convolve.c" "%ROOT%\src\composite.c" "%ROOT%\src\decode.c" "%ROOT%\src\encode.c" "%ROOT%\src\tiled.c" "%ROOT%\src\history.c" "%ROOT%\src\plan.c" "%ROOT%\src\scan.c" "%ROOT%\src\commands.c" "%ROOT%\src\server.c" "%ROOT%\src\main.c" /Fe"%ROOT%\bin\windows\imagetool_script.exe"
 
 if %ERRORLEVEL% EQU 0 (
     echo Compilation successful.
@@ -0,0 +1,875 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../include/commands.h"
+#include "../include/history.h"
+#include "../include/imgcache.h"
+#include "../include/memo.h"
+#include "../include/profile.h"
+#include "../include/shm.h"
+#include "../include/thumbcache.h"
+
+// Reentrant replacement for strtok: returns the next token and advances
+// *cursor past it, or NULL at the end of the line
+static char *next_token(char **cursor)
+{
+    char *p = *cursor;
+    while (*p == ' ')
+        p++;
+    if (*p == '\0')
+    {
+        *cursor = p;
+        return NULL;
+    }
+    char *tok = p;
+    while (*p && *p != ' ')
+        p++;
+    if (*p)
+        *p++ = '\0';
+    *cursor = p;
+    return tok;
+}
+
+// Everything left on the line (like strtok(NULL, "")), or NULL if empty
+static char *rest_of_line(char **cursor)
+{
+    char *p = *cursor;
+    if (*p == '\0')
+        return NULL;
+    *cursor = p + strlen(p);
+    return p;
+}
+
+void session_init(Session *s, imgctx *ctx, ImageCache *cache)
+{
+    s->ctx = ctx;
+    s->img = NULL;
+    s->cache = cache;
+    s->thumbs = NULL;
+    s->memo = NULL;
+    s->history = NULL;
+    s->dirty_set = 0;
+    s->peer_fd = -1;
+}
+
+void session_free(Session *s)
+{
+    img_free(s->ctx, s->img);
+    s->img = NULL;
+}
+
+void session_print_menu(FILE *out)
+{
+    fprintf(out, "\n=== Image Utility ===\n");
+    fprintf(out, "Commands:\n");
+    fprintf(out, "  load <filename>         - Load a BMP file\n");
+    fprintf(out, "  save <filename> [mode]  - Save current image; mode palette, rle (8-bit if\n");
+    fprintf(out, "                            <= 256 colours) or quantize (always 8-bit, RLE8);\n");
+    fprintf(out, "                            add v5 for a BITMAPV5HEADER\n");
+    fprintf(out, "  fill <R> <G> <B> [x y w h] - Fill image (or a rectangle of it) with color\n");
+    fprintf(out, "  rotate <angle>          - Rotate by angle (degrees)\n");
+    fprintf(out, "  scale <factor>          - Scale by factor (e.g. 0.5, 2.0)\n");
+    fprintf(out, "  resize <w> <h>          - Resize to width/height\n");
+    fprintf(out, "  crop <x> <y> <w> <h>    - Crop region\n");
+    fprintf(out, "  brightness <delta>      - Add delta (-255..255) to every channel\n");
+    fprintf(out, "  contrast <factor>       - Scale contrast around mid-gray (e.g. 1.2)\n");
+    fprintf(out, "  gamma <value>           - Gamma correction (> 1 brightens)\n");
+    fprintf(out, "  levels <lo> <hi> [olo ohi] - Map input range lo..hi to olo..ohi\n");
+    fprintf(out, "  adjust <op> <args> ...  - Chain the four above in a single pass\n");
+    fprintf(out, "  grayscale               - Convert to shades of gray\n");
+    fprintf(out, "  blur <radius>           - Box blur over a (2r+1)^2 square\n");
+    fprintf(out, "  gaussian <sigma>        - Gaussian blur\n");
+    fprintf(out, "  sharpen <sigma> <amount> [threshold] - Unsharp mask\n");
+    fprintf(out, "  overlay <file> <x> <y> [opacity] - Draw a BMP over the image (opacity 0..1)\n");
+    fprintf(out, "  embed <message>         - Hide text inside image\n");
+    fprintf(out, "  extract                 - Recover hidden text from image\n");
+    fprintf(out, "  thumb <file> <max-side> - Load a cached thumbnail of a BMP file\n");
+    fprintf(out, "  shm-export              - Share image in memory with other processes\n");
+    fprintf(out, "  shm-import <path>       - Map an image shared by another process\n");
+    fprintf(out, "  undo / redo             - Step back or forward through image changes\n");
+    fprintf(out, "  stats-image [hist]      - Show per-channel statistics (and histograms)\n");
+    fprintf(out, "  stats [on|off|reset]    - Show per-operation timing and memory\n");
+    fprintf(out, "  exit                    - Quit program\n");
+    fprintf(out, "======================\n");
+}
+
+// Replaces the current image with a new result
+static void replace_image(Session *s, BMPImage *img)
+{
+    img_free(s->ctx, s->img);
+    s->img = img;
+}
+
+// Runs a transform of the current image through the session's result cache
+static img_status transform(Session *s, MemoOpKind kind, const int *args, double value, BMPImage **out)
+{
+    MemoOp op;
+    memset(&op, 0, sizeof(op));
+    op.kind = kind;
+    if (args)
+        memcpy(op.args, args, sizeof(op.args));
+    op.value = value;
+    return memo_apply(s->memo, s->ctx, s->img, &op, out, NULL);
+}
+
+// Each handler parses its arguments from *cursor and reports to out
+
+static int cmd_exit(Session *s, char **cursor, FILE *out)
+{
+    (void)s;
+    (void)cursor;
+    (void)out;
+    return 1;
+}
+
+//For help we print the menu
+static int cmd_help(Session *s, char **cursor, FILE *out)
+{
+    (void)s;
+    (void)cursor;
+    session_print_menu(out);
+    return 0;
+}
+
+//Per-operation instrumentation
+static int cmd_stats(Session *s, char **cursor, FILE *out)
+{
+    char *arg = next_token(cursor);
+    if (!arg)
+    {
+        prof_print_table(out);
+        if (s->cache)
+        {
+            uint64_t hits, misses;
+            size_t bytes;
+            imgcache_stats(s->cache, &hits, &misses, &bytes);
+            fprintf(out, "image cache: %llu hits, %llu misses, %.1f MiB held\n",
+                    (unsigned long long)hits, (unsigned long long)misses, bytes / 1048576.0);
+        }
+        if (s->thumbs)
+        {
+            uint64_t hits, misses;
+            size_t bytes, entries;
+            thumbcache_stats(s->thumbs, &hits, &misses, &bytes, &entries);
+            fprintf(out, "thumbnail cache: %llu hits, %llu misses, %zu thumbnails, %.1f MiB on disk\n",
+                    (unsigned long long)hits, (unsigned long long)misses, entries, bytes / 1048576.0);
+        }
+        if (s->memo)
+        {
+            uint64_t hits, disk_hits, misses;
+            size_t bytes;
+            memo_stats(s->memo, &hits, &disk_hits, &misses, &bytes);
+            fprintf(out, "result cache: %llu hits (%llu from disk), %llu misses, %.1f MiB held\n",
+                    (unsigned long long)(hits + disk_hits), (unsigned long long)disk_hits,
+                    (unsigned long long)misses, bytes / 1048576.0);
+        }
+        if (s->history)
+        {
+            int undo, redo;
+            size_t bytes;
+            history_stats(s->history, &undo, &redo, &bytes);
+            fprintf(out, "history: %d undo, %d redo steps, %.1f MiB held\n", undo, redo, bytes / 1048576.0);
+        }
+    }
+    else if (s->peer_fd >= 0 && (strcmp(arg, "on") == 0 || strcmp(arg, "off") == 0 ||
+                                 strcmp(arg, "reset") == 0))
+    {
+        // The counters are process-wide; one client must not change them for all
+        fprintf(out, "Profiling is shared by all clients; set IMAGETOOL_STATS when starting the server.\n");
+    }
+    else if (strcmp(arg, "on") == 0)
+    {
+        prof_enable(1);
+        fprintf(out, "Profiling enabled.\n");
+    }
+    else if (strcmp(arg, "off") == 0)
+    {
+        prof_enable(0);
+        fprintf(out, "Profiling disabled.\n");
+    }
+    else if (strcmp(arg, "reset") == 0)
+    {
+        prof_reset();
+        fprintf(out, "Statistics cleared.\n");
+    }
+    else
+    {
+        fprintf(out, "Usage: stats [on|off|reset]\n");
+    }
+    return 0;
+}
+
+//If the user wants to load the image
+static int cmd_load(Session *s, char **cursor, FILE *out)
+{
+    //we get the file name
+    char *fname = next_token(cursor);
+    if (!fname)
+    {
+        fprintf(out, "Usage: load <filename>\n");
+        return 0;
+    }
+
+    //We load the image, through the cache when the session has one
+    BMPImage *tmp = NULL;
+    img_status st = s->cache ? imgcache_load(s->cache, s->ctx, fname, &tmp)
+                             : img_load(s->ctx, fname, &tmp);
+    if (st != IMG_OK)
+    {
+        fprintf(out, "Failed to load %s: %s\n", fname, img_ctx_error(s->ctx));
+    }
+    else
+    {
+        //We replace the previous image
+        replace_image(s, tmp);
+
+        //Print for a success
+        fprintf(out, "Loaded %s (%dx%d, %d bpp)\n",
+                fname, s->img->dib.biWidth, s->img->dib.biHeight, s->img->dib.biBitCount);
+    }
+    return 0;
+}
+
+//If the user wants to save the image
+static int cmd_save(Session *s, char **cursor, FILE *out)
+{
+    char *fname = next_token(cursor);
+    char *mode;
+    int flags = 0, bad = 0;
+    while ((mode = next_token(cursor)) != NULL)
+    {
+        if (strcmp(mode, "palette") == 0)
+            flags |= IMG_SAVE_PALETTE;
+        else if (strcmp(mode, "rle") == 0)
+            flags |= IMG_SAVE_PALETTE | IMG_SAVE_RLE;
+        else if (strcmp(mode, "quantize") == 0)
+            flags |= IMG_SAVE_QUANTIZE | IMG_SAVE_RLE;
+        else if (strcmp(mode, "v5") == 0)
+            flags |= IMG_SAVE_V5;
+        else
+            bad = 1;
+    }
+    if (!fname || bad)
+    {
+        fprintf(out, "Usage: save <filename> [palette|rle|quantize] [v5]\n");
+        return 0;
+    }
+    if (img_save_ex(s->ctx, fname, s->img, flags) == IMG_OK)
+        fprintf(out, "Saved image to %s\n", fname);
+    else
+        fprintf(out, "Failed to save image: %s\n", img_ctx_error(s->ctx));
+    return 0;
+}
+
+//Filling the picture (or a rectangle of it) with color described by the user
+static int cmd_fill(Session *s, char **cursor, FILE *out)
+{
+    char *r = next_token(cursor);
+    char *g = next_token(cursor);
+    char *b = next_token(cursor);
+    char *rect[4];
+    int n = 0;
+    while (n < 4 && (rect[n] = next_token(cursor)) != NULL)
+        n++;
+    if (!r || !g || !b || (n != 0 && n != 4))
+    {
+        fprintf(out, "Usage: fill <R> <G> <B> [x y w h]\n");
+        return 0;
+    }
+    unsigned char color[3];
+    color[0] = (unsigned char)atoi(r);
+    color[1] = (unsigned char)atoi(g);
+    color[2] = (unsigned char)atoi(b);
+    img_status st;
+    if (n == 4)
+    {
+        for (int i = 0; i < 4; i++)
+            s->dirty[i] = atoi(rect[i]);
+        s->dirty_set = 1;
+        st = img_fill_rect(s->ctx, s->img, color, s->dirty[0], s->dirty[1], s->dirty[2], s->dirty[3]);
+    }
+    else
+    {
+        st = img_fill(s->ctx, s->img, color);
+    }
+    if (st == IMG_OK)
+        fprintf(out, "Image filled with color (%d, %d, %d).\n", color[0], color[1], color[2]);
+    else
+        fprintf(out, "Fill failed: %s\n", img_ctx_error(s->ctx));
+    return 0;
+}
+
+//If the user prompted to rotate
+static int cmd_rotate(Session *s, char **cursor, FILE *out)
+{
+    char *ang = next_token(cursor);
+    if (!ang)
+    {
+        fprintf(out, "Usage: rotate <angle>\n");
+        return 0;
+    }
+    double angle = atof(ang);
+    BMPImage *rot = NULL;
+    if (transform(s, MEMO_ROTATE, NULL, angle, &rot) == IMG_OK)
+    {
+        replace_image(s, rot);
+        fprintf(out, "Rotated image by %.2f degrees.\n", angle);
+    }
+    else
+    {
+        fprintf(out, "Rotation failed: %s\n", img_ctx_error(s->ctx));
+    }
+    return 0;
+}
+
+//Scaling the image
+static int cmd_scale(Session *s, char **cursor, FILE *out)
+{
+    char *fac = next_token(cursor);
+    if (!fac)
+    {
+        fprintf(out, "Usage: scale <factor>\n");
+        return 0;
+    }
+    double factor = atof(fac);
+    if (factor <= 0)
+    {
+        fprintf(out, "Scale factor must be > 0.\n");
+        return 0;
+    }
+    BMPImage *sc = NULL;
+    if (transform(s, MEMO_SCALE, NULL, factor, &sc) == IMG_OK)
+    {
+        replace_image(s, sc);
+        fprintf(out, "Scaled image by %.2fx.\n", factor);
+    }
+    else
+    {
+        fprintf(out, "Scaling failed: %s\n", img_ctx_error(s->ctx));
+    }
+    return 0;
+}
+
+static int cmd_resize(Session *s, char **cursor, FILE *out)
+{
+    char *w = next_token(cursor);
+    char *h = next_token(cursor);
+    if (!w || !h)
+    {
+        fprintf(out, "Usage: resize <w> <h>\n");
+        return 0;
+    }
+    int new_w = atoi(w), new_h = atoi(h);
+    int args[4] = {new_w, new_h, 0, 0};
+    BMPImage *rsz = NULL;
+    if (transform(s, MEMO_RESIZE, args, 0.0, &rsz) == IMG_OK)
+    {
+        replace_image(s, rsz);
+        fprintf(out, "Resized image to %dx%d.\n", new_w, new_h);
+    }
+    else
+    {
+        fprintf(out, "Resize failed: %s\n", img_ctx_error(s->ctx));
+    }
+    return 0;
+}
+
+static int cmd_crop(Session *s, char **cursor, FILE *out)
+{
+    char *sx = next_token(cursor);
+    char *sy = next_token(cursor);
+    char *sw = next_token(cursor);
+    char *sh = next_token(cursor);
+    if (!sx || !sy || !sw || !sh)
+    {
+        fprintf(out, "Usage: crop <x> <y> <w> <h>\n");
+        return 0;
+    }
+    int x = atoi(sx), y = atoi(sy), w = atoi(sw), h = atoi(sh);
+    int args[4] = {x, y, w, h};
+    BMPImage *cr = NULL;
+    if (transform(s, MEMO_CROP, args, 0.0, &cr) == IMG_OK)
+    {
+        replace_image(s, cr);
+        fprintf(out, "Cropped to region (%d,%d,%d,%d).\n", x, y, w, h);
+    }
+    else
+    {
+        fprintf(out, "Crop failed: %s\n", img_ctx_error(s->ctx));
+    }
+    return 0;
+}
+
+// Adds one tone adjustment named op, with its arguments from *cursor, to lut.
+// Returns 0 on success, -1 on a bad name or missing arguments.
+static int parse_adjustment(const char *op, char **cursor, img_lut *lut)
+{
+    char *a = next_token(cursor);
+    if (!a)
+        return -1;
+    if (strcmp(op, "brightness") == 0)
+    {
+        img_lut_brightness(lut, atoi(a));
+    }
+    else if (strcmp(op, "contrast") == 0)
+    {
+        img_lut_contrast(lut, atof(a));
+    }
+    else if (strcmp(op, "gamma") == 0)
+    {
+        if (atof(a) <= 0)
+            return -1;
+        img_lut_gamma(lut, atof(a));
+    }
+    else if (strcmp(op, "levels") == 0)
+    {
+        char *b = next_token(cursor);
+        if (!b)
+            return -1;
+        // Optional output range, 0..255 when left out
+        char *save = *cursor;
+        char *c = next_token(cursor);
+        char *d = c ? next_token(cursor) : NULL;
+        if (!c || !d || !strchr("0123456789", c[0]))
+        {
+            *cursor = save;
+            img_lut_levels(lut, atoi(a), atoi(b), 0, 255);
+        }
+        else
+        {
+            img_lut_levels(lut, atoi(a), atoi(b), atoi(c), atoi(d));
+        }
+    }
+    else
+    {
+        return -1;
+    }
+    return 0;
+}
+
+static void apply_tone(Session *s, const img_lut *lut, FILE *out)
+{
+    if (img_apply_lut(s->ctx, s->img, lut) == IMG_OK)
+        fprintf(out, "Tone adjusted.\n");
+    else
+        fprintf(out, "Adjustment failed: %s\n", img_ctx_error(s->ctx));
+}
+
+//brightness, contrast, gamma and levels share one handler per name
+static int cmd_tone(Session *s, const char *op, const char *usage, char **cursor, FILE *out)
+{
+    img_lut lut;
+    img_lut_identity(&lut);
+    if (parse_adjustment(op, cursor, &lut) != 0)
+    {
+        fprintf(out, "Usage: %s\n", usage);
+        return 0;
+    }
+    apply_tone(s, &lut, out);
+    return 0;
+}
+
+static int cmd_brightness(Session *s, char **cursor, FILE *out)
+{
+    return cmd_tone(s, "brightness", "brightness <delta>", cursor, out);
+}
+
+static int cmd_contrast(Session *s, char **cursor, FILE *out)
+{
+    return cmd_tone(s, "contrast", "contrast <factor>", cursor, out);
+}
+
+static int cmd_gamma(Session *s, char **cursor, FILE *out)
+{
+    return cmd_tone(s, "gamma", "gamma <value>", cursor, out);
+}
+
+static int cmd_levels(Session *s, char **cursor, FILE *out)
+{
+    return cmd_tone(s, "levels", "levels <lo> <hi> [olo ohi]", cursor, out);
+}
+
+//Several adjustments composed into one table, e.g. "adjust brightness 10 gamma 1.2"
+static int cmd_adjust(Session *s, char **cursor, FILE *out)
+{
+    img_lut lut;
+    img_lut_identity(&lut);
+    int count = 0;
+    char *op;
+    while ((op = next_token(cursor)) != NULL)
+    {
+        if (parse_adjustment(op, cursor, &lut) != 0)
+        {
+            count = 0;
+            break;
+        }
+        count++;
+    }
+    if (count == 0)
+    {
+        fprintf(out, "Usage: adjust <brightness|contrast|gamma|levels> <args> ...\n");
+        return 0;
+    }
+    apply_tone(s, &lut, out);
+    return 0;
+}
+
+static int cmd_grayscale(Session *s, char **cursor, FILE *out)
+{
+    (void)cursor;
+    if (img_grayscale(s->ctx, s->img) == IMG_OK)
+        fprintf(out, "Converted to grayscale.\n");
+    else
+        fprintf(out, "Grayscale failed: %s\n", img_ctx_error(s->ctx));
+    return 0;
+}
+
+// Replaces the current image with a filter result or reports the failure
+static void finish_filter(Session *s, img_status st, BMPImage *result, const char *done, FILE *out)
+{
+    if (st == IMG_OK)
+    {
+        replace_image(s, result);
+        fprintf(out, "%s\n", done);
+    }
+    else
+    {
+        fprintf(out, "Filter failed: %s\n", img_ctx_error(s->ctx));
+    }
+}
+
+static int cmd_blur(Session *s, char **cursor, FILE *out)
+{
+    char *rad = next_token(cursor);
+    if (!rad)
+    {
+        fprintf(out, "Usage: blur <radius>\n");
+        return 0;
+    }
+    BMPImage *res = NULL;
+    img_status st = img_box_blur(s->ctx, s->img, atoi(rad), &res);
+    finish_filter(s, st, res, "Box blur applied.", out);
+    return 0;
+}
+
+static int cmd_gaussian(Session *s, char **cursor, FILE *out)
+{
+    char *sig = next_token(cursor);
+    if (!sig)
+    {
+        fprintf(out, "Usage: gaussian <sigma>\n");
+        return 0;
+    }
+    BMPImage *res = NULL;
+    img_status st = img_gaussian_blur(s->ctx, s->img, atof(sig), &res);
+    finish_filter(s, st, res, "Gaussian blur applied.", out);
+    return 0;
+}
+
+static int cmd_sharpen(Session *s, char **cursor, FILE *out)
+{
+    char *sig = next_token(cursor);
+    char *amt = next_token(cursor);
+    char *thr = next_token(cursor);
+    if (!sig || !amt)
+    {
+        fprintf(out, "Usage: sharpen <sigma> <amount> [threshold]\n");
+        return 0;
+    }
+    BMPImage *res = NULL;
+    img_status st = img_unsharp_mask(s->ctx, s->img, atof(sig), atof(amt), thr ? atoi(thr) : 0, &res);
+    finish_filter(s, st, res, "Sharpened image.", out);
+    return 0;
+}
+
+//Draws another BMP file over the current image, e.g. a watermark
+static int cmd_overlay(Session *s, char **cursor, FILE *out)
+{
+    char *fname = next_token(cursor);
+    char *xs = next_token(cursor);
+    char *ys = next_token(cursor);
+    char *ops = next_token(cursor);
+    if (!fname || !xs || !ys)
+    {
+        fprintf(out, "Usage: overlay <file> <x> <y> [opacity 0..1]\n");
+        return 0;
+    }
+    double opacity = ops ? atof(ops) : 1.0;
+    if (opacity < 0.0 || opacity > 1.0)
+    {
+        fprintf(out, "Opacity must be between 0 and 1.\n");
+        return 0;
+    }
+
+    // Repeated overlays of the same file come from the image cache
+    BMPImage *top = NULL;
+    img_status st = s->cache ? imgcache_load(s->cache, s->ctx, fname, &top)
+                             : img_load(s->ctx, fname, &top);
+    if (st == IMG_OK)
+        st = img_overlay(s->ctx, s->img, top, atoi(xs), atoi(ys), (int)(opacity * 255.0 + 0.5));
+    if (st == IMG_OK)
+        fprintf(out, "Overlaid %s at (%d,%d).\n", fname, atoi(xs), atoi(ys));
+    else
+        fprintf(out, "Overlay failed: %s\n", img_ctx_error(s->ctx));
+    img_free(s->ctx, top);
+    return 0;
+}
+
+static int cmd_embed(Session *s, char **cursor, FILE *out)
+{
+    char *msg = rest_of_line(cursor);
+    if (!msg)
+    {
+        fprintf(out, "Usage: embed <message>\n");
+        return 0;
+    }
+    if (img_embed(s->ctx, s->img, msg, 0) == IMG_OK)
+        fprintf(out, "Message embedded.\n");
+    else
+        fprintf(out, "Failed to embed message: %s\n", img_ctx_error(s->ctx));
+    return 0;
+}
+
+static int cmd_extract(Session *s, char **cursor, FILE *out)
+{
+    (void)cursor;
+    char *msg = NULL;
+    if (img_extract(s->ctx, s->img, 0, &msg) == IMG_OK)
+    {
+        fprintf(out, "Extracted message: \"%s\"\n", msg);
+        img_free_message(s->ctx, msg);
+    }
+    else
+    {
+        fprintf(out, "No message found.\n");
+    }
+    return 0;
+}
+
+//Content statistics of the current image
+static int cmd_stats_image(Session *s, char **cursor, FILE *out)
+{
+    char *arg = next_token(cursor);
+    int hist = arg && strcmp(arg, "hist") == 0;
+    if (arg && !hist)
+    {
+        fprintf(out, "Usage: stats-image [hist]\n");
+        return 0;
+    }
+    img_stats st;
+    if (img_compute_stats(s->ctx, s->img, &st) != IMG_OK)
+    {
+        fprintf(out, "Statistics failed: %s\n", img_ctx_error(s->ctx));
+        return 0;
+    }
+
+    //Printed in R, G, B (, A) order; stored as B, G, R (, A)
+    static const char *names[4] = {"blue", "green", "red", "alpha"};
+    static const int order[4] = {2, 1, 0, 3};
+    fprintf(out, "%llu pixels\n", (unsigned long long)st.pixels);
+    fprintf(out, "%-8s %5s %5s %9s %9s\n", "channel", "min", "max", "mean", "stddev");
+    for (int i = 0; i < st.channels; i++)
+    {
+        int c = order[i];
+        fprintf(out, "%-8s %5d %5d %9.3f %9.3f\n", names[c], st.min[c], st.max[c], st.mean[c], st.stddev[c]);
+    }
+    if (hist)
+    {
+        fprintf(out, "value %10s %10s %10s%s\n", "red", "green", "blue", st.channels == 4 ? "      alpha" : "");
+        for (int v = 0; v < 256; v++)
+        {
+            fprintf(out, "%5d %10llu %10llu %10llu", v, (unsigned long long)st.histogram[2][v],
+                    (unsigned long long)st.histogram[1][v], (unsigned long long)st.histogram[0][v]);
+            if (st.channels == 4)
+                fprintf(out, " %10llu", (unsigned long long)st.histogram[3][v]);
+            fprintf(out, "\n");
+        }
+    }
+    return 0;
+}
+
+//Small preview of a file, served from the thumbnail cache when possible
+static int cmd_thumb(Session *s, char **cursor, FILE *out)
+{
+    char *fname = next_token(cursor);
+    char *side = next_token(cursor);
+    if (!fname || !side || atoi(side) <= 0)
+    {
+        fprintf(out, "Usage: thumb <file> <max-side>\n");
+        return 0;
+    }
+    if (!s->thumbs)
+    {
+        fprintf(out, "No thumbnail cache in this session.\n");
+        return 0;
+    }
+    BMPImage *tmp = NULL;
+    int hit = 0;
+    if (thumbcache_get(s->thumbs, s->ctx, fname, atoi(side), &tmp, &hit) != IMG_OK)
+    {
+        fprintf(out, "Failed to make thumbnail of %s: %s\n", fname, img_ctx_error(s->ctx));
+        return 0;
+    }
+    replace_image(s, tmp);
+    fprintf(out, "Thumbnail of %s (%dx%d, %s)\n", fname, s->img->dib.biWidth, s->img->dib.biHeight,
+            hit ? "cached" : "generated");
+    return 0;
+}
+
+//Moving the image into shared memory so other processes can map it
+static int cmd_shm_export(Session *s, char **cursor, FILE *out)
+{
+    (void)cursor;
+    char path[64];
+    if (img_shm_export(s->ctx, s->img, NULL) != IMG_OK || img_shm_path(s->img, path, sizeof(path)) != 0)
+    {
+        fprintf(out, "Failed to share image: %s\n", img_ctx_error(s->ctx));
+        return 0;
+    }
+    fprintf(out, "Image shared at %s\n", path);
+
+    //A server client also gets the descriptor itself on its socket
+    if (s->peer_fd >= 0)
+    {
+        fflush(out);
+        if (img_shm_send_fd(s->peer_fd, s->img->mapping_fd, "FD\n") != 0)
+            fprintf(out, "Failed to send descriptor.\n");
+    }
+    return 0;
+}
+
+static int cmd_shm_import(Session *s, char **cursor, FILE *out)
+{
+    char *path = next_token(cursor);
+    if (!path)
+    {
+        fprintf(out, "Usage: shm-import <path>\n");
+        return 0;
+    }
+    BMPImage *tmp = NULL;
+    if (img_shm_open(s->ctx, path, &tmp) != IMG_OK)
+    {
+        fprintf(out, "Failed to map %s: %s\n", path, img_ctx_error(s->ctx));
+        return 0;
+    }
+    replace_image(s, tmp);
+    fprintf(out, "Mapped %s (%dx%d, %d bpp)\n",
+            path, s->img->dib.biWidth, s->img->dib.biHeight, s->img->dib.biBitCount);
+    return 0;
+}
+
+//undo and redo replace the image with another version from the history
+static int step_history(Session *s, img_status (*step)(History *, imgctx *, BMPImage **), const char *name,
+                        FILE *out)
+{
+    if (!s->history)
+    {
+        fprintf(out, "No history in this session.\n");
+        return 0;
+    }
+    BMPImage *tmp = NULL;
+    if (step(s->history, s->ctx, &tmp) != IMG_OK)
+    {
+        fprintf(out, "%s failed: %s\n", name, img_ctx_error(s->ctx));
+        return 0;
+    }
+    replace_image(s, tmp);
+    int undo, redo;
+    size_t bytes;
+    history_stats(s->history, &undo, &redo, &bytes);
+    fprintf(out, "%s done (%dx%d); %d undo, %d redo steps left.\n", name, s->img->dib.biWidth,
+            s->img->dib.biHeight, undo, redo);
+    return 0;
+}
+
+static int cmd_undo(Session *s, char **cursor, FILE *out)
+{
+    (void)cursor;
+    return step_history(s, history_undo, "Undo", out);
+}
+
+static int cmd_redo(Session *s, char **cursor, FILE *out)
+{
+    (void)cursor;
+    return step_history(s, history_redo, "Redo", out);
+}
+
+typedef struct {
+    const char *name;
+    int needs_image; // refuse to run without a loaded image
+    int records;     // may change the image: record a history version afterwards
+    int (*run)(Session *s, char **cursor, FILE *out);
+} Command;
+
+static const Command commands[] = {
+    {"exit", 0, 0, cmd_exit},
+    {"help", 0, 0, cmd_help},
+    {"stats", 0, 0, cmd_stats},
+    {"load", 0, 1, cmd_load},
+    {"save", 1, 0, cmd_save},
+    {"fill", 1, 1, cmd_fill},
+    {"rotate", 1, 1, cmd_rotate},
+    {"scale", 1, 1, cmd_scale},
+    {"resize", 1, 1, cmd_resize},
+    {"crop", 1, 1, cmd_crop},
+    {"brightness", 1, 1, cmd_brightness},
+    {"contrast", 1, 1, cmd_contrast},
+    {"gamma", 1, 1, cmd_gamma},
+    {"levels", 1, 1, cmd_levels},
+    {"adjust", 1, 1, cmd_adjust},
+    {"grayscale", 1, 1, cmd_grayscale},
+    {"blur", 1, 1, cmd_blur},
+    {"gaussian", 1, 1, cmd_gaussian},
+    {"sharpen", 1, 1, cmd_sharpen},
+    {"overlay", 1, 1, cmd_overlay},
+    {"embed", 1, 1, cmd_embed},
+    {"extract", 1, 0, cmd_extract},
+    {"undo", 0, 0, cmd_undo},
+    {"redo", 0, 0, cmd_redo},
+    {"stats-image", 1, 0, cmd_stats_image},
+    {"thumb", 0, 1, cmd_thumb},
+    {"shm-export", 1, 0, cmd_shm_export},
+    {"shm-import", 0, 1, cmd_shm_import},
+};
+
+// Adds the image to the history after a command that may have changed it.
+// A version that cannot be recorded would leave undo stepping to the wrong
+// state, so the history is cleared instead.
+static void record_history(Session *s, FILE *out)
+{
+    if (history_record(s->history, s->ctx, s->img, s->dirty_set ? s->dirty : NULL) != IMG_OK)
+    {
+        history_clear(s->history);
+        fprintf(out, "History cleared: %s\n", img_ctx_error(s->ctx));
+    }
+}
+
+int session_execute(Session *s, char *line, FILE *out)
+{
+    char *cursor = line;
+
+    //Now, what is the command that was entered
+    char *cmd = next_token(&cursor);
+    if (!cmd)
+        return 0;
+
+    for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++)
+    {
+        if (strcmp(cmd, commands[i].name) != 0)
+            continue;
+        if (commands[i].needs_image && !s->img)
+        {
+            fprintf(out, "No image loaded.\n");
+            return 0;
+        }
+        s->dirty_set = 0;
+        int rc = commands[i].run(s, &cursor, out);
+        if (commands[i].records && s->history && s->img)
+            record_history(s, out);
+        return rc;
+    }
+
+    fprintf(out, "Unknown command: %s\n", cmd);
+    session_print_menu(out);
+    return 0;
+}
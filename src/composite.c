@@ -0,0 +1,238 @@
+#include <string.h>
+#include "image_internal.h"
+#include "../include/threadpool.h"
+
+#ifdef IMG_SSE2
+#include <emmintrin.h>
+#endif
+
+// Source-over compositing in 8-bit fixed point:
+//   out = (src * a + dst * (255 - a)) / 255, rounded exactly,
+// where a is the source alpha (255 for 24-bit sources) scaled by the
+// opacity. A 32-bit destination's alpha becomes a + dst_a * (255 - a) / 255,
+// which is the same formula with 255 as the source value.
+
+// (v + 128) / 255 rounded, for v <= 255 * 255: (t + (t >> 8)) >> 8 with t = v + 128
+static unsigned char div255(int v)
+{
+    int t = v + 128;
+    return (unsigned char)((t + (t >> 8)) >> 8);
+}
+
+static unsigned char mix(int s, int d, int a)
+{
+    return div255(s * a + d * (255 - a));
+}
+
+typedef struct {
+    BMPImage *dst;
+    const BMPImage *src;
+    size_t dst_stride;
+    size_t src_stride;
+    int dst_bpp;
+    int src_bpp;
+    int dst_x;      // first destination column
+    int src_x;      // first source column
+    int dst_y;      // destination row of source row src_y0
+    int src_y0;
+    int flip;       // source rows run the other way from destination rows
+    int src_height;
+    int width;      // overlapping columns
+    int opacity;    // 0..255
+} OverlayJob;
+
+#ifdef IMG_SSE2
+// Blends 16 bytes at one alpha for every byte (24-bit onto 24-bit)
+static __m128i blend_bytes_sse2(__m128i s, __m128i d, __m128i a, __m128i inv)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi16(128);
+    __m128i lo = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(s, zero), a),
+                                             _mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), inv)), round);
+    __m128i hi = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(s, zero), a),
+                                             _mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), inv)), round);
+    lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+    hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+    return _mm_packus_epi16(lo, hi);
+}
+
+// Two BGRA pixels widened to 16 bits, with the alpha of each in all four lanes
+static __m128i spread_alpha(__m128i px16)
+{
+    px16 = _mm_shufflelo_epi16(px16, _MM_SHUFFLE(3, 3, 3, 3));
+    return _mm_shufflehi_epi16(px16, _MM_SHUFFLE(3, 3, 3, 3));
+}
+
+// 32-bit source onto 32-bit destination, 4 pixels at a time. Groups that
+// are fully opaque are copied and fully transparent ones skipped. Returns
+// the number of pixels done.
+static int blend_argb_sse2(unsigned char *d, const unsigned char *s, int width, int opacity)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i alpha_mask = _mm_set1_epi32((int)0xFF000000u);
+    const __m128i max = _mm_set1_epi16(255);
+    const __m128i round = _mm_set1_epi16(128);
+    const __m128i op = _mm_set1_epi16((short)opacity);
+    int x = 0;
+    for (; x + 4 <= width; x += 4)
+    {
+        __m128i sv = _mm_loadu_si128((const __m128i *)(s + 4 * x));
+        int opaque = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(sv, alpha_mask), alpha_mask)) == 0xFFFF;
+        if (opaque && opacity == 255)
+        {
+            _mm_storeu_si128((__m128i *)(d + 4 * x), sv);
+            continue;
+        }
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(sv, alpha_mask), zero)) == 0xFFFF)
+            continue;
+
+        __m128i dv = _mm_loadu_si128((const __m128i *)(d + 4 * x));
+        __m128i sb = _mm_or_si128(sv, alpha_mask); // alpha lane blends 255 over dst alpha
+        __m128i half[2];
+        for (int h = 0; h < 2; h++)
+        {
+            __m128i s16 = h ? _mm_unpackhi_epi8(sv, zero) : _mm_unpacklo_epi8(sv, zero);
+            __m128i b16 = h ? _mm_unpackhi_epi8(sb, zero) : _mm_unpacklo_epi8(sb, zero);
+            __m128i d16 = h ? _mm_unpackhi_epi8(dv, zero) : _mm_unpacklo_epi8(dv, zero);
+            // a = alpha * opacity / 255
+            __m128i a = _mm_add_epi16(_mm_mullo_epi16(spread_alpha(s16), op), round);
+            a = _mm_srli_epi16(_mm_add_epi16(a, _mm_srli_epi16(a, 8)), 8);
+            __m128i t = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(b16, a),
+                                                    _mm_mullo_epi16(d16, _mm_sub_epi16(max, a))), round);
+            half[h] = _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+        }
+        _mm_storeu_si128((__m128i *)(d + 4 * x), _mm_packus_epi16(half[0], half[1]));
+    }
+    return x;
+}
+#endif
+
+static void overlay_row(const OverlayJob *job, unsigned char *d, const unsigned char *s)
+{
+    int dbpp = job->dst_bpp;
+    int sbpp = job->src_bpp;
+    int width = job->width;
+    int op = job->opacity;
+    int x = 0;
+
+    if (sbpp == 3)
+    {
+        // Constant alpha: a straight copy or a uniform blend of every byte
+        if (dbpp == 3 && op == 255)
+        {
+            memcpy(d, s, (size_t)width * 3);
+            return;
+        }
+#ifdef IMG_SSE2
+        if (dbpp == 3)
+        {
+            __m128i a = _mm_set1_epi16((short)op);
+            __m128i inv = _mm_set1_epi16((short)(255 - op));
+            for (; x + 16 <= width * 3; x += 16)
+            {
+                __m128i sv = _mm_loadu_si128((const __m128i *)(s + x));
+                __m128i dv = _mm_loadu_si128((const __m128i *)(d + x));
+                _mm_storeu_si128((__m128i *)(d + x), blend_bytes_sse2(sv, dv, a, inv));
+            }
+            for (; x < width * 3; x++)
+                d[x] = mix(s[x], d[x], op);
+            return;
+        }
+#endif
+        for (; x < width; x++, d += dbpp, s += 3)
+        {
+            d[0] = mix(s[0], d[0], op);
+            d[1] = mix(s[1], d[1], op);
+            d[2] = mix(s[2], d[2], op);
+            if (dbpp == 4)
+                d[3] = mix(255, d[3], op);
+        }
+        return;
+    }
+
+#ifdef IMG_SSE2
+    if (dbpp == 4)
+    {
+        x = blend_argb_sse2(d, s, width, op);
+        d += 4 * x;
+        s += 4 * x;
+    }
+#endif
+    for (; x < width; x++, d += dbpp, s += 4)
+    {
+        int a = (op == 255) ? s[3] : div255(s[3] * op);
+        if (a == 0)
+            continue;
+        d[0] = mix(s[0], d[0], a);
+        d[1] = mix(s[1], d[1], a);
+        d[2] = mix(s[2], d[2], a);
+        if (dbpp == 4)
+            d[3] = mix(255, d[3], a);
+    }
+}
+
+static void overlay_rows(void *arg, int begin, int end)
+{
+    const OverlayJob *job = (const OverlayJob *)arg;
+    for (int i = begin; i < end; i++)
+    {
+        int sy = job->src_y0 + i;
+        int src_row = job->flip ? job->src_height - 1 - sy : sy;
+        unsigned char *d = job->dst->data + (size_t)(job->dst_y + i) * job->dst_stride + (size_t)job->dst_x * job->dst_bpp;
+        const unsigned char *s = job->src->data + (size_t)src_row * job->src_stride + (size_t)job->src_x * job->src_bpp;
+        overlay_row(job, d, s);
+    }
+}
+
+static int is_blendable(const BMPImage *img)
+{
+    return (img->dib.biBitCount == 24 || img->dib.biBitCount == 32) && img->dib.biCompression == 0;
+}
+
+img_status img_overlay(imgctx *ctx, BMPImage *dst, const BMPImage *src, int x, int y, int opacity)
+{
+    if (!ctx || !dst || !dst->data || !src || !src->data)
+        return ctx ? img_fail(ctx, IMG_ERR_ARG, "img_overlay: missing argument") : IMG_ERR_ARG;
+    if (!is_blendable(dst) || !is_blendable(src))
+        return img_fail(ctx, IMG_ERR_UNSUPPORTED, "overlay: only 24-bit or 32-bit BMP supported");
+    if (opacity < 0 || opacity > 255)
+        return img_fail(ctx, IMG_ERR_ARG, "overlay: opacity must be 0..255");
+
+    ProfScope scope;
+    prof_begin(&scope, PROF_OVERLAY);
+
+    // Clip the source rectangle to the destination
+    int64_t x0 = x > 0 ? x : 0;
+    int64_t y0 = y > 0 ? y : 0;
+    int64_t x1 = (int64_t)x + src->dib.biWidth;
+    int64_t y1 = (int64_t)y + img_height(src);
+    if (x1 > dst->dib.biWidth)
+        x1 = dst->dib.biWidth;
+    if (y1 > img_height(dst))
+        y1 = img_height(dst);
+
+    if (x1 > x0 && y1 > y0 && opacity > 0)
+    {
+        OverlayJob job;
+        job.dst = dst;
+        job.src = src;
+        job.dst_stride = img_row_size(dst->dib.biWidth, dst->dib.biBitCount);
+        job.src_stride = img_row_size(src->dib.biWidth, src->dib.biBitCount);
+        job.dst_bpp = dst->dib.biBitCount / 8;
+        job.src_bpp = src->dib.biBitCount / 8;
+        job.dst_x = (int)x0;
+        job.src_x = (int)(x0 - x);
+        job.dst_y = (int)y0;
+        job.src_y0 = (int)(y0 - y);
+        job.flip = (src->dib.biHeight < 0) != (dst->dib.biHeight < 0);
+        job.src_height = img_height(src);
+        job.width = (int)(x1 - x0);
+        job.opacity = opacity;
+        tp_parallel_for(ctx->pool, (int)(y1 - y0), ROW_GRAIN, overlay_rows, &job);
+        dst->hash = 0;
+        prof_pixels(PROF_OVERLAY, (uint64_t)(x1 - x0) * (uint64_t)(y1 - y0));
+    }
+
+    prof_end(&scope);
+    return IMG_OK;
+}
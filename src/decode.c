@@ -0,0 +1,445 @@
+#include <stdlib.h>
+#include <string.h>
+#include "image_internal.h"
+#include "../include/threadpool.h"
+
+// Pixel formats other than uncompressed 24/32-bit are expanded to 24-bit
+// (32-bit when they carry alpha) while loading, so the kernels only ever
+// see the working formats. Palettized rows go through lookup tables that
+// turn a whole source byte into its 1, 2 or 8 pixels; RLE data is first
+// decoded into one palette index per byte, writing each run with a single
+// memset, and then expanded like 8-bit rows. 16/32-bit bit fields are
+// widened per channel through tables.
+
+#define BI_RGB 0
+#define BI_RLE8 1
+#define BI_RLE4 2
+#define BI_BITFIELDS 3
+#define BI_ALPHABITFIELDS 6
+
+// Header sizes that carry the channel masks (BITMAPV2/V3 and up)
+#define DIB_RGB_MASKS 52
+#define DIB_ALPHA_MASK 56
+
+// Palette entries as stored in the file: blue, green, red, reserved. The
+// fourth byte lets a pixel be written with one 4-byte store.
+typedef struct {
+    unsigned char bgr[256][4];
+} Palette;
+
+// One channel of a bit-field pixel
+typedef struct {
+    uint32_t mask;
+    int shift;
+    int bits;
+    unsigned char widen[256]; // value -> 8 bits, for fields of up to 8 bits
+} Channel;
+
+typedef struct {
+    const unsigned char *src;
+    size_t src_stride;
+    unsigned char *dst;
+    size_t dst_stride;
+    int width;
+    int bits;                         // 1, 4 or 8 (indices), 16 or 32
+    int out_bpp;                      // 3, or 4 for bit fields with alpha
+    const Channel *ch;                // blue, green, red, alpha (bit fields)
+    const Palette *pal;
+    const unsigned char (*nibbles)[8]; // 4-bit: byte -> 2 pixels
+    const unsigned char (*bits1)[24];  // 1-bit: byte -> 8 pixels
+} ExpandJob;
+
+static void expand8(const unsigned char *s, unsigned char *d, int width, const Palette *pal)
+{
+    int x = 0;
+    for (; x + 1 < width; x++, d += 3)
+        memcpy(d, pal->bgr[s[x]], 4); // the fourth byte is overwritten next
+    if (x < width)
+        memcpy(d, pal->bgr[s[x]], 3);
+}
+
+static void expand_row(const ExpandJob *job, const unsigned char *s, unsigned char *d)
+{
+    int width = job->width;
+    int x = 0;
+    switch (job->bits)
+    {
+    case 8:
+        expand8(s, d, width, job->pal);
+        return;
+    case 4:
+        for (; x + 2 <= width; x += 2, d += 6)
+            memcpy(d, job->nibbles[*s++], 6);
+        if (x < width)
+            memcpy(d, job->pal->bgr[*s >> 4], 3);
+        return;
+    case 1:
+        for (; x + 8 <= width; x += 8, d += 24)
+            memcpy(d, job->bits1[*s++], 24);
+        for (int bit = 7; x < width; x++, bit--, d += 3)
+            memcpy(d, job->pal->bgr[(*s >> bit) & 1], 3);
+        return;
+    default:
+        // Bit fields, 2 or 4 bytes per pixel
+        for (; x < width; x++, d += job->out_bpp)
+        {
+            uint32_t v = (uint32_t)s[0] | (uint32_t)s[1] << 8;
+            if (job->bits == 32)
+            {
+                v |= (uint32_t)s[2] << 16 | (uint32_t)s[3] << 24;
+                s += 4;
+            }
+            else
+            {
+                s += 2;
+            }
+            for (int c = 0; c < job->out_bpp; c++)
+            {
+                const Channel *ch = &job->ch[c];
+                uint32_t f = (v & ch->mask) >> ch->shift;
+                d[c] = (ch->bits > 8) ? (unsigned char)(f >> (ch->bits - 8)) : ch->widen[f];
+            }
+        }
+        return;
+    }
+}
+
+static void expand_rows(void *arg, int begin, int end)
+{
+    const ExpandJob *job = (const ExpandJob *)arg;
+    size_t bytes = (size_t)job->width * job->out_bpp;
+    for (int y = begin; y < end; y++)
+    {
+        unsigned char *d = job->dst + (size_t)y * job->dst_stride;
+        expand_row(job, job->src + (size_t)y * job->src_stride, d);
+        memset(d + bytes, 0, job->dst_stride - bytes);
+    }
+}
+
+// Column after moving n pixels right from x, held at width: runs past the
+// end of a row are clipped, however many of them a stream holds
+static int rle_advance(int x, int n, int width)
+{
+    return (n < width - x) ? x + n : width;
+}
+
+// Decodes RLE8/RLE4 data into one index per byte, width bytes per row in
+// stored order. Pixels the stream skips (deltas, early ends of line) keep
+// index 0. Damaged streams stop decoding where they go wrong.
+static void decode_rle(const unsigned char *p, size_t size, int rle4, unsigned char *idx, int width, int height)
+{
+    const unsigned char *end = p + size;
+    int x = 0, y = 0;
+    while (p + 2 <= end && y < height)
+    {
+        int n = p[0];
+        int v = p[1];
+        p += 2;
+        unsigned char *row = idx + (size_t)y * width;
+        if (n > 0)
+        {
+            // Encoded run of n pixels
+            int count = rle_advance(x, n, width) - x;
+            if (!rle4 || (v >> 4) == (v & 15))
+            {
+                memset(row + x, rle4 ? (v & 15) : v, (size_t)count);
+            }
+            else
+            {
+                for (int i = 0; i < count; i++)
+                    row[x + i] = (unsigned char)((i & 1) ? (v & 15) : (v >> 4));
+            }
+            x += count;
+        }
+        else if (v == 0)
+        {
+            // End of line
+            x = 0;
+            y++;
+        }
+        else if (v == 1)
+        {
+            // End of bitmap
+            break;
+        }
+        else if (v == 2)
+        {
+            // Delta: move right and up
+            if (p + 2 > end)
+                break;
+            x = rle_advance(x, p[0], width);
+            y += p[1];
+            p += 2;
+        }
+        else
+        {
+            // Absolute run of v literal pixels, padded to a 16-bit boundary
+            size_t bytes = rle4 ? ((size_t)v + 1) / 2 : (size_t)v;
+            if (p + bytes > end)
+                break;
+            int count = rle_advance(x, v, width) - x;
+            if (rle4)
+            {
+                for (int i = 0; i < count; i++)
+                    row[x + i] = (unsigned char)((i & 1) ? (p[i / 2] & 15) : (p[i / 2] >> 4));
+            }
+            else
+            {
+                memcpy(row + x, p, (size_t)count);
+            }
+            x += count;
+            p += (bytes + 1) & ~(size_t)1;
+        }
+    }
+}
+
+static img_status read_at(imgctx *ctx, const char *filename, FILE *file, long offset, void *buf, size_t size)
+{
+    if (fseek(file, offset, SEEK_SET) != 0)
+        return img_fail(ctx, IMG_ERR_FORMAT, "%s: bad pixel data offset", filename);
+    size_t got = fread(buf, 1, size, file);
+    prof_io(PROF_LOAD, got, 0);
+    if (got != size)
+        return img_fail(ctx, IMG_ERR_FORMAT, "%s: truncated pixel data", filename);
+    return IMG_OK;
+}
+
+static uint32_t read32(const unsigned char *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+// Reads the red, green, blue and alpha masks of a bit-field image. They
+// follow the 40 bytes of BITMAPINFOHEADER fields, inside the larger header
+// versions or right after a plain one. Returns 0 if they cannot be read.
+static int read_masks(FILE *file, const BMPImage *img, uint32_t masks[4])
+{
+    memset(masks, 0, 4 * sizeof(uint32_t));
+    if (img->dib.biCompression != BI_BITFIELDS && img->dib.biCompression != BI_ALPHABITFIELDS)
+    {
+        // 16-bit default layout is 555
+        masks[0] = 0x7C00;
+        masks[1] = 0x03E0;
+        masks[2] = 0x001F;
+        return 1;
+    }
+    int count = (img->dib.biSize >= DIB_ALPHA_MASK || img->dib.biCompression == BI_ALPHABITFIELDS) ? 4 : 3;
+    unsigned char m[16];
+    if (fseek(file, (long)(sizeof(BMPHeader) + sizeof(DIBHeader)), SEEK_SET) != 0 ||
+        fread(m, 4, (size_t)count, file) != (size_t)count)
+        return 0;
+    prof_io(PROF_LOAD, (uint64_t)count * 4, 0);
+    for (int i = 0; i < count; i++)
+        masks[i] = read32(m + 4 * i);
+    return 1;
+}
+
+// Sets up the widening of one mask; 0 when its bits are not contiguous
+static int make_channel(uint32_t mask, int pixel_bits, Channel *ch)
+{
+    memset(ch, 0, sizeof(*ch));
+    if (pixel_bits == 16)
+        mask &= 0xFFFF;
+    ch->mask = mask;
+    if (!mask)
+        return 1;
+    while (!((mask >> ch->shift) & 1))
+        ch->shift++;
+    while (ch->shift + ch->bits < 32 && ((mask >> (ch->shift + ch->bits)) & 1))
+        ch->bits++;
+    if ((mask >> ch->shift) != (0xFFFFFFFFu >> (32 - ch->bits)))
+        return 0;
+    if (ch->bits <= 8)
+    {
+        uint32_t top = (1u << ch->bits) - 1;
+        for (uint32_t v = 0; v <= top; v++)
+            ch->widen[v] = (unsigned char)((v * 255 + top / 2) / top);
+    }
+    return 1;
+}
+
+int img_plain_bitfields(FILE *file, BMPImage *img)
+{
+    uint32_t masks[4];
+    if (img->dib.biBitCount != 32 || !read_masks(file, img, masks))
+        return 0;
+    return masks[0] == 0x00FF0000 && masks[1] == 0x0000FF00 && masks[2] == 0x000000FF &&
+           (masks[3] == 0 || masks[3] == 0xFF000000);
+}
+
+static img_status read_palette(imgctx *ctx, const char *filename, FILE *file, const BMPImage *img, Palette *pal)
+{
+    uint32_t count = 1u << img->dib.biBitCount;
+    if (img->dib.biClrUsed && img->dib.biClrUsed < count)
+        count = img->dib.biClrUsed;
+    // Writers that leave biClrUsed at zero may still store a short palette
+    uint32_t start = (uint32_t)sizeof(BMPHeader) + img->dib.biSize;
+    if (img->header.bfOffBits >= start && (img->header.bfOffBits - start) / 4 < count)
+        count = (img->header.bfOffBits - start) / 4;
+    memset(pal, 0, sizeof(*pal)); // indices past the palette read as black
+    return read_at(ctx, filename, file, (long)start, pal->bgr, count * 4);
+}
+
+img_status img_decode_pixels(imgctx *ctx, const char *filename, FILE *file, BMPImage *img)
+{
+    int bits = img->dib.biBitCount;
+    uint32_t comp = img->dib.biCompression;
+    int width = img->dib.biWidth;
+    int height = img_height(img);
+
+    int rle = (comp == BI_RLE8 && bits == 8) || (comp == BI_RLE4 && bits == 4);
+    int plain = comp == BI_RGB && (bits == 1 || bits == 4 || bits == 8 || bits == 16);
+    int fields = (comp == BI_BITFIELDS || comp == BI_ALPHABITFIELDS) && (bits == 16 || bits == 32);
+    if (!rle && !plain && !fields)
+        return img_fail(ctx, IMG_ERR_UNSUPPORTED, "%s: %d-bit images with compression %u are not supported",
+                        filename, bits, (unsigned)comp);
+    if (width <= 0 || height <= 0 || img->dib.biSize < sizeof(DIBHeader) || (rle && img->dib.biHeight < 0))
+        return img_fail(ctx, IMG_ERR_FORMAT, "%s: invalid header", filename);
+
+    ExpandJob job;
+    memset(&job, 0, sizeof(job));
+    job.out_bpp = 3;
+    Palette *palette = NULL;
+    Channel ch[4]; // file order: red, green, blue, alpha
+    Channel bgra[4];
+    img_status st = IMG_OK;
+    if (bits <= 8)
+    {
+        palette = (Palette *)malloc(sizeof(Palette));
+        if (!palette)
+            return img_fail(ctx, IMG_ERR_NOMEM, "out of memory");
+        st = read_palette(ctx, filename, file, img, palette);
+    }
+    else
+    {
+        uint32_t masks[4];
+        if (!read_masks(file, img, masks))
+            return img_fail(ctx, IMG_ERR_FORMAT, "%s: truncated header", filename);
+        for (int c = 0; c < 4; c++)
+            if (!make_channel(masks[c], bits, &ch[c]))
+                return img_fail(ctx, IMG_ERR_UNSUPPORTED, "%s: bit field masks must be contiguous", filename);
+        if (ch[3].mask)
+            job.out_bpp = 4;
+        bgra[0] = ch[2];
+        bgra[1] = ch[1];
+        bgra[2] = ch[0];
+        bgra[3] = ch[3];
+        job.ch = bgra;
+    }
+
+    int out_bits = job.out_bpp * 8;
+    uint64_t out_size = (uint64_t)img_row_size(width, out_bits) * (uint64_t)height;
+    if (st == IMG_OK && out_size > 0xFFFFFFFFULL)
+        st = img_fail(ctx, IMG_ERR_UNSUPPORTED, "%s: image too large", filename);
+
+    // Encoded data: the stored rows, or the RLE stream (biSizeImage, or up
+    // to the end of the file when it is left at zero). A stream cut short
+    // by the end of the file decodes as far as it goes; the rest stays 0.
+    size_t raw_size;
+    if (rle)
+    {
+        raw_size = img->dib.biSizeImage;
+        long file_size = (fseek(file, 0, SEEK_END) == 0) ? ftell(file) : -1;
+        if (file_size >= 0)
+        {
+            size_t avail = (file_size > (long)img->header.bfOffBits) ? (size_t)(file_size - img->header.bfOffBits) : 0;
+            if (raw_size == 0 || raw_size > avail)
+                raw_size = avail;
+        }
+    }
+    else
+    {
+        uint64_t need = (uint64_t)img_row_size(width, bits) * (uint64_t)height;
+        if (need > 0xFFFFFFFFULL)
+            st = (st == IMG_OK) ? img_fail(ctx, IMG_ERR_UNSUPPORTED, "%s: image too large", filename) : st;
+        raw_size = (size_t)need;
+    }
+
+    unsigned char *raw = (st == IMG_OK) ? (unsigned char *)malloc(raw_size ? raw_size : 1) : NULL;
+    unsigned char *idx = NULL;
+    if (st == IMG_OK && !raw)
+        st = img_fail(ctx, IMG_ERR_NOMEM, "out of memory");
+    if (st == IMG_OK)
+        st = read_at(ctx, filename, file, (long)img->header.bfOffBits, raw, raw_size);
+
+    job.src = raw;
+    job.src_stride = img_row_size(width, bits);
+    job.bits = bits;
+    if (st == IMG_OK && rle)
+    {
+        idx = (unsigned char *)calloc((size_t)width * (size_t)height, 1);
+        if (!idx)
+        {
+            st = img_fail(ctx, IMG_ERR_NOMEM, "out of memory");
+        }
+        else
+        {
+            decode_rle(raw, raw_size, comp == BI_RLE4, idx, width, height);
+            job.src = idx;
+            job.src_stride = (size_t)width;
+            job.bits = 8;
+        }
+    }
+
+    // Byte-to-pixels tables for the packed index formats
+    unsigned char (*nibbles)[8] = NULL;
+    unsigned char (*bits1)[24] = NULL;
+    if (st == IMG_OK && job.bits == 4)
+    {
+        nibbles = (unsigned char(*)[8])malloc(256 * sizeof(*nibbles));
+        if (!nibbles)
+            st = img_fail(ctx, IMG_ERR_NOMEM, "out of memory");
+        for (int b = 0; nibbles && b < 256; b++)
+        {
+            memcpy(nibbles[b], palette->bgr[b >> 4], 3);
+            memcpy(nibbles[b] + 3, palette->bgr[b & 15], 3);
+        }
+    }
+    if (st == IMG_OK && job.bits == 1)
+    {
+        bits1 = (unsigned char(*)[24])malloc(256 * sizeof(*bits1));
+        if (!bits1)
+            st = img_fail(ctx, IMG_ERR_NOMEM, "out of memory");
+        for (int b = 0; bits1 && b < 256; b++)
+            for (int i = 0; i < 8; i++)
+                memcpy(bits1[b] + 3 * i, palette->bgr[(b >> (7 - i)) & 1], 3);
+    }
+
+    unsigned char *data = NULL;
+    if (st == IMG_OK)
+    {
+        data = (unsigned char *)img_alloc(ctx, (size_t)out_size);
+        if (!data)
+            st = img_fail(ctx, IMG_ERR_NOMEM, "out of memory allocating %llu bytes of pixels",
+                          (unsigned long long)out_size);
+    }
+    if (st == IMG_OK)
+    {
+        prof_alloc(PROF_LOAD, out_size);
+        job.dst = data;
+        job.dst_stride = img_row_size(width, out_bits);
+        job.width = width;
+        job.pal = palette;
+        job.nibbles = (const unsigned char(*)[8])nibbles;
+        job.bits1 = (const unsigned char(*)[24])bits1;
+        tp_parallel_for(ctx->pool, height, ROW_GRAIN, expand_rows, &job);
+
+        // The image is now plain 24/32-bit with a 40-byte header
+        img->data = data;
+        img->dib.biSize = sizeof(DIBHeader);
+        img->dib.biBitCount = (uint16_t)out_bits;
+        img->dib.biCompression = BI_RGB;
+        img->dib.biSizeImage = (uint32_t)out_size;
+        img->dib.biClrUsed = 0;
+        img->dib.biClrImportant = 0;
+        img->header.bfOffBits = sizeof(BMPHeader) + sizeof(DIBHeader);
+        img->header.bfSize = img->header.bfOffBits + img->dib.biSizeImage;
+    }
+
+    free(bits1);
+    free(nibbles);
+    free(idx);
+    free(raw);
+    free(palette);
+    return st;
+}
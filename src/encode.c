@@ -0,0 +1,620 @@
+#include <stdlib.h>
+#include <string.h>
+#include "image_internal.h"
+#include "../include/threadpool.h"
+
+// Compact output: 24/32-bit images are written as 8-bit palettized BMPs,
+// optionally RLE8 compressed. Images of at most 256 colours keep their
+// exact colours, found with a small hash set that gives up at the 257th;
+// other images are quantized with an octree when asked to. Pixels become
+// palette indices through the set or the tree, behind a per-band cache of
+// recent colours.
+
+#define BI_RLE8 1
+#define BI_BITFIELDS 3
+
+// BITMAPV5HEADER fields that follow the 40 bytes of DIBHeader
+#pragma pack(push, 1)
+typedef struct {
+    uint32_t masks[4]; // red, green, blue, alpha
+    uint32_t cs_type;
+    int32_t endpoints[9];
+    uint32_t gamma[3];
+    uint32_t intent;
+    uint32_t profile_data;
+    uint32_t profile_size;
+    uint32_t reserved;
+} V5Fields;
+#pragma pack(pop)
+
+#define LCS_SRGB 0x73524742 // 'sRGB'
+#define LCS_GM_IMAGES 4
+
+#define MAX_COLORS 256
+#define SET_SLOTS 1024           // power of two, well above MAX_COLORS
+#define SET_EMPTY 0
+#define SET_USED 0x80000000u     // marks a slot; colours use 24 bits
+#define COLOR_CACHE 4096         // direct-mapped entries per band
+
+static uint32_t pixel_color(const unsigned char *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16;
+}
+
+static uint32_t mix_color(uint32_t c)
+{
+    return c * 0x9E3779B1u;
+}
+
+// ---------------------------------------------------------------------------
+// Exact palette: open-addressing set of the colours in use
+// ---------------------------------------------------------------------------
+
+typedef struct {
+    uint32_t key[SET_SLOTS];
+    unsigned char index[SET_SLOTS];
+    int count;
+} ColorSet;
+
+// Slot holding c, or the empty slot where it would go
+static uint32_t set_probe(const ColorSet *set, uint32_t c)
+{
+    uint32_t key = c | SET_USED;
+    uint32_t i = mix_color(c) >> 22; // 10 bits
+    while (set->key[i] != key && set->key[i] != SET_EMPTY)
+        i = (i + 1) & (SET_SLOTS - 1);
+    return i;
+}
+
+// Adds c unless present; returns 0 when the set is already full
+static int set_insert(ColorSet *set, uint32_t c)
+{
+    uint32_t i = set_probe(set, c);
+    if (set->key[i] != SET_EMPTY)
+        return 1;
+    if (set->count == MAX_COLORS)
+        return 0;
+    set->key[i] = c | SET_USED;
+    set->index[i] = (unsigned char)set->count++;
+    return 1;
+}
+
+// Collects the colours of image into set. Returns 0 once a 257th colour
+// turns up, or when a 32-bit pixel is not fully opaque.
+static int count_colors(const BMPImage *image, ColorSet *set)
+{
+    int width = image->dib.biWidth;
+    int height = img_height(image);
+    int bpp = image->dib.biBitCount / 8;
+    size_t stride = img_row_size(width, image->dib.biBitCount);
+
+    memset(set, 0, sizeof(*set));
+    uint32_t last = SET_USED; // no colour yet
+    for (int y = 0; y < height; y++)
+    {
+        const unsigned char *p = image->data + (size_t)y * stride;
+        for (int x = 0; x < width; x++, p += bpp)
+        {
+            if (bpp == 4 && p[3] != 255)
+                return 0;
+            uint32_t c = pixel_color(p);
+            if (c == last) // flat areas skip the probe
+                continue;
+            if (!set_insert(set, c))
+                return 0;
+            last = c;
+        }
+    }
+    return 1;
+}
+
+// ---------------------------------------------------------------------------
+// Octree quantizer
+// ---------------------------------------------------------------------------
+
+#define OCT_DEPTH 8
+
+typedef struct {
+    uint64_t sum[3];
+    uint32_t count;
+    int32_t child[8];
+    int32_t next;      // next reducible node of the same level, or free node
+    int16_t index;     // palette index of a leaf
+    unsigned char leaf;
+} OctNode;
+
+typedef struct {
+    OctNode *nodes;
+    int used;
+    int cap;
+    int free_list;
+    int reducible[OCT_DEPTH];
+    int leaves;
+} Octree;
+
+static int child_slot(uint32_t c, int level)
+{
+    int shift = 7 - level;
+    return (int)(((c >> (16 + shift)) & 1) << 2 | ((c >> (8 + shift)) & 1) << 1 | ((c >> shift) & 1));
+}
+
+static int oct_new(Octree *t, int level)
+{
+    int n;
+    if (t->free_list >= 0)
+    {
+        n = t->free_list;
+        t->free_list = t->nodes[n].next;
+    }
+    else
+    {
+        if (t->used == t->cap)
+        {
+            int cap = t->cap ? t->cap * 2 : 1024;
+            OctNode *grown = (OctNode *)realloc(t->nodes, (size_t)cap * sizeof(OctNode));
+            if (!grown)
+                return -1;
+            t->nodes = grown;
+            t->cap = cap;
+        }
+        n = t->used++;
+    }
+    OctNode *node = &t->nodes[n];
+    memset(node, 0, sizeof(*node));
+    for (int i = 0; i < 8; i++)
+        node->child[i] = -1;
+    node->next = -1;
+    if (level == OCT_DEPTH)
+    {
+        node->leaf = 1;
+        t->leaves++;
+    }
+    else if (level > 0)
+    {
+        node->next = t->reducible[level];
+        t->reducible[level] = n;
+    }
+    return n;
+}
+
+// Folds the children of the most recent node on the deepest level with
+// reducible nodes into it. Their children are all leaves by then.
+static void oct_reduce(Octree *t)
+{
+    int level = OCT_DEPTH - 1;
+    while (level > 0 && t->reducible[level] < 0)
+        level--;
+    int n = t->reducible[level];
+    if (n < 0)
+        return;
+    OctNode *node = &t->nodes[n];
+    t->reducible[level] = node->next;
+    int merged = 0;
+    for (int i = 0; i < 8; i++)
+    {
+        int c = node->child[i];
+        if (c < 0)
+            continue;
+        for (int k = 0; k < 3; k++)
+            node->sum[k] += t->nodes[c].sum[k];
+        node->count += t->nodes[c].count;
+        t->nodes[c].next = t->free_list;
+        t->free_list = c;
+        node->child[i] = -1;
+        merged++;
+    }
+    node->leaf = 1;
+    t->leaves -= merged - 1;
+}
+
+// Adds count pixels of colour c. Returns -1 when out of memory.
+static int oct_insert(Octree *t, uint32_t c, uint32_t count)
+{
+    int n = 0;
+    for (int level = 0; !t->nodes[n].leaf; level++)
+    {
+        int slot = child_slot(c, level);
+        if (t->nodes[n].child[slot] < 0)
+        {
+            int made = oct_new(t, level + 1);
+            if (made < 0)
+                return -1;
+            t->nodes[n].child[slot] = made;
+        }
+        n = t->nodes[n].child[slot];
+    }
+    OctNode *leaf = &t->nodes[n];
+    leaf->sum[0] += (uint64_t)(c & 255) * count;
+    leaf->sum[1] += (uint64_t)((c >> 8) & 255) * count;
+    leaf->sum[2] += (uint64_t)(c >> 16) * count;
+    leaf->count += count;
+    while (t->leaves > MAX_COLORS)
+        oct_reduce(t);
+    return 0;
+}
+
+// Numbers the leaves in tree order and stores their mean colours
+static void oct_palette(Octree *t, int n, unsigned char pal[][4], int *count)
+{
+    OctNode *node = &t->nodes[n];
+    if (node->leaf)
+    {
+        uint32_t k = node->count ? node->count : 1;
+        node->index = (int16_t)*count;
+        for (int c = 0; c < 3; c++)
+            pal[*count][c] = (unsigned char)((node->sum[c] + k / 2) / k);
+        pal[*count][3] = 0;
+        (*count)++;
+        return;
+    }
+    for (int i = 0; i < 8; i++)
+        if (node->child[i] >= 0)
+            oct_palette(t, node->child[i], pal, count);
+}
+
+static int oct_lookup(const Octree *t, uint32_t c)
+{
+    int n = 0;
+    for (int level = 0; !t->nodes[n].leaf; level++)
+        n = t->nodes[n].child[child_slot(c, level)];
+    return t->nodes[n].index;
+}
+
+// ---------------------------------------------------------------------------
+// Index plane and RLE8
+// ---------------------------------------------------------------------------
+
+// Direct-mapped cache of recently seen colours and their indices
+typedef struct {
+    uint32_t key[COLOR_CACHE]; // colour | SET_USED
+    unsigned char index[COLOR_CACHE];
+} ColorCache;
+
+typedef struct {
+    const BMPImage *img;
+    size_t stride;
+    unsigned char *indices; // width bytes per row, stored order
+    const ColorSet *set;    // exact palette, or
+    const Octree *tree;     // quantized palette
+    volatile int failed;
+} IndexJob;
+
+static void index_rows(void *arg, int begin, int end)
+{
+    IndexJob *job = (IndexJob *)arg;
+    int width = job->img->dib.biWidth;
+    int bpp = job->img->dib.biBitCount / 8;
+
+    ColorCache *cache = (ColorCache *)calloc(1, sizeof(ColorCache));
+    if (!cache)
+    {
+        job->failed = 1;
+        return;
+    }
+
+    for (int y = begin; y < end; y++)
+    {
+        const unsigned char *p = job->img->data + (size_t)y * job->stride;
+        unsigned char *out = job->indices + (size_t)y * width;
+        for (int x = 0; x < width; x++, p += bpp)
+        {
+            uint32_t c = pixel_color(p);
+            uint32_t h = mix_color(c) >> 20; // 12 bits
+            if (cache->key[h] != (c | SET_USED))
+            {
+                cache->key[h] = c | SET_USED;
+                cache->index[h] = job->tree ? (unsigned char)oct_lookup(job->tree, c)
+                                            : job->set->index[set_probe(job->set, c)];
+            }
+            out[x] = cache->index[h];
+        }
+    }
+    free(cache);
+}
+
+// Encodes one row of indices; returns the bytes written. Runs of three or
+// more are encoded, shorter stretches go out as absolute runs (three
+// pixels at least) or single-pixel runs.
+static size_t rle8_row(const unsigned char *row, int width, unsigned char *out)
+{
+    unsigned char *o = out;
+    int x = 0;
+    while (x < width)
+    {
+        int run = 1;
+        while (x + run < width && run < 255 && row[x + run] == row[x])
+            run++;
+        if (run >= 3)
+        {
+            *o++ = (unsigned char)run;
+            *o++ = row[x];
+            x += run;
+            continue;
+        }
+
+        // Literal stretch up to the next run of three
+        int lit = 0;
+        while (x + lit < width && lit < 255)
+        {
+            if (x + lit + 2 < width && row[x + lit] == row[x + lit + 1] && row[x + lit] == row[x + lit + 2])
+                break;
+            lit++;
+        }
+        if (lit < 3)
+        {
+            for (int i = 0; i < lit; i++)
+            {
+                *o++ = 1;
+                *o++ = row[x + i];
+            }
+        }
+        else
+        {
+            *o++ = 0;
+            *o++ = (unsigned char)lit;
+            memcpy(o, row + x, (size_t)lit);
+            o += lit;
+            if (lit & 1)
+                *o++ = 0;
+        }
+        x += lit;
+    }
+    *o++ = 0; // end of line
+    *o++ = 0;
+    return (size_t)(o - out);
+}
+
+// ---------------------------------------------------------------------------
+// Writer
+// ---------------------------------------------------------------------------
+
+// Writes the file header and a 40-byte or V5 info header, filling in
+// biSize and bfOffBits (extra = palette bytes before the pixels) and bfSize.
+// Returns the bytes written.
+static size_t write_headers(FILE *f, BMPHeader header, DIBHeader dib, int v5, size_t extra)
+{
+    V5Fields ext;
+    memset(&ext, 0, sizeof(ext));
+    dib.biSize = (uint32_t)(sizeof(DIBHeader) + (v5 ? sizeof(V5Fields) : 0));
+    header.bfType = 0x4D42;
+    header.bfOffBits = (uint32_t)(sizeof(BMPHeader) + dib.biSize + extra);
+    header.bfSize = header.bfOffBits + dib.biSizeImage;
+    if (v5 && dib.biBitCount == 32)
+    {
+        // Bit fields are what make the alpha channel official
+        dib.biCompression = BI_BITFIELDS;
+        ext.masks[0] = 0x00FF0000;
+        ext.masks[1] = 0x0000FF00;
+        ext.masks[2] = 0x000000FF;
+        ext.masks[3] = 0xFF000000;
+    }
+    ext.cs_type = LCS_SRGB;
+    ext.intent = LCS_GM_IMAGES;
+
+    size_t put = fwrite(&header, 1, sizeof(BMPHeader), f);
+    put += fwrite(&dib, 1, sizeof(DIBHeader), f);
+    if (v5)
+        put += fwrite(&ext, 1, sizeof(ext), f);
+    return put;
+}
+
+// Writes a 24/32-bit image as stored, behind a V5 header
+static img_status write_v5(imgctx *ctx, const char *filename, const BMPImage *image)
+{
+    ProfScope scope;
+    prof_begin(&scope, PROF_SAVE);
+
+    char part[IMG_PART_PATH_MAX];
+    FILE *f = img_create_file(filename, part);
+    if (!f)
+    {
+        prof_end(&scope);
+        return img_fail(ctx, IMG_ERR_IO, "cannot create %s", filename);
+    }
+    size_t put = write_headers(f, image->header, image->dib, 1, 0);
+    put += fwrite(image->data, 1, image->dib.biSizeImage, f);
+    prof_io(PROF_SAVE, 0, put);
+
+    img_status st = img_finish_file(ctx, f, part, filename,
+                                    put == sizeof(BMPHeader) + sizeof(DIBHeader) + sizeof(V5Fields) +
+                                               image->dib.biSizeImage);
+    if (st == IMG_OK)
+        prof_pixels(PROF_SAVE, img_pixel_count(image));
+    prof_end(&scope);
+    return st;
+}
+
+static img_status write_indexed(imgctx *ctx, const char *filename, const BMPImage *image,
+                                const unsigned char pal[][4], int colors, const unsigned char *indices, int rle,
+                                int v5)
+{
+    int width = image->dib.biWidth;
+    int height = img_height(image);
+    size_t raw_stride = img_row_size(width, 8);
+    size_t raw_size = raw_stride * (size_t)height;
+
+    // RLE8 is bottom-up only; top-down images are written in reverse
+    unsigned char *body = NULL;
+    size_t body_size = raw_size;
+    if (rle)
+    {
+        body = (unsigned char *)malloc((size_t)height * (2 * (size_t)width + 2) + 2);
+        if (!body)
+            return img_fail(ctx, IMG_ERR_NOMEM, "out of memory");
+        size_t n = 0;
+        for (int y = 0; y < height; y++)
+        {
+            int row = (image->dib.biHeight < 0) ? height - 1 - y : y;
+            n += rle8_row(indices + (size_t)row * width, width, body + n);
+        }
+        body[n - 1] = 1; // the last end of line becomes end of bitmap
+        body_size = n;
+        // Noisy images may not compress; plain rows are never larger
+        if (body_size >= raw_size)
+        {
+            free(body);
+            body = NULL;
+            body_size = raw_size;
+            rle = 0;
+        }
+    }
+
+    char part[IMG_PART_PATH_MAX];
+    FILE *f = img_create_file(filename, part);
+    if (!f)
+    {
+        free(body);
+        return img_fail(ctx, IMG_ERR_IO, "cannot create %s", filename);
+    }
+
+    DIBHeader dib = image->dib;
+    dib.biBitCount = 8;
+    dib.biCompression = rle ? BI_RLE8 : 0;
+    dib.biSizeImage = (uint32_t)body_size;
+    dib.biClrUsed = (uint32_t)colors;
+    dib.biClrImportant = 0;
+    if (rle)
+        dib.biHeight = height;
+
+    size_t expect = sizeof(BMPHeader) + sizeof(DIBHeader) + (v5 ? sizeof(V5Fields) : 0) + (size_t)colors * 4 +
+                    body_size;
+    size_t put = write_headers(f, image->header, dib, v5, (size_t)colors * 4);
+    put += fwrite(pal, 4, (size_t)colors, f) * 4;
+    if (rle)
+    {
+        put += fwrite(body, 1, body_size, f);
+    }
+    else
+    {
+        // Rows padded to 4 bytes, in stored order
+        unsigned char pad[4] = {0, 0, 0, 0};
+        for (int y = 0; y < height; y++)
+        {
+            put += fwrite(indices + (size_t)y * width, 1, (size_t)width, f);
+            put += fwrite(pad, 1, raw_stride - (size_t)width, f);
+        }
+    }
+    prof_io(PROF_SAVE, 0, put);
+    free(body);
+
+    return img_finish_file(ctx, f, part, filename, put == expect);
+}
+
+img_status img_save_ex(imgctx *ctx, const char *filename, const BMPImage *image, int flags)
+{
+    if (!ctx || !filename || !image || !image->data)
+        return ctx ? img_fail(ctx, IMG_ERR_ARG, "img_save_ex: missing argument") : IMG_ERR_ARG;
+
+    // Only true-colour images are converted; anything else is written as is
+    int bits = image->dib.biBitCount;
+    int v5 = (flags & IMG_SAVE_V5) != 0;
+    if ((bits != 24 && bits != 32) || image->dib.biCompression != 0)
+        return img_save(ctx, filename, image);
+    if (!(flags & (IMG_SAVE_PALETTE | IMG_SAVE_QUANTIZE)))
+        return v5 ? write_v5(ctx, filename, image) : img_save(ctx, filename, image);
+
+    ColorSet *set = (ColorSet *)malloc(sizeof(ColorSet));
+    if (!set)
+        return img_fail(ctx, IMG_ERR_NOMEM, "out of memory");
+    int exact = count_colors(image, set);
+    int has_alpha = 0;
+    if (!exact && bits == 32)
+    {
+        // Translucent pixels would lose their alpha in a palette
+        size_t stride = img_row_size(image->dib.biWidth, 32);
+        for (int y = 0; y < img_height(image) && !has_alpha; y++)
+            for (int x = 0; x < image->dib.biWidth && !has_alpha; x++)
+                has_alpha = image->data[(size_t)y * stride + (size_t)x * 4 + 3] != 255;
+    }
+    if (has_alpha || (!exact && !(flags & IMG_SAVE_QUANTIZE)))
+    {
+        free(set);
+        return v5 ? write_v5(ctx, filename, image) : img_save(ctx, filename, image);
+    }
+
+    ProfScope scope;
+    prof_begin(&scope, PROF_SAVE);
+
+    img_status st = IMG_OK;
+    unsigned char pal[MAX_COLORS][4];
+    int colors = 0;
+    Octree tree;
+    memset(&tree, 0, sizeof(tree));
+    tree.free_list = -1;
+    for (int i = 0; i < OCT_DEPTH; i++)
+        tree.reducible[i] = -1;
+
+    if (exact)
+    {
+        for (int i = 0; i < SET_SLOTS; i++)
+        {
+            if (set->key[i] == SET_EMPTY)
+                continue;
+            uint32_t c = set->key[i] & ~SET_USED;
+            unsigned char *e = pal[set->index[i]];
+            e[0] = (unsigned char)c;
+            e[1] = (unsigned char)(c >> 8);
+            e[2] = (unsigned char)(c >> 16);
+            e[3] = 0;
+        }
+        colors = set->count;
+    }
+    else
+    {
+        // Runs of one colour go into the tree in a single step
+        int width = image->dib.biWidth;
+        int bpp = bits / 8;
+        size_t stride = img_row_size(width, bits);
+        if (oct_new(&tree, 0) < 0)
+            st = img_fail(ctx, IMG_ERR_NOMEM, "out of memory");
+        for (int y = 0; st == IMG_OK && y < img_height(image); y++)
+        {
+            const unsigned char *p = image->data + (size_t)y * stride;
+            int x = 0;
+            while (x < width && st == IMG_OK)
+            {
+                uint32_t c = pixel_color(p + (size_t)x * bpp);
+                int run = 1;
+                while (x + run < width && pixel_color(p + (size_t)(x + run) * bpp) == c)
+                    run++;
+                if (oct_insert(&tree, c, (uint32_t)run) < 0)
+                    st = img_fail(ctx, IMG_ERR_NOMEM, "out of memory");
+                x += run;
+            }
+        }
+        if (st == IMG_OK)
+            oct_palette(&tree, 0, pal, &colors);
+    }
+
+    unsigned char *indices = NULL;
+    if (st == IMG_OK)
+    {
+        indices = (unsigned char *)malloc((size_t)image->dib.biWidth * (size_t)img_height(image));
+        if (!indices)
+            st = img_fail(ctx, IMG_ERR_NOMEM, "out of memory");
+    }
+    if (st == IMG_OK)
+    {
+        IndexJob job;
+        job.img = image;
+        job.stride = img_row_size(image->dib.biWidth, bits);
+        job.indices = indices;
+        job.set = exact ? set : NULL;
+        job.tree = exact ? NULL : &tree;
+        job.failed = 0;
+        tp_parallel_for(ctx->pool, img_height(image), ROW_GRAIN, index_rows, &job);
+        if (job.failed)
+            st = img_fail(ctx, IMG_ERR_NOMEM, "out of memory");
+    }
+    if (st == IMG_OK)
+        st = write_indexed(ctx, filename, image, (const unsigned char(*)[4])pal, colors, indices,
+                           (flags & IMG_SAVE_RLE) != 0, v5);
+    if (st == IMG_OK)
+        prof_pixels(PROF_SAVE, img_pixel_count(image));
+
+    free(indices);
+    free(tree.nodes);
+    free(set);
+    prof_end(&scope);
+    return st;
+}
@@ -0,0 +1,164 @@
+#include <string.h>
+#include "image_internal.h"
+
+#ifdef IMG_SSE2
+#include <emmintrin.h>
+#endif
+
+// 64-bit content hash in the style of XXH3: eight 64-bit lanes take a
+// 64-byte stripe per step using only 32x32->64 multiplies, which SSE2
+// does two lanes at a time, and are scrambled every block. The SSE2 and
+// scalar paths produce identical results.
+
+#define STRIPE 64
+#define STRIPES_PER_BLOCK 16
+
+#define PRIME32_1 0x9E3779B1U
+#define PRIME32_2 0x85EBCA77U
+#define PRIME32_3 0xC2B2AE3DU
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+static const uint64_t lane_key[8] = {
+    0xbe4ba423396cfeb8ULL, 0x1cad21f72c81017cULL, 0xdb979083e96dd4deULL, 0x1f67b3b7a4a44072ULL,
+    0x78e5c0cc4ee679cbULL, 0x2172ffcc7dd05a82ULL, 0x8e2443f7744608b8ULL, 0x4c263a81e69035e0ULL};
+
+static uint64_t read64(const unsigned char *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v)); // little-endian hosts
+    return v;
+}
+
+static void accumulate_scalar(uint64_t acc[8], const unsigned char *p, size_t stripes)
+{
+    for (size_t s = 0; s < stripes; s++, p += STRIPE)
+    {
+        for (int i = 0; i < 8; i++)
+        {
+            uint64_t v = read64(p + 8 * i);
+            uint64_t k = v ^ lane_key[i];
+            acc[i ^ 1] += v;
+            acc[i] += (k & 0xFFFFFFFFULL) * (k >> 32);
+        }
+    }
+}
+
+#ifdef IMG_SSE2
+static void accumulate_sse2(uint64_t acc[8], const unsigned char *p, size_t stripes)
+{
+    __m128i a[4], key[4];
+    for (int i = 0; i < 4; i++)
+    {
+        a[i] = _mm_loadu_si128((const __m128i *)(acc + 2 * i));
+        key[i] = _mm_loadu_si128((const __m128i *)(lane_key + 2 * i));
+    }
+    for (size_t s = 0; s < stripes; s++, p += STRIPE)
+    {
+        for (int i = 0; i < 4; i++)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *)(p + 16 * i));
+            __m128i k = _mm_xor_si128(v, key[i]);
+            __m128i prod = _mm_mul_epu32(k, _mm_srli_epi64(k, 32));
+            __m128i swapped = _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)); // lane i ^ 1
+            a[i] = _mm_add_epi64(a[i], _mm_add_epi64(prod, swapped));
+        }
+    }
+    for (int i = 0; i < 4; i++)
+        _mm_storeu_si128((__m128i *)(acc + 2 * i), a[i]);
+}
+
+static void scramble_sse2(uint64_t acc[8])
+{
+    const __m128i prime = _mm_set1_epi32((int)PRIME32_1);
+    for (int i = 0; i < 4; i++)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)(acc + 2 * i));
+        a = _mm_xor_si128(a, _mm_srli_epi64(a, 47));
+        a = _mm_xor_si128(a, _mm_loadu_si128((const __m128i *)(lane_key + 2 * i)));
+        // 64x32 multiply from two 32x32->64 halves
+        __m128i lo = _mm_mul_epu32(a, prime);
+        __m128i hi = _mm_mul_epu32(_mm_srli_epi64(a, 32), prime);
+        _mm_storeu_si128((__m128i *)(acc + 2 * i), _mm_add_epi64(lo, _mm_slli_epi64(hi, 32)));
+    }
+}
+#define accumulate accumulate_sse2
+#define scramble scramble_sse2
+#else
+static void scramble_scalar(uint64_t acc[8])
+{
+    for (int i = 0; i < 8; i++)
+    {
+        uint64_t a = acc[i];
+        a ^= a >> 47;
+        a ^= lane_key[i];
+        acc[i] = a * PRIME32_1;
+    }
+}
+
+#define accumulate accumulate_scalar
+#define scramble scramble_scalar
+#endif
+
+static uint64_t avalanche(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+uint64_t img_hash_bytes(const void *data, size_t len, uint64_t seed)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    uint64_t acc[8] = {PRIME32_3, PRIME64_1, PRIME64_2, PRIME64_3,
+                       PRIME64_4, PRIME32_2, PRIME64_5, PRIME32_1};
+    acc[0] += seed;
+
+    // Whole blocks, then the remaining whole stripes
+    size_t stripes = len / STRIPE;
+    while (stripes >= STRIPES_PER_BLOCK)
+    {
+        accumulate(acc, p, STRIPES_PER_BLOCK);
+        scramble(acc);
+        p += STRIPES_PER_BLOCK * STRIPE;
+        stripes -= STRIPES_PER_BLOCK;
+    }
+    accumulate(acc, p, stripes);
+    p += stripes * STRIPE;
+
+    // Tail, zero padded to a stripe (the length is mixed in below)
+    size_t tail = len % STRIPE;
+    if (tail)
+    {
+        unsigned char last[STRIPE] = {0};
+        memcpy(last, p, tail);
+        accumulate_scalar(acc, last, 1);
+    }
+
+    uint64_t h = (uint64_t)len * PRIME64_1 ^ seed;
+    for (int i = 0; i < 8; i++)
+        h = (h ^ avalanche(acc[i] + lane_key[i])) * PRIME64_2;
+    return avalanche(h);
+}
+
+// Pixel hash with the geometry as seed; never 0, which means "unknown"
+uint64_t img_pixel_hash(const BMPImage *image)
+{
+    uint64_t seed = (uint64_t)(uint32_t)image->dib.biWidth * PRIME64_3 ^
+                    (uint64_t)(uint32_t)image->dib.biHeight * PRIME64_4 ^ image->dib.biBitCount;
+    uint64_t h = img_hash_bytes(image->data, image->dib.biSizeImage, seed);
+    return h ? h : 1;
+}
+
+uint64_t img_content_hash(const BMPImage *image)
+{
+    if (!image || !image->data)
+        return 0;
+    return image->hash ? image->hash : img_pixel_hash(image);
+}
@@ -0,0 +1,363 @@
+#include <stdlib.h>
+#include <string.h>
+#include "image_internal.h"
+#include "../include/history.h"
+#include "../include/threadpool.h"
+
+// One tile of IMG_TILE x IMG_TILE pixels (fewer on the right and bottom
+// edges), shared by every version it appears in unchanged
+typedef struct {
+    int refs;
+    size_t size;            // pixel bytes
+    unsigned char pixels[]; // rows of the tile back to back, unpadded
+} Tile;
+
+typedef struct {
+    BMPHeader header;
+    DIBHeader dib;
+    uint64_t hash;  // content hash of the recorded image, 0 when unknown
+    int tiles_x;
+    int tiles_y;
+    Tile **tiles;   // tiles_x * tiles_y, row-major
+} Version;
+
+struct History {
+    size_t limit;
+    size_t bytes;       // pixel bytes of all distinct tiles
+    Version *versions;  // oldest first
+    int count;
+    int capacity;
+    int current;        // version matching the session image, -1 when empty
+};
+
+History *history_create(size_t limit_bytes)
+{
+    History *h = (History *)calloc(1, sizeof(History));
+    if (!h)
+        return NULL;
+    h->limit = limit_bytes;
+    h->current = -1;
+    return h;
+}
+
+static void release_tile(History *h, Tile *t)
+{
+    if (t && --t->refs == 0)
+    {
+        h->bytes -= t->size;
+        free(t);
+    }
+}
+
+static void release_version(History *h, Version *v)
+{
+    for (int i = 0; i < v->tiles_x * v->tiles_y; i++)
+        release_tile(h, v->tiles[i]);
+    free(v->tiles);
+    v->tiles = NULL;
+}
+
+void history_clear(History *h)
+{
+    if (!h)
+        return;
+    for (int i = 0; i < h->count; i++)
+        release_version(h, &h->versions[i]);
+    h->count = 0;
+    h->current = -1;
+}
+
+void history_destroy(History *h)
+{
+    if (!h)
+        return;
+    history_clear(h);
+    free(h->versions);
+    free(h);
+}
+
+void history_stats(const History *h, int *undo_steps, int *redo_steps, size_t *bytes)
+{
+    *undo_steps = (h && h->current > 0) ? h->current : 0;
+    *redo_steps = h ? h->count - 1 - h->current : 0;
+    *bytes = h ? h->bytes : 0;
+}
+
+// Pixel rectangle of tile (tx, ty)
+static void tile_rect(const DIBHeader *dib, int tx, int ty, int *x, int *y, int *w, int *hgt)
+{
+    int height = (dib->biHeight > 0) ? dib->biHeight : -dib->biHeight;
+    *x = tx * IMG_TILE;
+    *y = ty * IMG_TILE;
+    *w = (dib->biWidth - *x < IMG_TILE) ? dib->biWidth - *x : IMG_TILE;
+    *hgt = (height - *y < IMG_TILE) ? height - *y : IMG_TILE;
+}
+
+// ---------------------------------------------------------------------------
+// Recording
+// ---------------------------------------------------------------------------
+
+typedef struct {
+    const BMPImage *img;
+    const Version *prev;  // NULL when the geometry changed
+    Version *next;
+    int region[4];        // tiles that may have changed: tx0, ty0, tx1, ty1 (exclusive)
+    size_t stride;
+    int bpp;
+    size_t *added;        // bytes of new tiles per tile row
+    volatile int failed;
+} RecordJob;
+
+static int tile_matches(const RecordJob *job, const Tile *t, int x, int y, int w, int hgt)
+{
+    size_t row = (size_t)w * job->bpp;
+    for (int j = 0; j < hgt; j++)
+    {
+        const unsigned char *p = job->img->data + (size_t)(y + j) * job->stride + (size_t)x * job->bpp;
+        if (memcmp(t->pixels + (size_t)j * row, p, row) != 0)
+            return 0;
+    }
+    return 1;
+}
+
+static void record_rows(void *arg, int begin, int end)
+{
+    RecordJob *job = (RecordJob *)arg;
+    Version *next = job->next;
+
+    for (int ty = begin; ty < end; ty++)
+    {
+        job->added[ty] = 0;
+        for (int tx = 0; tx < next->tiles_x; tx++)
+        {
+            int i = ty * next->tiles_x + tx;
+            int x, y, w, hgt;
+            tile_rect(&next->dib, tx, ty, &x, &y, &w, &hgt);
+
+            // Unchanged tiles are shared with the previous version
+            if (job->prev)
+            {
+                Tile *old = job->prev->tiles[i];
+                int outside = tx < job->region[0] || ty < job->region[1] || tx >= job->region[2] ||
+                              ty >= job->region[3];
+                if (outside || tile_matches(job, old, x, y, w, hgt))
+                {
+                    old->refs++;
+                    next->tiles[i] = old;
+                    continue;
+                }
+            }
+
+            size_t row = (size_t)w * job->bpp;
+            Tile *t = (Tile *)malloc(sizeof(Tile) + row * hgt);
+            next->tiles[i] = t;
+            if (!t)
+            {
+                job->failed = 1;
+                continue;
+            }
+            t->refs = 1;
+            t->size = row * hgt;
+            for (int j = 0; j < hgt; j++)
+                memcpy(t->pixels + (size_t)j * row,
+                       job->img->data + (size_t)(y + j) * job->stride + (size_t)x * job->bpp, row);
+            job->added[ty] += t->size;
+        }
+    }
+}
+
+// Drops versions, oldest first, until the tiles fit in the limit
+static void trim(History *h)
+{
+    int drop = 0;
+    while (h->bytes > h->limit && drop < h->current)
+        release_version(h, &h->versions[drop++]);
+    if (drop > 0)
+    {
+        memmove(h->versions, h->versions + drop, (size_t)(h->count - drop) * sizeof(Version));
+        h->count -= drop;
+        h->current -= drop;
+    }
+}
+
+img_status history_record(History *h, imgctx *ctx, const BMPImage *image, const int *region)
+{
+    if (!h || !ctx || !image || !image->data)
+        return ctx ? img_fail(ctx, IMG_ERR_ARG, "history_record: missing argument") : IMG_ERR_ARG;
+    if ((image->dib.biBitCount != 24 && image->dib.biBitCount != 32) || image->dib.biCompression != 0)
+        return img_fail(ctx, IMG_ERR_UNSUPPORTED, "history: only 24-bit or 32-bit BMP supported");
+
+    int bpp = image->dib.biBitCount / 8;
+    if (img_pixel_count(image) * (uint64_t)bpp > h->limit)
+    {
+        history_clear(h);
+        return IMG_OK;
+    }
+
+    ProfScope scope;
+    prof_begin(&scope, PROF_HISTORY);
+
+    Version next;
+    next.header = image->header;
+    next.dib = image->dib;
+    next.hash = image->hash;
+    next.tiles_x = (image->dib.biWidth + IMG_TILE - 1) / IMG_TILE;
+    next.tiles_y = (img_height(image) + IMG_TILE - 1) / IMG_TILE;
+    next.tiles = (Tile **)calloc((size_t)next.tiles_x * next.tiles_y, sizeof(Tile *));
+    size_t *added = (size_t *)malloc((size_t)next.tiles_y * sizeof(size_t));
+    if (h->count == h->capacity && next.tiles && added)
+    {
+        int capacity = h->capacity ? 2 * h->capacity : 16;
+        Version *grown = (Version *)realloc(h->versions, (size_t)capacity * sizeof(Version));
+        if (grown)
+        {
+            h->versions = grown;
+            h->capacity = capacity;
+        }
+    }
+    if (!next.tiles || !added || h->count == h->capacity)
+    {
+        free(next.tiles);
+        free(added);
+        prof_end(&scope);
+        return img_fail(ctx, IMG_ERR_NOMEM, "out of memory recording history");
+    }
+
+    // Only a version of the same geometry can share tiles
+    const Version *prev = (h->current >= 0) ? &h->versions[h->current] : NULL;
+    if (prev && (prev->dib.biWidth != image->dib.biWidth || prev->dib.biHeight != image->dib.biHeight ||
+                 prev->dib.biBitCount != image->dib.biBitCount))
+        prev = NULL;
+
+    RecordJob job;
+    job.img = image;
+    job.prev = prev;
+    job.next = &next;
+    job.region[0] = 0;
+    job.region[1] = 0;
+    job.region[2] = next.tiles_x;
+    job.region[3] = next.tiles_y;
+    if (region)
+    {
+        job.region[0] = (region[0] > 0) ? region[0] / IMG_TILE : 0;
+        job.region[1] = (region[1] > 0) ? region[1] / IMG_TILE : 0;
+        job.region[2] = (region[0] + region[2] + IMG_TILE - 1) / IMG_TILE;
+        job.region[3] = (region[1] + region[3] + IMG_TILE - 1) / IMG_TILE;
+    }
+    job.stride = img_row_size(image->dib.biWidth, image->dib.biBitCount);
+    job.bpp = bpp;
+    job.added = added;
+    job.failed = 0;
+    tp_parallel_for(ctx->pool, next.tiles_y, 1, record_rows, &job);
+
+    size_t total = 0;
+    for (int ty = 0; ty < next.tiles_y; ty++)
+        total += added[ty];
+    free(added);
+    h->bytes += total;
+
+    if (job.failed || (prev && total == 0))
+    {
+        release_version(h, &next);
+        prof_end(&scope);
+        return job.failed ? img_fail(ctx, IMG_ERR_NOMEM, "out of memory recording history") : IMG_OK;
+    }
+
+    // The new version replaces any that could have been redone
+    for (int i = h->current + 1; i < h->count; i++)
+        release_version(h, &h->versions[i]);
+    h->count = h->current + 1;
+    h->versions[h->count++] = next;
+    h->current++;
+    trim(h);
+
+    prof_pixels(PROF_HISTORY, (uint64_t)(total / bpp));
+    prof_end(&scope);
+    return IMG_OK;
+}
+
+// ---------------------------------------------------------------------------
+// Undo / redo
+// ---------------------------------------------------------------------------
+
+typedef struct {
+    const Version *v;
+    BMPImage *img;
+    size_t stride;
+    int bpp;
+} RebuildJob;
+
+static void rebuild_rows(void *arg, int begin, int end)
+{
+    RebuildJob *job = (RebuildJob *)arg;
+    const Version *v = job->v;
+    size_t used = (size_t)v->dib.biWidth * job->bpp;
+
+    for (int ty = begin; ty < end; ty++)
+    {
+        for (int tx = 0; tx < v->tiles_x; tx++)
+        {
+            const Tile *t = v->tiles[ty * v->tiles_x + tx];
+            int x, y, w, hgt;
+            tile_rect(&v->dib, tx, ty, &x, &y, &w, &hgt);
+            size_t row = (size_t)w * job->bpp;
+            for (int j = 0; j < hgt; j++)
+                memcpy(job->img->data + (size_t)(y + j) * job->stride + (size_t)x * job->bpp,
+                       t->pixels + (size_t)j * row, row);
+        }
+        // Row padding
+        int x, y, w, hgt;
+        tile_rect(&v->dib, 0, ty, &x, &y, &w, &hgt);
+        for (int j = 0; j < hgt; j++)
+            memset(job->img->data + (size_t)(y + j) * job->stride + used, 0, job->stride - used);
+    }
+}
+
+// Makes version index current, rebuilding its image into *out
+static img_status restore(History *h, imgctx *ctx, int index, BMPImage **out)
+{
+    const Version *v = &h->versions[index];
+
+    ProfScope scope;
+    prof_begin(&scope, PROF_HISTORY);
+
+    // img_new_image takes its headers from an image
+    BMPImage tmpl;
+    memset(&tmpl, 0, sizeof(tmpl));
+    tmpl.header = v->header;
+    tmpl.dib = v->dib;
+
+    BMPImage *img;
+    img_status status = img_new_image(ctx, PROF_HISTORY, &tmpl, tmpl.dib.biWidth, img_height(&tmpl),
+                                      tmpl.dib.biBitCount, &img);
+    if (status == IMG_OK)
+    {
+        RebuildJob job = {v, img, img_row_size(img->dib.biWidth, img->dib.biBitCount), img->dib.biBitCount / 8};
+        tp_parallel_for(ctx->pool, v->tiles_y, 1, rebuild_rows, &job);
+        img->hash = v->hash;
+        h->current = index;
+        prof_pixels(PROF_HISTORY, img_pixel_count(img));
+        *out = img;
+    }
+
+    prof_end(&scope);
+    return status;
+}
+
+img_status history_undo(History *h, imgctx *ctx, BMPImage **out)
+{
+    if (!h || !ctx || !out)
+        return ctx ? img_fail(ctx, IMG_ERR_ARG, "history_undo: missing argument") : IMG_ERR_ARG;
+    if (h->current <= 0)
+        return img_fail(ctx, IMG_ERR_ARG, "nothing to undo");
+    return restore(h, ctx, h->current - 1, out);
+}
+
+img_status history_redo(History *h, imgctx *ctx, BMPImage **out)
+{
+    if (!h || !ctx || !out)
+        return ctx ? img_fail(ctx, IMG_ERR_ARG, "history_redo: missing argument") : IMG_ERR_ARG;
+    if (h->current + 1 >= h->count)
+        return img_fail(ctx, IMG_ERR_ARG, "nothing to redo");
+    return restore(h, ctx, h->current + 1, out);
+}
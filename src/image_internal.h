@@ -0,0 +1,247 @@
+#ifndef IMAGE_INTERNAL_H
+#define IMAGE_INTERNAL_H
+
+// Definitions shared by the library sources; not part of the public API.
+
+#include <math.h>
+#include <stddef.h>
+#include <stdio.h>
+#include "../include/image.h"
+#include "../include/profile.h"
+
+#define IMG_ERROR_MAX 256
+
+// Rows handed to one worker at a time; small images stay on one thread
+#define ROW_GRAIN 16
+
+// SSE2 kernels are used where the compiler targets it (always on x86-64);
+// IMG_NO_SIMD builds the portable code only
+#if !defined(IMG_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define IMG_SSE2 1
+#include <emmintrin.h>
+#endif
+
+struct imgctx {
+    img_allocator alloc;
+    ThreadPool *pool;
+    img_status status;
+    char error[IMG_ERROR_MAX];
+};
+
+// Initialises a context in caller-provided storage
+void img_ctx_init(imgctx *ctx, const img_allocator *allocator, ThreadPool *pool);
+
+// Records an error in the context and returns its code
+img_status img_fail(imgctx *ctx, img_status status, const char *fmt, ...);
+
+// Context allocator
+void *img_alloc(imgctx *ctx, size_t size);
+void img_release(imgctx *ctx, void *ptr);
+
+// Allocates an image with the headers of tmpl (may be NULL) resized to
+// width x height at bits_per_pixel. Pixel bytes are left uninitialised.
+// Height keeps the orientation sign of tmpl.
+img_status img_new_image(imgctx *ctx, ProfOp op, const BMPImage *tmpl,
+                         int width, int height, int bits_per_pixel, BMPImage **out);
+
+// Marks an image's pixels as heap-owned (no mapping)
+static inline void img_init_storage(BMPImage *img)
+{
+    img->data = NULL;
+    img->mapping = NULL;
+    img->mapping_size = 0;
+    img->mapping_fd = -1;
+}
+
+// Unmaps a mapping-backed image's pixels and closes its descriptor (shm.c)
+void img_unmap_storage(BMPImage *img);
+
+// Expands a palettized (1/4/8-bit, RLE4/RLE8) or 16/32-bit bit-field
+// image whose headers were read from file into 24-bit pixels (32-bit when
+// there is an alpha mask) in img->data, rewriting the headers to match
+// (decode.c)
+img_status img_decode_pixels(imgctx *ctx, const char *filename, FILE *file, BMPImage *img);
+
+// 1 when a 32-bit bit-field image stores plain BGRA bytes and can be read
+// as uncompressed (decode.c)
+int img_plain_bitfields(FILE *file, BMPImage *img);
+
+// Files at least this large are mapped instead of read (where supported)
+#define IMG_MAP_MIN_BYTES ((uint64_t)64 << 20)
+
+// Maps size bytes of file from offset as the private, copy-on-write pixel
+// storage of img (shm.c). Returns IMG_ERR_UNSUPPORTED without recording an
+// error when the file cannot be mapped; the caller then reads it.
+img_status img_map_file(FILE *file, uint64_t offset, size_t size, BMPImage *img);
+
+// Longest "<filename>.part" path img_create_file accepts
+#define IMG_PART_PATH_MAX (4096 + 8)
+
+// Opens "<filename>.part" (its path stored in part) to write an image to.
+// img_finish_file closes it and renames it over filename, so a save never
+// truncates a file that this or another process still maps or reads.
+FILE *img_create_file(const char *filename, char part[IMG_PART_PATH_MAX]);
+
+// Closes f; when ok and the close succeeded, moves part over filename,
+// otherwise deletes part and reports a short write
+img_status img_finish_file(imgctx *ctx, FILE *f, const char *part, const char *filename, int ok);
+
+// round(v), halves away from zero, inlined for per-pixel use. Values
+// beyond +-1e9 (and NaN) give -1, which is outside any image.
+static inline int img_round(double v)
+{
+    if (!(v > -1e9 && v < 1e9))
+        return -1;
+    double t = (double)(int64_t)v;
+    double f = v - t;
+    if (f >= 0.5)
+        t += 1.0;
+    else if (f <= -0.5)
+        t -= 1.0;
+    return (int)t;
+}
+
+// Affine map from destination to source pixel coordinates about a pivot
+// (px, py): source x = m[0] * (x - px) + m[1] * (y - py) + m[2], source y
+// likewise with m[3..5]. img_affine's matrix has pivot 0; a rotation
+// pivots on the image centre, the way the legacy rotate_bmp computed it.
+typedef struct {
+    double m[6];
+    double px, py;
+} img_map;
+
+// Exact source coordinates of destination (x, y), evaluated in that order
+static inline double img_map_x(const img_map *map, int x, int y)
+{
+    return map->m[0] * (x - map->px) + map->m[1] * (y - map->py) + map->m[2];
+}
+
+static inline double img_map_y(const img_map *map, int x, int y)
+{
+    return map->m[3] * (x - map->px) + map->m[4] * (y - map->py) + map->m[5];
+}
+
+// Source pixel of destination (x, y) rounded from the exact coordinates;
+// kept out of line, img_affine_span needs it for few pixels
+void img_affine_exact(const img_map *map, int x, int y, int *sx, int *sy);
+
+// Integer parts of n 32.32 fixed-point coordinates stepping from (fx, fy)
+// by (dx, dy). Returns 1 when the fraction of any of them lies within
+// band of 0, that is the coordinate within band of a .5 boundary.
+static inline int img_step_span(int64_t fx, int64_t fy, int64_t dx, int64_t dy, uint32_t band, int n, int *sx,
+                                int *sy)
+{
+    int i = 0;
+    int near = 0;
+#ifdef IMG_SSE2
+    // Four pixels per step: two 64-bit coordinates in each of two
+    // registers, high words stored and low words compared unsigned
+    int64_t start[8] = {fx, fx + dx, fx + 2 * dx, fx + 3 * dx, fy, fy + dy, fy + 2 * dy, fy + 3 * dy};
+    int64_t step[4] = {4 * dx, 4 * dx, 4 * dy, 4 * dy};
+    __m128i x01 = _mm_loadu_si128((const __m128i *)start);
+    __m128i x23 = _mm_loadu_si128((const __m128i *)(start + 2));
+    __m128i y01 = _mm_loadu_si128((const __m128i *)(start + 4));
+    __m128i y23 = _mm_loadu_si128((const __m128i *)(start + 6));
+    __m128i step_x = _mm_loadu_si128((const __m128i *)step);
+    __m128i step_y = _mm_loadu_si128((const __m128i *)(step + 2));
+    __m128i shift = _mm_set1_epi32((int)(band ^ 0x80000000u));
+    __m128i limit = _mm_set1_epi32((int)((2 * band) ^ 0x80000000u));
+    __m128i far = _mm_set1_epi32(-1);
+    for (; i + 4 <= n; i += 4)
+    {
+        __m128 ax = _mm_castsi128_ps(x01), bx = _mm_castsi128_ps(x23);
+        __m128 ay = _mm_castsi128_ps(y01), by = _mm_castsi128_ps(y23);
+        _mm_storeu_si128((__m128i *)(sx + i), _mm_castps_si128(_mm_shuffle_ps(ax, bx, _MM_SHUFFLE(3, 1, 3, 1))));
+        _mm_storeu_si128((__m128i *)(sy + i), _mm_castps_si128(_mm_shuffle_ps(ay, by, _MM_SHUFFLE(3, 1, 3, 1))));
+        __m128i lx = _mm_castps_si128(_mm_shuffle_ps(ax, bx, _MM_SHUFFLE(2, 0, 2, 0)));
+        __m128i ly = _mm_castps_si128(_mm_shuffle_ps(ay, by, _MM_SHUFFLE(2, 0, 2, 0)));
+        far = _mm_and_si128(far, _mm_cmpgt_epi32(_mm_add_epi32(lx, shift), limit));
+        far = _mm_and_si128(far, _mm_cmpgt_epi32(_mm_add_epi32(ly, shift), limit));
+        x01 = _mm_add_epi64(x01, step_x);
+        x23 = _mm_add_epi64(x23, step_x);
+        y01 = _mm_add_epi64(y01, step_y);
+        y23 = _mm_add_epi64(y23, step_y);
+    }
+    near = _mm_movemask_epi8(far) != 0xFFFF;
+    fx += (int64_t)i * dx;
+    fy += (int64_t)i * dy;
+#endif
+    for (; i < n; i++, fx += dx, fy += dy)
+    {
+        sx[i] = (int)(fx >> 32);
+        sy[i] = (int)(fy >> 32);
+        near |= ((uint32_t)((uint32_t)fx + band) <= 2 * band) | ((uint32_t)((uint32_t)fy + band) <= 2 * band);
+    }
+    return near;
+}
+
+// Source pixels (sx[i], sy[i]) of destination pixels x0 + i, i < n, of row
+// y: img_round of img_map_x and img_map_y. The coordinates step in 32.32
+// fixed point; pixels whose stepped coordinate lies within the stepping
+// error of a .5 boundary are recomputed exactly, so ties and near-ties
+// round as round() does on the exact coordinate. Spans reaching beyond
+// +-2^30, or too large for a tight error bound, are rounded per pixel.
+static inline void img_affine_span(const img_map *map, int x0, int y, int n, int *sx, int *sy)
+{
+    const double limit = 1073741824.0;
+    const double one = 4294967296.0;
+    const double *m = map->m;
+    double ux = img_map_x(map, x0, y);
+    double uy = img_map_y(map, x0, y);
+    double ex = img_map_x(map, x0 + n - 1, y);
+    double ey = img_map_y(map, x0 + n - 1, y);
+
+    // Error of the stepped value in 2^-32 units: one per step of the
+    // truncated increment, one for the start, and a few ulps of the
+    // largest term for the double arithmetic on both sides
+    double ax = fmax(fabs(x0 - map->px), fabs(x0 + n - 1 - map->px));
+    double ay = fabs(y - map->py);
+    double tx = fabs(m[0]) * ax + fabs(m[1]) * ay + fabs(m[2]);
+    double ty = fabs(m[3]) * ax + fabs(m[4]) * ay + fabs(m[5]);
+    double band = n + 3 + fmax(tx, ty) / 65536.0;
+
+    if (ux > -limit && ux < limit && uy > -limit && uy < limit && ex > -limit && ex < limit && ey > -limit &&
+        ey < limit && band < limit)
+    {
+        int64_t fx = (int64_t)(ux * one) + ((int64_t)1 << 31);
+        int64_t fy = (int64_t)(uy * one) + ((int64_t)1 << 31);
+        int64_t dx = (int64_t)(m[0] * one);
+        int64_t dy = (int64_t)(m[3] * one);
+        uint32_t b = (uint32_t)band;
+        if (!img_step_span(fx, fy, dx, dy, b, n, sx, sy))
+            return;
+        for (int i = 0; i < n; i++, fx += dx, fy += dy)
+        {
+            if ((uint32_t)((uint32_t)fx + b) <= 2 * b || (uint32_t)((uint32_t)fy + b) <= 2 * b)
+                img_affine_exact(map, x0 + i, y, &sx[i], &sy[i]);
+        }
+        return;
+    }
+    for (int i = 0; i < n; i++)
+        img_affine_exact(map, x0 + i, y, &sx[i], &sy[i]);
+}
+
+// Map of a rotation by angle_degrees around the centre of a width x height
+// image
+void img_rotation_map(double angle_degrees, int width, int height, img_map *map);
+
+// Hash of the pixel bytes and geometry, never 0 (hash.c)
+uint64_t img_pixel_hash(const BMPImage *image);
+
+// Row stride in bytes, padded to 4
+static inline size_t img_row_size(int width, int bits_per_pixel)
+{
+    return (((size_t)width * (size_t)bits_per_pixel + 31) / 32) * 4;
+}
+
+static inline int img_height(const BMPImage *img)
+{
+    return (img->dib.biHeight > 0) ? img->dib.biHeight : -img->dib.biHeight;
+}
+
+static inline uint64_t img_pixel_count(const BMPImage *img)
+{
+    return (uint64_t)img->dib.biWidth * (uint64_t)img_height(img);
+}
+
+#endif
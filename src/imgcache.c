@@ -0,0 +1,251 @@
+#define _XOPEN_SOURCE 700 // st_mtim, realpath
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "image_internal.h"
+#include "../include/imgcache.h"
+#include "../include/threadpool.h"
+
+// One decoded image. Entries are reference counted so a copy can be made
+// outside the cache lock; an evicted entry is freed by its last user.
+typedef struct CacheEntry
+{
+    char *path;
+    FileIdentity id;
+    BMPImage *img;          // allocated with malloc (cache-private context)
+    size_t bytes;
+    int refs;
+    struct CacheEntry *prev; // towards most recently used
+    struct CacheEntry *next; // towards least recently used
+} CacheEntry;
+
+struct ImageCache
+{
+    tp_mutex lock;
+    CacheEntry *head; // most recently used
+    CacheEntry *tail; // least recently used
+    size_t bytes;
+    size_t budget;
+    uint64_t hits;
+    uint64_t misses;
+};
+
+int imgcache_canonical_path(const char *path, char *buf, size_t len)
+{
+#ifdef _WIN32
+    return _fullpath(buf, path, len) ? 0 : -1;
+#else
+    char *real = realpath(path, NULL);
+    if (!real)
+        return -1;
+    size_t n = strlen(real);
+    int ok = n < len;
+    if (ok)
+        memcpy(buf, real, n + 1);
+    free(real);
+    return ok ? 0 : -1;
+#endif
+}
+
+int imgcache_file_identity(const char *filename, FileIdentity *id)
+{
+#ifdef _WIN32
+    struct _stat64 st;
+    if (_stat64(filename, &st) != 0)
+        return -1;
+    id->mtime_ns = (int64_t)st.st_mtime * 1000000000LL;
+    id->inode = 0;
+#else
+    struct stat st;
+    if (stat(filename, &st) != 0)
+        return -1;
+    id->mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+    id->inode = (uint64_t)st.st_ino;
+#endif
+    id->size = (uint64_t)st.st_size;
+    return 0;
+}
+
+ImageCache *imgcache_create(size_t budget_bytes)
+{
+    ImageCache *cache = (ImageCache *)calloc(1, sizeof(ImageCache));
+    if (!cache)
+        return NULL;
+    tp_mutex_init(&cache->lock);
+    cache->budget = budget_bytes;
+    return cache;
+}
+
+static void free_entry(CacheEntry *e)
+{
+    imgctx ctx;
+    img_ctx_init(&ctx, NULL, NULL);
+    img_free(&ctx, e->img);
+    free(e->path);
+    free(e);
+}
+
+// Takes an entry out of the LRU list (lock held)
+static void unlink_entry(ImageCache *cache, CacheEntry *e)
+{
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        cache->head = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        cache->tail = e->prev;
+    e->prev = e->next = NULL;
+    cache->bytes -= e->bytes;
+}
+
+// Puts an entry at the most recently used end (lock held)
+static void push_front(ImageCache *cache, CacheEntry *e)
+{
+    e->prev = NULL;
+    e->next = cache->head;
+    if (cache->head)
+        cache->head->prev = e;
+    cache->head = e;
+    if (!cache->tail)
+        cache->tail = e;
+    cache->bytes += e->bytes;
+}
+
+// Drops an entry from the cache; it is freed now or by its last user (lock held)
+static void evict(ImageCache *cache, CacheEntry *e)
+{
+    unlink_entry(cache, e);
+    if (--e->refs == 0)
+        free_entry(e);
+}
+
+void imgcache_destroy(ImageCache *cache)
+{
+    if (!cache)
+        return;
+    while (cache->head)
+        evict(cache, cache->head);
+    tp_mutex_destroy(&cache->lock);
+    free(cache);
+}
+
+// Releases a reference taken by a lookup
+static void put_entry(ImageCache *cache, CacheEntry *e)
+{
+    tp_mutex_lock(&cache->lock);
+    int last = (--e->refs == 0);
+    tp_mutex_unlock(&cache->lock);
+    if (last)
+        free_entry(e);
+}
+
+img_status imgcache_load(ImageCache *cache, imgctx *ctx, const char *filename, BMPImage **out)
+{
+    if (!cache || !ctx || !filename || !out)
+        return ctx ? img_fail(ctx, IMG_ERR_ARG, "imgcache_load: missing argument") : IMG_ERR_ARG;
+
+    // Keyed by the canonical path, so every spelling of a file shares one copy
+    char path[IMGCACHE_PATH_MAX];
+    FileIdentity id;
+    if (imgcache_canonical_path(filename, path, sizeof(path)) != 0 || imgcache_file_identity(path, &id) != 0)
+        return img_fail(ctx, IMG_ERR_IO, "cannot open %s", filename);
+
+    // Look for a fresh entry; a stale one (file changed) is dropped
+    tp_mutex_lock(&cache->lock);
+    CacheEntry *found = NULL;
+    for (CacheEntry *e = cache->head; e; e = e->next)
+    {
+        if (strcmp(e->path, path) != 0)
+            continue;
+        if (imgcache_same_file(&e->id, &id))
+        {
+            found = e;
+            found->refs++;
+            unlink_entry(cache, found);
+            push_front(cache, found);
+            cache->hits++;
+        }
+        else
+        {
+            evict(cache, e);
+        }
+        break;
+    }
+    if (!found)
+        cache->misses++;
+    tp_mutex_unlock(&cache->lock);
+
+    // Hit: hand out a private copy, no file access
+    if (found)
+    {
+        img_status st = img_clone(ctx, found->img, out);
+        put_entry(cache, found);
+        return st;
+    }
+
+    // Too big to keep: decode straight into the caller's context
+    if (id.size > cache->budget)
+        return img_load(ctx, path, out);
+
+    // Miss: decode once into cache-owned memory
+    imgctx own;
+    img_ctx_init(&own, NULL, ctx->pool);
+    BMPImage *img = NULL;
+    if (img_load(&own, path, &img) != IMG_OK)
+        return img_fail(ctx, own.status, "%s", own.error);
+    // Hashed once here rather than in every copy handed out
+    img->hash = img_pixel_hash(img);
+
+    CacheEntry *e = (CacheEntry *)calloc(1, sizeof(CacheEntry));
+    size_t len = strlen(path);
+    char *copy = (char *)malloc(len + 1);
+    if (!e || !copy)
+    {
+        free(e);
+        free(copy);
+        img_free(&own, img);
+        return img_fail(ctx, IMG_ERR_NOMEM, "out of memory");
+    }
+    memcpy(copy, path, len + 1);
+    e->path = copy;
+    e->id = id;
+    e->img = img;
+    e->bytes = img->dib.biSizeImage;
+    e->refs = 2; // the cache and this call
+
+    tp_mutex_lock(&cache->lock);
+    // Another client may have decoded the same file meanwhile
+    for (CacheEntry *old = cache->head; old; old = old->next)
+    {
+        if (strcmp(old->path, path) == 0)
+        {
+            evict(cache, old);
+            break;
+        }
+    }
+    push_front(cache, e);
+    // Evict from the cold end, never the entry just added
+    while (cache->bytes > cache->budget && cache->tail && cache->tail != e)
+        evict(cache, cache->tail);
+    tp_mutex_unlock(&cache->lock);
+
+    img_status st = img_clone(ctx, img, out);
+    put_entry(cache, e);
+    return st;
+}
+
+void imgcache_stats(ImageCache *cache, uint64_t *hits, uint64_t *misses, size_t *bytes)
+{
+    tp_mutex_lock(&cache->lock);
+    if (hits)
+        *hits = cache->hits;
+    if (misses)
+        *misses = cache->misses;
+    if (bytes)
+        *bytes = cache->bytes;
+    tp_mutex_unlock(&cache->lock);
+}
@@ -1,313 +1,291 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <ctype.h>
 #include "../include/image.h"
+#include "../include/commands.h"
+#include "../include/profile.h"
+#include "../include/server.h"
+#include "../include/history.h"
+#include "../include/memo.h"
+#include "../include/plan.h"
+#include "../include/scan.h"
+#include "../include/thumbcache.h"
+#include "../include/threadpool.h"
 
-static void print_menu()
-{
-    printf("\n=== Image Utility ===\n");
-    printf("Commands:\n");
-    printf("  load <filename>         - Load a BMP file\n");
-    printf("  save <filename>         - Save current image\n");
-    printf("  fill <R> <G> <B>        - Fill image with color\n");
-    printf("  rotate <angle>          - Rotate by angle (degrees)\n");
-    printf("  scale <factor>          - Scale by factor (e.g. 0.5, 2.0)\n");
-    printf("  resize <w> <h>          - Resize to width/height\n");
-    printf("  crop <x> <y> <w> <h>    - Crop region\n");
-    printf("  embed <message>         - Hide text inside image\n");
-    printf("  extract                 - Recover hidden text from image\n");
-    printf("  exit                    - Quit program\n");
-    printf("======================\n");
-}
+// Default budget of the server's decoded-image cache
+#define DEFAULT_CACHE_MB 512
 
-int main()
-{
-    //Initializing space for image
-    BMPImage *img = NULL;
-    char line[512];
+// Default location and budget of the persistent thumbnail cache
+#define DEFAULT_THUMB_DIR ".imagetool-thumbs"
+#define DEFAULT_THUMB_MB 64
 
-    //Printing menu
-    printf("Welcome to the Image Utility (BMP only).\n");
-    print_menu();
+// Default budget of the in-memory transform result cache
+#define DEFAULT_MEMO_MB 256
 
-    //while true in C
-    while (1)
-    {   
-        //get the command name
-        printf("\n> ");
-        if (!fgets(line, sizeof(line), stdin))
-            break;
+// Default memory limit of the interactive undo/redo history
+#define DEFAULT_HISTORY_MB 512
 
-        // strip newline
-        line[strcspn(line, "\r\n")] = 0;
-
-        //If the user did not enter anything
-        if (strlen(line) == 0)
-            continue;
-
-        //Now, what is the command that her entered
-        char *cmd = strtok(line, " ");
-        if (!cmd)
-            continue;
-
-        //If he entered exit, just exit
-        if (strcmp(cmd, "exit") == 0)
-        {
-            break;
-        }
+// Longest chain accepted by --run
+#define MAX_STEPS 64
 
-        //For help we print the menu 
-        else if (strcmp(cmd, "help") == 0)
-        {
-            print_menu();
-        }
+static void print_usage(const char *prog)
+{
+    printf("Usage:\n");
+    printf("  %s                                   - Interactive mode\n", prog);
+    printf("  %s --serve <socket> [--threads N] [--cache-mb N]\n", prog);
+    printf("                                       - Serve commands on a Unix socket\n");
+    printf("  Both modes accept [--thumb-dir DIR] [--thumb-mb N] for the thumbnail cache\n");
+    printf("  and [--memo-mb N] [--memo-dir DIR] for the transform result cache;\n");
+    printf("  [--history-mb N] limits the interactive undo history (0 disables it)\n");
+    printf("  %s --run <in> <out> <steps> [--budget-mb N] [--temp-dir DIR] [--threads N]\n", prog);
+    printf("                                       - Transform a file within a memory budget;\n");
+    printf("                                         steps like \"crop 0 0 800 600, rotate 30, scale 0.5\"\n");
+    printf("  %s [--threads N] --scan [--msb] [--show] <files...>\n", prog);
+    printf("                                       - List files carrying an embedded message\n");
+}
 
-        //If the user wants to load the image =
-        else if (strcmp(cmd, "load") == 0)
-        {  
-            //we get the file name
-            char *fname = strtok(NULL, " ");
-            if (!fname)
-            {
-                printf("Usage: load <filename>\n");
-                continue;
-            }
+// Parses comma-separated steps of a --run chain; returns their number or -1
+static int parse_steps(char *text, MemoOp *ops, int max)
+{
+    int count = 0;
+    for (char *step = strtok(text, ","); step; step = strtok(NULL, ","))
+    {
+        char name[16];
+        double v[4];
+        int n = sscanf(step, " %15s %lf %lf %lf %lf", name, &v[0], &v[1], &v[2], &v[3]);
+        if (count == max || n < 2)
+            return -1;
+        MemoOp *op = &ops[count++];
+        memset(op, 0, sizeof(*op));
+        for (int i = 0; i < n - 1; i++)
+            op->args[i] = (int)v[i];
+        op->value = v[0];
+        if (strcmp(name, "rotate") == 0 && n == 2)
+            op->kind = MEMO_ROTATE;
+        else if (strcmp(name, "scale") == 0 && n == 2)
+            op->kind = MEMO_SCALE;
+        else if (strcmp(name, "resize") == 0 && n == 3)
+            op->kind = MEMO_RESIZE;
+        else if (strcmp(name, "crop") == 0 && n == 5)
+            op->kind = MEMO_CROP;
+        else
+            return -1;
+    }
+    return count;
+}
 
-            //We load the image 
-            BMPImage *tmp = load_bmp(fname);
+// Runs a chain from file to file with the strategy the budget allows
+static int run_batch(const char *in, const char *out, char *steps, uint64_t budget, const char *temp_dir,
+                     int nthreads)
+{
+    MemoOp ops[MAX_STEPS];
+    int count = parse_steps(steps, ops, MAX_STEPS);
+    if (count < 0)
+    {
+        printf("Invalid steps; use rotate <deg>, scale <f>, resize <w> <h>, crop <x> <y> <w> <h>\n");
+        return 1;
+    }
 
-            if (!tmp)
-            {
-                printf("Failed to load %s\n", fname);
-            }
+    ThreadPool *pool = tp_create(nthreads);
+    imgctx *ctx = img_ctx_create(NULL, pool);
+    Plan plan = {0};
+    img_status status = ctx ? plan_make(ctx, in, ops, count, budget, &plan) : IMG_ERR_NOMEM;
+    // The plan is filled in when it succeeds or when no strategy fits; other
+    // failures (no context, an allocation) leave nothing to print
+    if (status == IMG_OK || plan.strategy == PLAN_COUNT)
+        plan_print(&plan, stdout);
+    if (status == IMG_OK)
+        status = plan_run(ctx, &plan, in, ops, count, out, temp_dir);
+    if (status == IMG_OK)
+        printf("Saved %s\n", out);
+    else
+        printf("Error: %s\n", ctx ? img_ctx_error(ctx) : "out of memory");
+    img_ctx_destroy(ctx);
+    tp_destroy(pool);
+    return status == IMG_OK ? 0 : 1;
+}
 
-            else
-            {
-                //We delete the previous image
-                free_bmp(img);
+// Reports which files carry an embedded message, reading only their headers
+// and the carrier bytes of the length prefix (and of the message with --show)
+static int run_scan(char **args, int count, int nthreads)
+{
+    int use_msb = 0, show = 0;
+    for (; count > 0 && strncmp(args[0], "--", 2) == 0; args++, count--)
+    {
+        if (strcmp(args[0], "--msb") == 0)
+            use_msb = 1;
+        else if (strcmp(args[0], "--show") == 0)
+            show = 1;
+        else
+            break;
+    }
 
-                //Copy the temporary one
-                img = tmp;
+    ScanResult *results = (ScanResult *)calloc(count > 0 ? (size_t)count : 1, sizeof(ScanResult));
+    if (!results)
+    {
+        printf("Out of memory.\n");
+        return 1;
+    }
+    for (int i = 0; i < count; i++)
+        results[i].path = args[i];
 
-                //Print for a success
-                printf("Loaded %s (%dx%d, %d bpp)\n",
-                       fname, img->dib.biWidth, img->dib.biHeight, img->dib.biBitCount);
-            }
-        }
+    //Scans wait on the disk, so every worker mostly sleeps on I/O
+    ThreadPool *pool = tp_create(nthreads);
+    scan_files(pool, results, count, use_msb, show);
+    tp_destroy(pool);
 
-        //If the user wants to save the image 
-        else if (strcmp(cmd, "save") == 0)
+    int found = 0, failed = 0;
+    for (int i = 0; i < count; i++)
+    {
+        ScanResult *r = &results[i];
+        if (r->status == IMG_OK && r->length > 0)
         {
-            if (!img)
-            {
-                printf("No image loaded.\n");
-                continue;
-            }
-            char *fname = strtok(NULL, " ");
-            if (!fname)
-            {
-                printf("Usage: save <filename>\n");
-                continue;
-            }
-            if (save_bmp(fname, img) == 0)
-            {
-                printf("Saved image to %s\n", fname);
-            }
+            found++;
+            if (show)
+                printf("%s: %u bytes: %s\n", r->path, r->length, r->message);
             else
-            {
-                printf("Failed to save image.\n");
-            }
+                printf("%s: %u bytes\n", r->path, r->length);
         }
-
-        //Filling the picture with color described by the user
-        else if (strcmp(cmd, "fill") == 0)
+        else if (r->status != IMG_OK && r->status != IMG_ERR_CAPACITY)
         {
-            if (!img)
-            {
-                printf("No image loaded.\n");
-                continue;
-            }
-            char *r = strtok(NULL, " ");
-            char *g = strtok(NULL, " ");
-            char *b = strtok(NULL, " ");
-            if (!r || !g || !b)
-            {
-                printf("Usage: fill <R> <G> <B>\n");
-                continue;
-            }
-            unsigned char color[3];
-            color[0] = (unsigned char)atoi(r);
-            color[1] = (unsigned char)atoi(g);
-            color[2] = (unsigned char)atoi(b);
-            fill_bmp(img, color);
-            printf("Image filled with color (%d, %d, %d).\n", color[0], color[1], color[2]);
+            failed++;
+            printf("%s: %s\n", r->path, img_status_str(r->status));
         }
+    }
+    printf("Scanned %d files: %d carry a message, %d could not be scanned.\n", count, found, failed);
+    scan_free_results(results, count);
+    free(results);
+    return 0;
+}
 
-        //If the user prompted to rotate 
-        else if (strcmp(cmd, "rotate") == 0)
-        {
-            if (!img)
-            {
-                printf("No image loaded.\n");
-                continue;
-            }
-            char *ang = strtok(NULL, " ");
-            if (!ang)
-            {
-                printf("Usage: rotate <angle>\n");
-                continue;
-            }
-            double angle = atof(ang);
-            BMPImage *rot = rotate_bmp(img, angle);
-            if (rot)
-            {
-                free_bmp(img);
-                img = rot;
-                printf("Rotated image by %.2f degrees.\n", angle);
-            }
-            else
-            {
-                printf("Rotation failed.\n");
-            }
-        }
+int main(int argc, char **argv)
+{
+    //Worker threads (0 = one per CPU)
+    int nthreads = 0;
+    const char *socket_path = NULL;
+    size_t cache_mb = DEFAULT_CACHE_MB;
+    const char *thumb_dir = DEFAULT_THUMB_DIR;
+    size_t thumb_mb = DEFAULT_THUMB_MB;
+    size_t memo_mb = DEFAULT_MEMO_MB;
+    const char *memo_dir = NULL;
+    size_t history_mb = DEFAULT_HISTORY_MB;
+    char **run = NULL;
+    uint64_t budget = PLAN_UNAVAILABLE;
+    const char *temp_dir = NULL;
+    char **scan = NULL;
+    int scan_count = 0;
 
-        //Scaling the image 
-        else if (strcmp(cmd, "scale") == 0)
-        {
-            if (!img)
-            {
-                printf("No image loaded.\n");
-                continue;
-            }
-            char *fac = strtok(NULL, " ");
-            if (!fac)
-            {
-                printf("Usage: scale <factor>\n");
-                continue;
-            }
-            double factor = atof(fac);
-            if (factor <= 0)
-            {
-                printf("Scale factor must be > 0.\n");
-                continue;
-            }
-            BMPImage *sc = scale_bmp(img, factor);
-            if (sc)
-            {
-                free_bmp(img);
-                img = sc;
-                printf("Scaled image by %.2fx.\n", factor);
-            }
-            else
-            {
-                printf("Scaling failed.\n");
-            }
-        }
-        else if (strcmp(cmd, "resize") == 0)
-        {
-            if (!img)
-            {
-                printf("No image loaded.\n");
-                continue;
-            }
-            char *w = strtok(NULL, " ");
-            char *h = strtok(NULL, " ");
-            if (!w || !h)
-            {
-                printf("Usage: resize <w> <h>\n");
-                continue;
-            }
-            int new_w = atoi(w), new_h = atoi(h);
-            BMPImage *rsz = resize_bmp(img, new_w, new_h);
-            if (rsz)
-            {
-                free_bmp(img);
-                img = rsz;
-                printf("Resized image to %dx%d.\n", new_w, new_h);
-            }
-            else
-            {
-                printf("Resize failed.\n");
-            }
-        }
-        else if (strcmp(cmd, "crop") == 0)
+    //Command line options
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc)
+            socket_path = argv[++i];
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+            nthreads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--cache-mb") == 0 && i + 1 < argc)
+            cache_mb = (size_t)atol(argv[++i]);
+        else if (strcmp(argv[i], "--thumb-dir") == 0 && i + 1 < argc)
+            thumb_dir = argv[++i];
+        else if (strcmp(argv[i], "--thumb-mb") == 0 && i + 1 < argc)
+            thumb_mb = (size_t)atol(argv[++i]);
+        else if (strcmp(argv[i], "--memo-mb") == 0 && i + 1 < argc)
+            memo_mb = (size_t)atol(argv[++i]);
+        else if (strcmp(argv[i], "--memo-dir") == 0 && i + 1 < argc)
+            memo_dir = argv[++i];
+        else if (strcmp(argv[i], "--history-mb") == 0 && i + 1 < argc)
+            history_mb = (size_t)atol(argv[++i]);
+        else if (strcmp(argv[i], "--run") == 0 && i + 3 < argc)
         {
-            if (!img)
-            {
-                printf("No image loaded.\n");
-                continue;
-            }
-            char *sx = strtok(NULL, " ");
-            char *sy = strtok(NULL, " ");
-            char *sw = strtok(NULL, " ");
-            char *sh = strtok(NULL, " ");
-            if (!sx || !sy || !sw || !sh)
-            {
-                printf("Usage: crop <x> <y> <w> <h>\n");
-                continue;
-            }
-            int x = atoi(sx), y = atoi(sy), w = atoi(sw), h = atoi(sh);
-            BMPImage *cr = crop_bmp(img, x, y, w, h);
-            if (cr)
-            {
-                free_bmp(img);
-                img = cr;
-                printf("Cropped to region (%d,%d,%d,%d).\n", x, y, w, h);
-            }
-            else
-            {
-                printf("Crop failed.\n");
-            }
+            run = &argv[i + 1];
+            i += 3;
         }
-        else if (strcmp(cmd, "embed") == 0)
+        else if (strcmp(argv[i], "--budget-mb") == 0 && i + 1 < argc)
+            budget = (uint64_t)atol(argv[++i]) * 1024 * 1024;
+        else if (strcmp(argv[i], "--temp-dir") == 0 && i + 1 < argc)
+            temp_dir = argv[++i];
+        else if (strcmp(argv[i], "--scan") == 0)
         {
-            if (!img)
-            {
-                printf("No image loaded.\n");
-                continue;
-            }
-            char *msg = strtok(NULL, "");
-            if (!msg)
-            {
-                printf("Usage: embed <message>\n");
-                continue;
-            }
-            if (embed_message(img, msg, 0) == 0)
-            {
-                printf("Message embedded.\n");
-            }
-            else
-            {
-                printf("Failed to embed message.\n");
-            }
-        }
-        else if (strcmp(cmd, "extract") == 0)
-        {
-            if (!img)
-            {
-                printf("No image loaded.\n");
-                continue;
-            }
-            char *msg = extract_message(img, 0);
-            if (msg)
-            {
-                printf("Extracted message: \"%s\"\n", msg);
-                free_message(msg);
-            }
-            else
-            {
-                printf("No message found.\n");
-            }
+            //Everything after --scan is its flags and files
+            scan = &argv[i + 1];
+            scan_count = argc - i - 1;
+            break;
         }
         else
         {
-            printf("Unknown command: %s\n", cmd);
-            print_menu();
+            print_usage(argv[0]);
+            return 1;
         }
     }
 
-    free_bmp(img);
+    //IMAGETOOL_STATS / IMAGETOOL_STATS_JSON switch profiling on
+    prof_init_from_env();
+
+    if (scan)
+        return run_scan(scan, scan_count, nthreads);
+
+    //Batch runs use none of the caches: every run reads a new file
+    if (run)
+        return run_batch(run[0], run[1], run[2], budget, temp_dir, nthreads);
+
+    //Thumbnails persist across runs; the directory is made on first use
+    ThumbCache *thumbs = thumbcache_open(thumb_dir, thumb_mb * 1024 * 1024);
+    //Repeated transform recipes are served from here
+    MemoCache *memo = memo_create(memo_mb * 1024 * 1024, memo_dir);
+
+    if (socket_path)
+    {
+        int rc = server_run(socket_path, nthreads, cache_mb * 1024 * 1024, thumbs, memo);
+        memo_destroy(memo);
+        thumbcache_close(thumbs);
+        return rc;
+    }
+
+    //Session state and the pool the kernels run on
+    ThreadPool *pool = tp_create(nthreads);
+    imgctx *ctx = img_ctx_create(NULL, pool);
+    if (!ctx)
+    {
+        printf("Out of memory.\n");
+        memo_destroy(memo);
+        thumbcache_close(thumbs);
+        tp_destroy(pool);
+        return 1;
+    }
+    Session session;
+    session_init(&session, ctx, NULL);
+    session.thumbs = thumbs;
+    session.memo = memo;
+    //Every change can be undone, within the history's memory limit
+    History *history = history_mb ? history_create(history_mb * 1024 * 1024) : NULL;
+    session.history = history;
+    char line[SESSION_LINE_MAX];
+
+    //Printing menu
+    printf("Welcome to the Image Utility (BMP only).\n");
+    session_print_menu(stdout);
+
+    //while true in C
+    while (1)
+    {
+        //get the command name
+        printf("\n> ");
+        if (!fgets(line, sizeof(line), stdin))
+            break;
+
+        // strip newline
+        line[strcspn(line, "\r\n")] = 0;
+
+        //If the user entered exit, leave the loop
+        if (session_execute(&session, line, stdout))
+            break;
+    }
+
+    session_free(&session);
+    history_destroy(history);
+    img_ctx_destroy(ctx);
+    memo_destroy(memo);
+    thumbcache_close(thumbs);
+    tp_destroy(pool);
     printf("Goodbye!\n");
     return 0;
 }
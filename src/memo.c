@@ -0,0 +1,403 @@
+#define _POSIX_C_SOURCE 200809L // mkstemp, fchmod
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+#include "image_internal.h"
+#include "../include/memo.h"
+#include "../include/threadpool.h"
+
+// Part of every key: bump when a kernel's output changes so results
+// written to disk by older builds are no longer found
+#define MEMO_VERSION 3
+
+#define DIR_MAX_LEN 4096
+
+// One cached result. Entries are reference counted so a copy can be made
+// outside the cache lock; an evicted entry is freed by its last user.
+typedef struct MemoEntry
+{
+    uint64_t key;
+    BMPImage *img;          // allocated with malloc (cache-private context)
+    size_t bytes;
+    int refs;
+    struct MemoEntry *prev; // towards most recently used
+    struct MemoEntry *next; // towards least recently used
+} MemoEntry;
+
+struct MemoCache
+{
+    tp_mutex lock;
+    char *dir;        // disk tier, NULL when memory only
+    MemoEntry *head;  // most recently used
+    MemoEntry *tail;  // least recently used
+    size_t bytes;
+    size_t budget;
+    uint64_t hits;
+    uint64_t disk_hits;
+    uint64_t misses;
+    uint64_t temp_serial; // names temporary files on Windows
+};
+
+static void put32(unsigned char *p, uint32_t v)
+{
+    for (int i = 0; i < 4; i++)
+        p[i] = (unsigned char)(v >> (8 * i));
+}
+
+// Key of op applied to the image identified by src. Only the parameters
+// the operation uses are encoded, in a fixed little-endian layout.
+static uint64_t op_key(uint64_t src, const MemoOp *op)
+{
+    unsigned char enc[1 + 4 * 4 + 8];
+    memset(enc, 0, sizeof(enc));
+    enc[0] = (unsigned char)op->kind;
+
+    int nargs = (op->kind == MEMO_CROP) ? 4 : (op->kind == MEMO_RESIZE) ? 2 : 0;
+    for (int i = 0; i < nargs; i++)
+        put32(enc + 1 + 4 * i, (uint32_t)op->args[i]);
+
+    if (op->kind == MEMO_ROTATE || op->kind == MEMO_SCALE)
+    {
+        double v = (op->value == 0.0) ? 0.0 : op->value; // -0 and +0 alike
+        uint64_t bits;
+        memcpy(&bits, &v, sizeof(bits));
+        put32(enc + 17, (uint32_t)bits);
+        put32(enc + 21, (uint32_t)(bits >> 32));
+    }
+
+    uint64_t key = img_hash_bytes(enc, sizeof(enc), src ^ ((uint64_t)MEMO_VERSION << 56));
+    return key ? key : 1;
+}
+
+static img_status run_op(imgctx *ctx, const BMPImage *src, const MemoOp *op, BMPImage **out)
+{
+    switch (op->kind)
+    {
+    case MEMO_ROTATE:
+        return img_rotate(ctx, src, op->value, out);
+    case MEMO_SCALE:
+        return img_scale(ctx, src, op->value, out);
+    case MEMO_RESIZE:
+        return img_resize(ctx, src, op->args[0], op->args[1], out);
+    case MEMO_CROP:
+        return img_crop(ctx, src, op->args[0], op->args[1], op->args[2], op->args[3], out);
+    }
+    return img_fail(ctx, IMG_ERR_ARG, "unknown operation %d", (int)op->kind);
+}
+
+static void disk_file(const MemoCache *cache, uint64_t key, const char *ext, char *buf, size_t len)
+{
+    snprintf(buf, len, "%s/%016llx.%s", cache->dir, (unsigned long long)key, ext);
+}
+
+MemoCache *memo_create(size_t budget_bytes, const char *disk_dir)
+{
+    if (disk_dir && strlen(disk_dir) >= DIR_MAX_LEN)
+        return NULL;
+    MemoCache *cache = (MemoCache *)calloc(1, sizeof(MemoCache));
+    if (!cache)
+        return NULL;
+    if (disk_dir)
+    {
+        size_t len = strlen(disk_dir);
+        cache->dir = (char *)malloc(len + 1);
+        if (!cache->dir)
+        {
+            free(cache);
+            return NULL;
+        }
+        memcpy(cache->dir, disk_dir, len + 1);
+    }
+    tp_mutex_init(&cache->lock);
+    cache->budget = budget_bytes;
+    return cache;
+}
+
+static void free_entry(MemoEntry *e)
+{
+    imgctx ctx;
+    img_ctx_init(&ctx, NULL, NULL);
+    img_free(&ctx, e->img);
+    free(e);
+}
+
+// Takes an entry out of the LRU list (lock held)
+static void unlink_entry(MemoCache *cache, MemoEntry *e)
+{
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        cache->head = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        cache->tail = e->prev;
+    e->prev = e->next = NULL;
+    cache->bytes -= e->bytes;
+}
+
+// Puts an entry at the most recently used end (lock held)
+static void push_front(MemoCache *cache, MemoEntry *e)
+{
+    e->prev = NULL;
+    e->next = cache->head;
+    if (cache->head)
+        cache->head->prev = e;
+    cache->head = e;
+    if (!cache->tail)
+        cache->tail = e;
+    cache->bytes += e->bytes;
+}
+
+// Drops an entry from the cache; it is freed now or by its last user (lock held)
+static void evict(MemoCache *cache, MemoEntry *e)
+{
+    unlink_entry(cache, e);
+    if (--e->refs == 0)
+        free_entry(e);
+}
+
+void memo_destroy(MemoCache *cache)
+{
+    if (!cache)
+        return;
+    while (cache->head)
+        evict(cache, cache->head);
+    tp_mutex_destroy(&cache->lock);
+    free(cache->dir);
+    free(cache);
+}
+
+// Releases a reference taken by a lookup
+static void put_entry(MemoCache *cache, MemoEntry *e)
+{
+    tp_mutex_lock(&cache->lock);
+    int last = (--e->refs == 0);
+    tp_mutex_unlock(&cache->lock);
+    if (last)
+        free_entry(e);
+}
+
+// Keeps a private copy of img in the memory tier
+static void remember(MemoCache *cache, uint64_t key, const BMPImage *img)
+{
+    if (img->dib.biSizeImage > cache->budget)
+        return;
+
+    imgctx own;
+    img_ctx_init(&own, NULL, NULL);
+    MemoEntry *e = (MemoEntry *)calloc(1, sizeof(MemoEntry));
+    if (!e || img_clone(&own, img, &e->img) != IMG_OK)
+    {
+        free(e);
+        return;
+    }
+    e->key = key;
+    e->bytes = img->dib.biSizeImage;
+    e->refs = 1;
+
+    tp_mutex_lock(&cache->lock);
+    // Another client may have stored the same result meanwhile
+    for (MemoEntry *old = cache->head; old; old = old->next)
+    {
+        if (old->key == key)
+        {
+            evict(cache, old);
+            break;
+        }
+    }
+    push_front(cache, e);
+    while (cache->bytes > cache->budget && cache->tail && cache->tail != e)
+        evict(cache, cache->tail);
+    tp_mutex_unlock(&cache->lock);
+}
+
+// Looks key up in memory, then on disk. Returns 1 with a copy in *out.
+static int fetch(MemoCache *cache, imgctx *ctx, uint64_t key, BMPImage **out)
+{
+    tp_mutex_lock(&cache->lock);
+    MemoEntry *found = NULL;
+    for (MemoEntry *e = cache->head; e; e = e->next)
+    {
+        if (e->key == key)
+        {
+            found = e;
+            found->refs++;
+            unlink_entry(cache, found);
+            push_front(cache, found);
+            cache->hits++;
+            break;
+        }
+    }
+    tp_mutex_unlock(&cache->lock);
+
+    if (found)
+    {
+        img_status st = img_clone(ctx, found->img, out);
+        put_entry(cache, found);
+        return st == IMG_OK;
+    }
+    if (!cache->dir)
+        return 0;
+
+    // The file was written by this cache: no need to hash it again
+    char file[DIR_MAX_LEN + 32];
+    disk_file(cache, key, "bmp", file, sizeof(file));
+    imgctx quiet;
+    img_ctx_init(&quiet, NULL, NULL);
+    BMPImage *img = NULL;
+    if (img_load(&quiet, file, &img) != IMG_OK)
+        return 0;
+    img->hash = key;
+
+    tp_mutex_lock(&cache->lock);
+    cache->disk_hits++;
+    tp_mutex_unlock(&cache->lock);
+    remember(cache, key, img);
+
+    img_status st = img_clone(ctx, img, out);
+    img_free(&quiet, img);
+    return st == IMG_OK;
+}
+
+// Creates a temporary file in the disk tier whose name no other process
+// sharing the directory can pick. Returns 0 on success.
+static int temp_file(MemoCache *cache, uint64_t key, char *buf, size_t len)
+{
+#ifdef _WIN32
+    tp_mutex_lock(&cache->lock);
+    unsigned long long serial = cache->temp_serial++;
+    tp_mutex_unlock(&cache->lock);
+    snprintf(buf, len, "%s/%016llx.%d.%llu.tmp", cache->dir, (unsigned long long)key, _getpid(), serial);
+    return 0;
+#else
+    (void)cache;
+    snprintf(buf, len, "%s/%016llx.tmp.XXXXXX", cache->dir, (unsigned long long)key);
+    int fd = mkstemp(buf);
+    if (fd < 0)
+        return -1;
+    fchmod(fd, 0644); // mkstemp makes it private; results are shared
+    close(fd);
+    return 0;
+#endif
+}
+
+// Writes a result to the disk tier through a temporary file, so readers
+// in other processes never see it half written
+static void store(MemoCache *cache, uint64_t key, const BMPImage *img)
+{
+    char tmp[DIR_MAX_LEN + 48];
+    char file[DIR_MAX_LEN + 32];
+    if (temp_file(cache, key, tmp, sizeof(tmp)) != 0)
+        return;
+    disk_file(cache, key, "bmp", file, sizeof(file));
+
+    imgctx quiet;
+    img_ctx_init(&quiet, NULL, NULL);
+    if (img_save(&quiet, tmp, img) != IMG_OK)
+    {
+        remove(tmp);
+        return;
+    }
+#ifdef _WIN32
+    remove(file); // rename does not replace on Windows
+#endif
+    if (rename(tmp, file) != 0)
+        remove(tmp);
+}
+
+img_status memo_apply(MemoCache *cache, imgctx *ctx, BMPImage *src, const MemoOp *op,
+                      BMPImage **out, int *hit)
+{
+    if (!ctx || !src || !src->data || !op || !out)
+        return ctx ? img_fail(ctx, IMG_ERR_ARG, "memo_apply: missing argument") : IMG_ERR_ARG;
+    if (hit)
+        *hit = 0;
+    if (!cache)
+        return run_op(ctx, src, op, out);
+
+    if (!src->hash)
+        src->hash = img_pixel_hash(src);
+    uint64_t key = op_key(src->hash, op);
+
+    // Hit: no pixel work beyond handing out a copy
+    if (fetch(cache, ctx, key, out))
+    {
+        if (hit)
+            *hit = 1;
+        return IMG_OK;
+    }
+
+    img_status st = run_op(ctx, src, op, out);
+    if (st != IMG_OK)
+        return st;
+    (*out)->hash = key;
+
+    tp_mutex_lock(&cache->lock);
+    cache->misses++;
+    tp_mutex_unlock(&cache->lock);
+    remember(cache, key, *out);
+    if (cache->dir)
+        store(cache, key, *out);
+    return IMG_OK;
+}
+
+img_status memo_apply_chain(MemoCache *cache, imgctx *ctx, BMPImage *src, const MemoOp *ops, int count,
+                            BMPImage **out)
+{
+    if (!ctx || !src || !src->data || !ops || count <= 0 || !out)
+        return ctx ? img_fail(ctx, IMG_ERR_ARG, "memo_apply_chain: missing argument") : IMG_ERR_ARG;
+
+    // Start after the longest prefix whose result is cached
+    BMPImage *cur = NULL;
+    int start = 0;
+    if (cache)
+    {
+        uint64_t keys[64];
+        if (count > 64)
+            return img_fail(ctx, IMG_ERR_ARG, "memo_apply_chain: at most 64 operations");
+        if (!src->hash)
+            src->hash = img_pixel_hash(src);
+        uint64_t key = src->hash;
+        for (int i = 0; i < count; i++)
+            keys[i] = key = op_key(key, &ops[i]);
+        for (int i = count - 1; i >= 0 && !cur; i--)
+        {
+            if (fetch(cache, ctx, keys[i], &cur))
+                start = i + 1;
+        }
+    }
+
+    for (int i = start; i < count; i++)
+    {
+        BMPImage *next = NULL;
+        img_status st = memo_apply(cache, ctx, cur ? cur : src, &ops[i], &next, NULL);
+        img_free(ctx, cur);
+        if (st != IMG_OK)
+            return st;
+        cur = next;
+    }
+    *out = cur;
+    return IMG_OK;
+}
+
+void memo_stats(MemoCache *cache, uint64_t *hits, uint64_t *disk_hits, uint64_t *misses, size_t *bytes)
+{
+    tp_mutex_lock(&cache->lock);
+    if (hits)
+        *hits = cache->hits;
+    if (disk_hits)
+        *disk_hits = cache->disk_hits;
+    if (misses)
+        *misses = cache->misses;
+    if (bytes)
+        *bytes = cache->bytes;
+    tp_mutex_unlock(&cache->lock);
+}
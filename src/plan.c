@@ -0,0 +1,629 @@
+#define _POSIX_C_SOURCE 200809L // mkstemp, ftruncate
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "image_internal.h"
+#include "../include/plan.h"
+#include "../include/threadpool.h"
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+// Peak memory here means bytes that must stay resident: heap and
+// copy-on-write pages. Clean pages of a mapped file and pages of the
+// temporary files of PLAN_TILED can be dropped or written back by the
+// kernel, so only the working set of a kernel over them is counted.
+
+// Strategies in order of speed; the first one that fits is chosen
+static const char *strategy_names[PLAN_COUNT] = {"memory", "mapped", "stream", "tiled"};
+
+// Allocations at least this large go to temporary files under PLAN_TILED
+#define TEMP_MIN_BYTES ((size_t)1 << 20)
+
+#define PATH_MAX_LEN 4096
+
+const char *plan_strategy_name(PlanStrategy strategy)
+{
+    return ((unsigned)strategy < PLAN_COUNT) ? strategy_names[strategy] : "?";
+}
+
+// Byte count with a binary unit suffix
+static void format_bytes(char *buf, size_t len, uint64_t bytes)
+{
+    const char *units[] = {"B", "KiB", "MiB", "GiB", "TiB"};
+    double v = (double)bytes;
+    int u = 0;
+    while (v >= 1024.0 && u < 4)
+    {
+        v /= 1024.0;
+        u++;
+    }
+    if (u == 0)
+        snprintf(buf, len, "%llu B", (unsigned long long)bytes);
+    else
+        snprintf(buf, len, "%.1f %s", v, units[u]);
+}
+
+void plan_print(const Plan *plan, FILE *out)
+{
+    char buf[32];
+    if (plan->budget == PLAN_UNAVAILABLE)
+        snprintf(buf, sizeof(buf), "no limit");
+    else
+        format_bytes(buf, sizeof(buf), plan->budget);
+    fprintf(out, "Plan for a %dx%d result, budget %s: %s\n", plan->width, plan->height, buf,
+            plan->strategy < PLAN_COUNT ? plan_strategy_name(plan->strategy) : "none fits");
+    for (int s = 0; s < PLAN_COUNT; s++)
+    {
+        if (plan->peak[s] == PLAN_UNAVAILABLE)
+            snprintf(buf, sizeof(buf), "n/a");
+        else
+            format_bytes(buf, sizeof(buf), plan->peak[s]);
+        fprintf(out, "  %-7s %12s%s\n", strategy_names[s], buf, (int)plan->strategy == s ? "  <- chosen" : "");
+    }
+}
+
+// Headers of src_path, with biSizeImage set to the size of the rows. Sets
+// *raw when the pixels are uncompressed 24/32-bit rows that can be mapped
+// or streamed as stored; other formats are decoded on load.
+static img_status read_headers(imgctx *ctx, const char *path, BMPImage *img, int *raw)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        return img_fail(ctx, IMG_ERR_IO, "cannot open %s", path);
+    memset(img, 0, sizeof(*img));
+    size_t got = fread(&img->header, 1, sizeof(BMPHeader), f);
+    got += fread(&img->dib, 1, sizeof(DIBHeader), f);
+    fseek(f, 0, SEEK_END);
+    long file_size = ftell(f);
+    fclose(f);
+
+    if (got != sizeof(BMPHeader) + sizeof(DIBHeader) || img->header.bfType != 0x4D42)
+        return img_fail(ctx, IMG_ERR_FORMAT, "%s is not a BMP file", path);
+    if (img->dib.biSize < sizeof(DIBHeader) || img->dib.biWidth <= 0 || img->dib.biHeight == 0 ||
+        img->dib.biHeight == INT32_MIN || img->header.bfOffBits < sizeof(BMPHeader) + img->dib.biSize)
+        return img_fail(ctx, IMG_ERR_FORMAT, "%s: invalid header", path);
+
+    *raw = (img->dib.biBitCount == 24 || img->dib.biBitCount == 32) && img->dib.biCompression == 0;
+    if (!*raw)
+    {
+        // Decoded to 24-bit, or 32-bit for 32-bit sources with alpha
+        img->dib.biBitCount = (img->dib.biBitCount == 32) ? 32 : 24;
+        img->dib.biCompression = 0;
+    }
+    uint64_t size = (uint64_t)img_row_size(img->dib.biWidth, img->dib.biBitCount) * (uint64_t)img_height(img);
+    if (size > 0xFFFFFFFFULL)
+        return img_fail(ctx, IMG_ERR_UNSUPPORTED, "%s: image too large", path);
+    img->dib.biSizeImage = (uint32_t)size;
+    if (*raw && (file_size < 0 || (uint64_t)file_size < img->header.bfOffBits + size))
+        return img_fail(ctx, IMG_ERR_FORMAT, "%s: truncated pixel data", path);
+    return IMG_OK;
+}
+
+// Size of the result of each step, checked as the kernels check them
+typedef struct {
+    int width, height;
+} Shape;
+
+static img_status walk_shapes(imgctx *ctx, const BMPImage *src, const MemoOp *ops, int count, Shape *shapes)
+{
+    shapes[0].width = src->dib.biWidth;
+    shapes[0].height = img_height(src);
+    for (int i = 0; i < count; i++)
+    {
+        Shape in = shapes[i];
+        Shape out = in;
+        const MemoOp *op = &ops[i];
+        switch (op->kind)
+        {
+        case MEMO_ROTATE:
+            break;
+        case MEMO_SCALE:
+            if (!(op->value > 0))
+                return img_fail(ctx, IMG_ERR_ARG, "plan: step %d: scale factor must be > 0", i + 1);
+            out.width = (int)(in.width * op->value);
+            out.height = (int)(in.height * op->value);
+            if (out.width <= 0 || out.height <= 0)
+                return img_fail(ctx, IMG_ERR_ARG, "plan: step %d: scale result would be empty", i + 1);
+            break;
+        case MEMO_RESIZE:
+            if (op->args[0] <= 0 || op->args[1] <= 0)
+                return img_fail(ctx, IMG_ERR_ARG, "plan: step %d: resize width and height must be > 0", i + 1);
+            out.width = op->args[0];
+            out.height = op->args[1];
+            break;
+        case MEMO_CROP:
+            if (op->args[2] <= 0 || op->args[3] <= 0 || op->args[0] < 0 || op->args[1] < 0 ||
+                (int64_t)op->args[0] + op->args[2] > in.width || (int64_t)op->args[1] + op->args[3] > in.height)
+                return img_fail(ctx, IMG_ERR_BOUNDS, "plan: step %d: crop rectangle out of bounds", i + 1);
+            out.width = op->args[2];
+            out.height = op->args[3];
+            break;
+        default:
+            return img_fail(ctx, IMG_ERR_ARG, "plan: step %d: unknown operation %d", i + 1, (int)op->kind);
+        }
+        if ((uint64_t)img_row_size(out.width, src->dib.biBitCount) * (uint64_t)out.height > 0xFFFFFFFFULL)
+            return img_fail(ctx, IMG_ERR_UNSUPPORTED, "plan: step %d: image of %dx%d exceeds the BMP size limit",
+                            i + 1, out.width, out.height);
+        shapes[i + 1] = out;
+    }
+    return IMG_OK;
+}
+
+static uint64_t max64(uint64_t a, uint64_t b)
+{
+    return a > b ? a : b;
+}
+
+static void estimate(const Shape *shapes, const MemoOp *ops, int count, int bits, int raw, uint64_t *peak)
+{
+    uint64_t tile = (uint64_t)IMG_TILE * IMG_TILE * (bits / 8);
+    uint64_t rows = 0, memory = 0, mapped = 0, tiled = 0;
+    int streamable = raw;
+    for (int i = 0; i <= count; i++)
+    {
+        uint64_t row = img_row_size(shapes[i].width, bits);
+        uint64_t size = row * (uint64_t)shapes[i].height;
+        rows += row;
+        memory = max64(memory, size);
+        if (i > 0)
+            mapped = max64(mapped, size);
+        if (i == count)
+        {
+            // Saving reads the rows in order
+            tiled = max64(tiled, IMG_TILE * row);
+            break;
+        }
+
+        uint64_t next_row = img_row_size(shapes[i + 1].width, bits);
+        uint64_t next = next_row * (uint64_t)shapes[i + 1].height;
+        memory = max64(memory, size + next);
+        if (i > 0)
+            mapped = max64(mapped, size + next);
+        if (ops[i].kind == MEMO_ROTATE)
+        {
+            // The source tiles under a band of output tiles lie along a
+            // strip at most as long as the image's diagonal and three
+            // tiles wide; converting in and out takes a band of rows
+            uint64_t tx = (uint64_t)(shapes[i].width + IMG_TILE - 1) / IMG_TILE;
+            uint64_t ty = (uint64_t)(shapes[i].height + IMG_TILE - 1) / IMG_TILE;
+            tiled = max64(tiled, (3 * (tx + ty) + tx) * tile);
+            tiled = max64(tiled, IMG_TILE * row + tx * tile);
+            streamable = 0;
+        }
+        else
+        {
+            // Nearest-neighbour scaling and cropping walk both images in row order
+            tiled = max64(tiled, IMG_TILE * (row + next_row));
+        }
+    }
+
+    peak[PLAN_MEMORY] = memory;
+    peak[PLAN_STREAM] = streamable ? rows : PLAN_UNAVAILABLE;
+#ifdef _WIN32
+    (void)mapped;
+    (void)tiled;
+    peak[PLAN_MAPPED] = PLAN_UNAVAILABLE;
+    peak[PLAN_TILED] = PLAN_UNAVAILABLE;
+#else
+    peak[PLAN_MAPPED] = raw ? mapped : PLAN_UNAVAILABLE;
+    peak[PLAN_TILED] = raw ? tiled : PLAN_UNAVAILABLE;
+#endif
+}
+
+img_status plan_make(imgctx *ctx, const char *src_path, const MemoOp *ops, int count, uint64_t budget_bytes,
+                     Plan *out)
+{
+    if (!ctx || !src_path || (!ops && count > 0) || count < 0 || !out)
+        return ctx ? img_fail(ctx, IMG_ERR_ARG, "plan_make: missing argument") : IMG_ERR_ARG;
+
+    BMPImage src;
+    int raw;
+    img_status status = read_headers(ctx, src_path, &src, &raw);
+    if (status != IMG_OK)
+        return status;
+
+    Shape *shapes = (Shape *)malloc(sizeof(Shape) * ((size_t)count + 1));
+    if (!shapes)
+        return img_fail(ctx, IMG_ERR_NOMEM, "out of memory");
+    status = walk_shapes(ctx, &src, ops, count, shapes);
+    if (status == IMG_OK)
+    {
+        estimate(shapes, ops, count, src.dib.biBitCount, raw, out->peak);
+        out->budget = budget_bytes;
+        out->width = shapes[count].width;
+        out->height = shapes[count].height;
+
+        int s = 0;
+        while (s < PLAN_COUNT && out->peak[s] > budget_bytes)
+            s++;
+        if (s < PLAN_COUNT)
+        {
+            out->strategy = (PlanStrategy)s;
+        }
+        else
+        {
+            uint64_t least = PLAN_UNAVAILABLE;
+            for (int i = 0; i < PLAN_COUNT; i++)
+                if (out->peak[i] < least)
+                    least = out->peak[i];
+            out->strategy = PLAN_COUNT;
+            status = img_fail(ctx, IMG_ERR_NOMEM, "plan: no strategy fits in %llu bytes (the smallest needs %llu)",
+                              (unsigned long long)budget_bytes, (unsigned long long)least);
+        }
+    }
+    free(shapes);
+    return status;
+}
+
+// ---------------------------------------------------------------------------
+// Whole images: memory, mapped and tiled
+// ---------------------------------------------------------------------------
+
+// Maps the pixels of src_path whatever their size
+static img_status map_source(imgctx *ctx, const char *path, BMPImage **out)
+{
+    BMPImage head;
+    int raw;
+    img_status status = read_headers(ctx, path, &head, &raw);
+    if (status != IMG_OK)
+        return status;
+    if (!raw)
+        return img_fail(ctx, IMG_ERR_UNSUPPORTED, "plan: %s: only uncompressed 24/32-bit files can be mapped", path);
+
+    BMPImage *img = (BMPImage *)img_alloc(ctx, sizeof(BMPImage));
+    FILE *f = img ? fopen(path, "rb") : NULL;
+    if (!f)
+    {
+        img_release(ctx, img);
+        return img ? img_fail(ctx, IMG_ERR_IO, "cannot open %s", path) : img_fail(ctx, IMG_ERR_NOMEM, "out of memory");
+    }
+    *img = head;
+    img_init_storage(img);
+    status = img_map_file(f, img->header.bfOffBits, img->dib.biSizeImage, img);
+    fclose(f);
+    if (status != IMG_OK)
+    {
+        img_release(ctx, img);
+        return img_fail(ctx, IMG_ERR_UNSUPPORTED, "plan: cannot map %s", path);
+    }
+    *out = img;
+    return IMG_OK;
+}
+
+// One step on a whole image; rotations go through tiles when tiled is set
+static img_status run_step(imgctx *ctx, BMPImage *src, const MemoOp *op, int tiled, BMPImage **out)
+{
+    if (!tiled || op->kind != MEMO_ROTATE)
+        return memo_apply(NULL, ctx, src, op, out, NULL);
+
+    img_tiled *in, *rotated;
+    img_status status = img_to_tiled(ctx, src, &in);
+    if (status != IMG_OK)
+        return status;
+    status = img_tiled_rotate(ctx, in, op->value, &rotated);
+    img_free_tiled(ctx, in);
+    if (status != IMG_OK)
+        return status;
+    status = img_from_tiled(ctx, rotated, out);
+    img_free_tiled(ctx, rotated);
+    return status;
+}
+
+static img_status run_whole(imgctx *ctx, const char *src_path, const MemoOp *ops, int count, const char *dst_path,
+                            int map, int tiled)
+{
+    BMPImage *cur;
+    img_status status = map ? map_source(ctx, src_path, &cur) : img_load(ctx, src_path, &cur);
+    if (status != IMG_OK)
+        return status;
+    for (int i = 0; i < count; i++)
+    {
+        BMPImage *next;
+        status = run_step(ctx, cur, &ops[i], tiled, &next);
+        img_free(ctx, cur);
+        if (status != IMG_OK)
+            return status;
+        cur = next;
+    }
+    status = img_save(ctx, dst_path, cur);
+    img_free(ctx, cur);
+    return status;
+}
+
+#ifndef _WIN32
+
+// Allocator of PLAN_TILED: large blocks are shared mappings of unlinked
+// files, small ones come from malloc. A 16-byte prefix holds the mapping
+// length, 0 for malloc.
+typedef struct {
+    char dir[PATH_MAX_LEN];
+} TempFiles;
+
+#define TEMP_PREFIX 16
+
+static void *temp_alloc(void *user, size_t size)
+{
+    TempFiles *temp = (TempFiles *)user;
+    size_t length = size + TEMP_PREFIX;
+    unsigned char *base;
+    if (size < TEMP_MIN_BYTES)
+    {
+        base = (unsigned char *)malloc(length);
+        if (!base)
+            return NULL;
+        length = 0;
+    }
+    else
+    {
+        char path[PATH_MAX_LEN + 32];
+        snprintf(path, sizeof(path), "%s/imagetool-XXXXXX", temp->dir);
+        int fd = mkstemp(path);
+        if (fd < 0)
+            return NULL;
+        unlink(path);
+        void *map = MAP_FAILED;
+        if (ftruncate(fd, (off_t)length) == 0)
+            map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED)
+            return NULL;
+        base = (unsigned char *)map;
+    }
+    memcpy(base, &length, sizeof(length));
+    return base + TEMP_PREFIX;
+}
+
+static void temp_release(void *user, void *ptr)
+{
+    (void)user;
+    if (!ptr)
+        return;
+    unsigned char *base = (unsigned char *)ptr - TEMP_PREFIX;
+    size_t length;
+    memcpy(&length, base, sizeof(length));
+    if (length)
+        munmap(base, length);
+    else
+        free(base);
+}
+
+static img_status run_tiled(imgctx *ctx, const char *src_path, const MemoOp *ops, int count, const char *dst_path,
+                            const char *temp_dir)
+{
+    TempFiles temp;
+    if (temp_dir)
+    {
+        snprintf(temp.dir, sizeof(temp.dir), "%s", temp_dir);
+    }
+    else
+    {
+        const char *slash = strrchr(dst_path, '/');
+        if (slash)
+            snprintf(temp.dir, sizeof(temp.dir), "%.*s", (int)(slash - dst_path), dst_path);
+        else
+            snprintf(temp.dir, sizeof(temp.dir), ".");
+        if (!temp.dir[0])
+            snprintf(temp.dir, sizeof(temp.dir), "/");
+    }
+
+    img_allocator files = {temp_alloc, temp_release, &temp};
+    imgctx *fctx = img_ctx_create(&files, img_ctx_pool(ctx));
+    if (!fctx)
+        return img_fail(ctx, IMG_ERR_NOMEM, "out of memory");
+    img_status status = run_whole(fctx, src_path, ops, count, dst_path, 1, 1);
+    if (status != IMG_OK)
+        img_fail(ctx, status, "%s", img_ctx_error(fctx));
+    img_ctx_destroy(fctx);
+    return status;
+}
+
+#endif
+
+// ---------------------------------------------------------------------------
+// Streaming
+// ---------------------------------------------------------------------------
+
+// A step of the chain holding the last row it produced. Every step reads
+// its input rows in increasing order, so one row per step is enough and
+// the file is read once from start to end.
+typedef struct {
+    const MemoOp *op; // NULL for the file
+    int width, height;
+    size_t stride;
+    unsigned char *row;
+    int index;        // row held, -1 before the first
+} Stage;
+
+typedef struct {
+    FILE *in;
+    Stage *stages;
+    int bpp;
+} Stream;
+
+static const unsigned char *stage_row(Stream *s, int i, int y)
+{
+    Stage *st = &s->stages[i];
+    if (st->index == y)
+        return st->row;
+
+    if (!st->op)
+    {
+        while (st->index < y)
+        {
+            if (fread(st->row, 1, st->stride, s->in) != st->stride)
+                return NULL;
+            st->index++;
+        }
+        return st->row;
+    }
+
+    const Stage *src = &s->stages[i - 1];
+    const MemoOp *op = st->op;
+    int bpp = s->bpp;
+    const unsigned char *in;
+    switch (op->kind)
+    {
+    case MEMO_CROP:
+        in = stage_row(s, i - 1, op->args[1] + y);
+        if (!in)
+            return NULL;
+        memcpy(st->row, in + (size_t)op->args[0] * bpp, (size_t)st->width * bpp);
+        break;
+    case MEMO_SCALE:
+        in = stage_row(s, i - 1, (int)(y / op->value));
+        if (!in)
+            return NULL;
+        for (int x = 0; x < st->width; x++)
+            memcpy(st->row + (size_t)x * bpp, in + (size_t)(int)(x / op->value) * bpp, bpp);
+        break;
+    case MEMO_RESIZE:
+        in = stage_row(s, i - 1, (int)(((int64_t)y * src->height) / st->height));
+        if (!in)
+            return NULL;
+        for (int x = 0; x < st->width; x++)
+            memcpy(st->row + (size_t)x * bpp, in + (size_t)(((int64_t)x * src->width) / st->width) * bpp, bpp);
+        break;
+    default:
+        return NULL;
+    }
+    st->index = y;
+    return st->row;
+}
+
+static img_status run_stream(imgctx *ctx, const char *src_path, const MemoOp *ops, int count, const char *dst_path)
+{
+    BMPImage head;
+    int raw;
+    img_status status = read_headers(ctx, src_path, &head, &raw);
+    if (status != IMG_OK)
+        return status;
+    if (!raw)
+        return img_fail(ctx, IMG_ERR_UNSUPPORTED, "plan: %s: only uncompressed 24/32-bit files can be streamed",
+                        src_path);
+    for (int i = 0; i < count; i++)
+        if (ops[i].kind == MEMO_ROTATE)
+            return img_fail(ctx, IMG_ERR_UNSUPPORTED, "plan: rotations cannot be streamed");
+
+    // The result goes to a new file first: dst_path may be the source
+    char part[PATH_MAX_LEN + 8];
+    if (snprintf(part, sizeof(part), "%s.part", dst_path) >= (int)sizeof(part))
+        return img_fail(ctx, IMG_ERR_ARG, "plan: path too long");
+
+    Stream s;
+    s.bpp = head.dib.biBitCount / 8;
+    s.stages = (Stage *)calloc((size_t)count + 1, sizeof(Stage));
+    Shape *shapes = (Shape *)malloc(sizeof(Shape) * ((size_t)count + 1));
+    s.in = fopen(src_path, "rb");
+    FILE *out = fopen(part, "wb");
+    status = IMG_OK;
+    if (!s.stages || !shapes || !s.in || !out)
+    {
+        status = (!s.stages || !shapes) ? img_fail(ctx, IMG_ERR_NOMEM, "out of memory")
+                 : !s.in   ? img_fail(ctx, IMG_ERR_IO, "cannot open %s", src_path)
+                           : img_fail(ctx, IMG_ERR_IO, "cannot create %s", part);
+        goto done;
+    }
+
+    status = walk_shapes(ctx, &head, ops, count, shapes);
+    if (status != IMG_OK)
+        goto done;
+    for (int i = 0; i <= count; i++)
+    {
+        Stage *st = &s.stages[i];
+        st->op = i ? &ops[i - 1] : NULL;
+        st->width = shapes[i].width;
+        st->height = shapes[i].height;
+        st->stride = img_row_size(st->width, head.dib.biBitCount);
+        st->index = -1;
+        // Zeroed once: the kernels' rows have zero padding
+        st->row = (unsigned char *)calloc(1, st->stride);
+        if (!st->row)
+        {
+            status = img_fail(ctx, IMG_ERR_NOMEM, "out of memory");
+            goto done;
+        }
+    }
+    if (fseek(s.in, head.header.bfOffBits, SEEK_SET) != 0)
+    {
+        status = img_fail(ctx, IMG_ERR_FORMAT, "%s: bad pixel data offset", src_path);
+        goto done;
+    }
+
+    // Headers as img_new_image and img_save would write them
+    {
+        const Stage *last = &s.stages[count];
+        BMPHeader header = head.header;
+        DIBHeader dib = head.dib;
+        dib.biSize = sizeof(DIBHeader);
+        dib.biWidth = last->width;
+        dib.biHeight = (head.dib.biHeight < 0) ? -last->height : last->height;
+        dib.biSizeImage = (uint32_t)(last->stride * (size_t)last->height);
+        header.bfOffBits = sizeof(BMPHeader) + sizeof(DIBHeader);
+        header.bfSize = header.bfOffBits + dib.biSizeImage;
+        size_t put = fwrite(&header, 1, sizeof(BMPHeader), out);
+        put += fwrite(&dib, 1, sizeof(DIBHeader), out);
+        for (int y = 0; y < last->height; y++)
+        {
+            const unsigned char *row = stage_row(&s, count, y);
+            if (!row)
+            {
+                status = img_fail(ctx, IMG_ERR_FORMAT, "%s: truncated pixel data", src_path);
+                goto done;
+            }
+            put += fwrite(row, 1, last->stride, out);
+        }
+        prof_io(PROF_SAVE, 0, put);
+        if (put != sizeof(BMPHeader) + sizeof(DIBHeader) + dib.biSizeImage)
+            status = img_fail(ctx, IMG_ERR_IO, "short write to %s", part);
+    }
+
+done:
+    if (out && fclose(out) != 0 && status == IMG_OK)
+        status = img_fail(ctx, IMG_ERR_IO, "short write to %s", part);
+    if (s.in)
+        fclose(s.in);
+    if (s.stages)
+        for (int i = 0; i <= count; i++)
+            free(s.stages[i].row);
+    free(s.stages);
+    free(shapes);
+    if (status == IMG_OK)
+    {
+        remove(dst_path);
+        if (rename(part, dst_path) != 0)
+            status = img_fail(ctx, IMG_ERR_IO, "cannot create %s", dst_path);
+    }
+    if (status != IMG_OK)
+        remove(part);
+    return status;
+}
+
+img_status plan_run(imgctx *ctx, const Plan *plan, const char *src_path, const MemoOp *ops, int count,
+                    const char *dst_path, const char *temp_dir)
+{
+    if (!ctx || !plan || !src_path || (!ops && count > 0) || count < 0 || !dst_path)
+        return ctx ? img_fail(ctx, IMG_ERR_ARG, "plan_run: missing argument") : IMG_ERR_ARG;
+
+    switch (plan->strategy)
+    {
+    case PLAN_MEMORY:
+        return run_whole(ctx, src_path, ops, count, dst_path, 0, 0);
+    case PLAN_MAPPED:
+        return run_whole(ctx, src_path, ops, count, dst_path, 1, 0);
+    case PLAN_STREAM:
+        return run_stream(ctx, src_path, ops, count, dst_path);
+    case PLAN_TILED:
+#ifdef _WIN32
+        (void)temp_dir;
+        return img_fail(ctx, IMG_ERR_UNSUPPORTED, "plan: tiled execution is not available on Windows");
+#else
+        return run_tiled(ctx, src_path, ops, count, dst_path, temp_dir);
+#endif
+    default:
+        return img_fail(ctx, IMG_ERR_ARG, "plan_run: no strategy");
+    }
+}
@@ -0,0 +1,234 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../include/profile.h"
+#include "../include/threadpool.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#if defined(_MSC_VER) && !defined(__clang__)
+volatile long prof_enabled = 0;
+#else
+_Atomic int prof_enabled = 0;
+#endif
+
+static ProfRecord records[PROF_OP_COUNT];
+
+// Guards the counters; several contexts may record from different threads
+static tp_mutex lock = TP_MUTEX_INIT;
+
+// Live pixel-buffer bytes across all images
+static uint64_t live_bytes = 0;
+
+static const char *op_names[PROF_OP_COUNT] = {
+    "load", "save", "fill", "rotate", "scale",
+    "resize", "crop", "embed", "extract", "clone", "shm", "thumb", "stats", "tone", "filter", "overlay",
+    "affine", "tile", "history", "scan"};
+
+static const char *json_path = NULL;
+
+// Monotonic clock in nanoseconds
+uint64_t prof_now_ns(void)
+{
+#ifdef _WIN32
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER now;
+    if (freq.QuadPart == 0)
+        QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (uint64_t)((double)now.QuadPart * 1e9 / (double)freq.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+void prof_enable(int on)
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+    prof_enabled = on ? 1 : 0;
+#else
+    atomic_store_explicit(&prof_enabled, on ? 1 : 0, memory_order_relaxed);
+#endif
+}
+
+void prof_reset(void)
+{
+    tp_mutex_lock(&lock);
+    memset(records, 0, sizeof(records));
+    tp_mutex_unlock(&lock);
+}
+
+void prof_record_call(ProfOp op, uint64_t wall_ns)
+{
+    tp_mutex_lock(&lock);
+    records[op].calls++;
+    records[op].wall_ns += wall_ns;
+    if (live_bytes > records[op].peak_live)
+        records[op].peak_live = live_bytes;
+    tp_mutex_unlock(&lock);
+}
+
+void prof_record_io(ProfOp op, uint64_t read, uint64_t written)
+{
+    tp_mutex_lock(&lock);
+    records[op].bytes_read += read;
+    records[op].bytes_written += written;
+    tp_mutex_unlock(&lock);
+}
+
+void prof_record_alloc(ProfOp op, uint64_t bytes)
+{
+    tp_mutex_lock(&lock);
+    records[op].bytes_allocated += bytes;
+    live_bytes += bytes;
+    if (live_bytes > records[op].peak_live)
+        records[op].peak_live = live_bytes;
+    tp_mutex_unlock(&lock);
+}
+
+void prof_record_free(uint64_t bytes)
+{
+    // Buffers allocated before profiling was enabled were never counted
+    tp_mutex_lock(&lock);
+    live_bytes = (bytes > live_bytes) ? 0 : live_bytes - bytes;
+    tp_mutex_unlock(&lock);
+}
+
+void prof_record_pixels(ProfOp op, uint64_t pixels)
+{
+    tp_mutex_lock(&lock);
+    records[op].pixels += pixels;
+    tp_mutex_unlock(&lock);
+}
+
+const ProfRecord *prof_get(ProfOp op)
+{
+    return &records[op];
+}
+
+const char *prof_op_name(ProfOp op)
+{
+    return op_names[op];
+}
+
+// Formats a byte count with a binary unit suffix
+static void format_bytes(char *buf, size_t len, uint64_t bytes)
+{
+    const char *units[] = {"B", "KiB", "MiB", "GiB", "TiB"};
+    double v = (double)bytes;
+    int u = 0;
+    while (v >= 1024.0 && u < 4)
+    {
+        v /= 1024.0;
+        u++;
+    }
+    if (u == 0)
+        snprintf(buf, len, "%llu B", (unsigned long long)bytes);
+    else
+        snprintf(buf, len, "%.1f %s", v, units[u]);
+}
+
+// Copies the counters under the lock, so a table is never torn by a
+// call recording on another thread
+static uint64_t snapshot(ProfRecord copy[PROF_OP_COUNT])
+{
+    tp_mutex_lock(&lock);
+    memcpy(copy, records, sizeof(records));
+    uint64_t live = live_bytes;
+    tp_mutex_unlock(&lock);
+    return live;
+}
+
+void prof_print_table(FILE *out)
+{
+    ProfRecord copy[PROF_OP_COUNT];
+    uint64_t live_now = snapshot(copy);
+    fprintf(out, "%-8s %7s %10s %10s %11s %11s %11s %11s %10s %9s\n",
+            "op", "calls", "total ms", "avg ms", "read", "written",
+            "allocated", "peak live", "pixels", "Mpix/s");
+
+    for (int i = 0; i < PROF_OP_COUNT; i++)
+    {
+        const ProfRecord *r = &copy[i];
+        if (r->calls == 0)
+            continue;
+
+        char rd[16], wr[16], al[16], pk[16];
+        format_bytes(rd, sizeof(rd), r->bytes_read);
+        format_bytes(wr, sizeof(wr), r->bytes_written);
+        format_bytes(al, sizeof(al), r->bytes_allocated);
+        format_bytes(pk, sizeof(pk), r->peak_live);
+
+        double total_ms = (double)r->wall_ns / 1e6;
+        double mpix = (r->wall_ns > 0) ? (double)r->pixels * 1e3 / (double)r->wall_ns : 0.0;
+
+        fprintf(out, "%-8s %7llu %10.3f %10.3f %11s %11s %11s %11s %10llu %9.1f\n",
+                op_names[i], (unsigned long long)r->calls, total_ms,
+                total_ms / (double)r->calls, rd, wr, al, pk,
+                (unsigned long long)r->pixels, mpix);
+    }
+
+    char live[16];
+    format_bytes(live, sizeof(live), live_now);
+    fprintf(out, "live pixel buffers: %s%s\n", live, prof_is_enabled() ? "" : " (profiling off)");
+}
+
+void prof_write_json(FILE *out)
+{
+    ProfRecord copy[PROF_OP_COUNT];
+    uint64_t live_now = snapshot(copy);
+    fprintf(out, "{\n  \"live_bytes\": %llu,\n  \"operations\": {", (unsigned long long)live_now);
+    int first = 1;
+    for (int i = 0; i < PROF_OP_COUNT; i++)
+    {
+        const ProfRecord *r = &copy[i];
+        if (r->calls == 0)
+            continue;
+        fprintf(out, "%s\n    \"%s\": {\"calls\": %llu, \"wall_ns\": %llu, \"bytes_read\": %llu, "
+                     "\"bytes_written\": %llu, \"bytes_allocated\": %llu, \"peak_live\": %llu, "
+                     "\"pixels\": %llu}",
+                first ? "" : ",", op_names[i],
+                (unsigned long long)r->calls, (unsigned long long)r->wall_ns,
+                (unsigned long long)r->bytes_read, (unsigned long long)r->bytes_written,
+                (unsigned long long)r->bytes_allocated, (unsigned long long)r->peak_live,
+                (unsigned long long)r->pixels);
+        first = 0;
+    }
+    fprintf(out, "%s}\n}\n", first ? "" : "\n  ");
+}
+
+// atexit handler for IMAGETOOL_STATS_JSON
+static void dump_json_at_exit(void)
+{
+    FILE *f = fopen(json_path, "w");
+    if (!f)
+    {
+        perror("IMAGETOOL_STATS_JSON");
+        return;
+    }
+    prof_write_json(f);
+    fclose(f);
+}
+
+void prof_init_from_env(void)
+{
+    const char *on = getenv("IMAGETOOL_STATS");
+    if (on && *on && strcmp(on, "0") != 0)
+        prof_enable(1);
+
+    const char *path = getenv("IMAGETOOL_STATS_JSON");
+    if (path && *path)
+    {
+        json_path = path;
+        prof_enable(1);
+        atexit(dump_json_at_exit);
+    }
+}
@@ -0,0 +1,311 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "reference.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+// Nothing here shares code with the library, so a change to a library
+// helper cannot change the reference along with the kernel it checks
+
+static size_t row_size(int width, int bits_per_pixel)
+{
+    return (((size_t)width * (size_t)bits_per_pixel + 31) / 32) * 4;
+}
+
+static int height_of(const BMPImage *img)
+{
+    return img->dib.biHeight < 0 ? -img->dib.biHeight : img->dib.biHeight;
+}
+
+static int bytes_per_pixel(const BMPImage *img)
+{
+    return img->dib.biBitCount / 8;
+}
+
+BMPImage *ref_new_image(const BMPImage *tmpl, int width, int height)
+{
+    size_t stride = row_size(width, tmpl->dib.biBitCount);
+    BMPImage *img = (BMPImage *)malloc(sizeof(BMPImage));
+    if (!img)
+        return NULL;
+    img->header = tmpl->header;
+    img->dib = tmpl->dib;
+    img->dib.biWidth = width;
+    img->dib.biHeight = tmpl->dib.biHeight < 0 ? -height : height;
+    img->dib.biSizeImage = (uint32_t)(stride * height);
+    img->header.bfSize = img->header.bfOffBits + img->dib.biSizeImage;
+    img->mapping = NULL;
+    img->mapping_size = 0;
+    img->mapping_fd = -1;
+    img->hash = 0;
+    img->data = (unsigned char *)calloc(stride * height, 1);
+    if (!img->data)
+    {
+        free(img);
+        return NULL;
+    }
+    return img;
+}
+
+void ref_fill_rect(BMPImage *img, const unsigned char color[3], int x, int y, int width, int height)
+{
+    size_t stride = row_size(img->dib.biWidth, img->dib.biBitCount);
+    int bpp = bytes_per_pixel(img);
+    for (int row = y; row < y + height; row++)
+    {
+        for (int col = x; col < x + width; col++)
+        {
+            unsigned char *p = img->data + (size_t)row * stride + (size_t)col * bpp;
+            p[0] = color[2];
+            p[1] = color[1];
+            p[2] = color[0];
+        }
+    }
+}
+
+// round(v) as the original rotate_bmp took it, -1 for coordinates far
+// outside any image (which (int) could not hold)
+static int round_coord(double v)
+{
+    return (v > -1e9 && v < 1e9) ? (int)round(v) : -1;
+}
+
+BMPImage *ref_affine(const BMPImage *src, const double m[6])
+{
+    int width = src->dib.biWidth;
+    int height = height_of(src);
+    int bpp = bytes_per_pixel(src);
+    size_t stride = row_size(width, src->dib.biBitCount);
+    BMPImage *dst = ref_new_image(src, width, height);
+    if (!dst)
+        return NULL;
+
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            int sx = round_coord(m[0] * x + m[1] * y + m[2]);
+            int sy = round_coord(m[3] * x + m[4] * y + m[5]);
+            if (sx < 0 || sx >= width || sy < 0 || sy >= height)
+                continue;
+            for (int c = 0; c < bpp; c++)
+                dst->data[(size_t)y * stride + (size_t)x * bpp + c] = src->data[(size_t)sy * stride + (size_t)sx * bpp + c];
+        }
+    }
+    return dst;
+}
+
+// The original rotate_bmp, only extended to 32-bit pixels and top-down rows
+BMPImage *ref_rotate(const BMPImage *src, double angle_degrees)
+{
+    // Getting info about the image
+    int width = src->dib.biWidth;
+    int height = height_of(src);
+    int bpp = bytes_per_pixel(src);
+    size_t row_padded = row_size(width, src->dib.biBitCount);
+
+    // Create a new image for result, black initially
+    BMPImage *dst = ref_new_image(src, width, height);
+    if (!dst)
+        return NULL;
+
+    // Rotation setup
+    double angle = angle_degrees * M_PI / 180.0;
+    double cosA = cos(angle);
+    double sinA = sin(angle);
+
+    double cx = width / 2.0;
+    double cy = height / 2.0;
+
+    size_t dst_row_padded = row_padded;
+
+    // For each pixel in destination
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            // Map back to source
+            double srcX = cosA * (x - cx) + sinA * (y - cy) + cx;
+            double srcY = -sinA * (x - cx) + cosA * (y - cy) + cy;
+
+            int srcXi = (int)round(srcX);
+            int srcYi = (int)round(srcY);
+
+            if (srcXi >= 0 && srcXi < width && srcYi >= 0 && srcYi < height)
+            {
+                unsigned char *dstPixel = dst->data + y * dst_row_padded + x * bpp;
+                unsigned char *srcPixel = src->data + srcYi * row_padded + srcXi * bpp;
+
+                for (int c = 0; c < bpp; c++)
+                    dstPixel[c] = srcPixel[c];
+            }
+        }
+    }
+
+    return dst;
+}
+
+BMPImage *ref_scale(const BMPImage *src, double factor)
+{
+    int newW = (int)(src->dib.biWidth * factor);
+    int newH = (int)(height_of(src) * factor);
+    if (!(factor > 0) || newW <= 0 || newH <= 0)
+        return NULL;
+    int bpp = bytes_per_pixel(src);
+    size_t srcStride = row_size(src->dib.biWidth, src->dib.biBitCount);
+    size_t dstStride = row_size(newW, src->dib.biBitCount);
+    BMPImage *dst = ref_new_image(src, newW, newH);
+    if (!dst)
+        return NULL;
+
+    for (int y = 0; y < newH; y++)
+    {
+        int srcY = (int)(y / factor);
+        for (int x = 0; x < newW; x++)
+        {
+            int srcX = (int)(x / factor);
+            for (int c = 0; c < bpp; c++)
+                dst->data[(size_t)y * dstStride + (size_t)x * bpp + c] = src->data[(size_t)srcY * srcStride + (size_t)srcX * bpp + c];
+        }
+    }
+    return dst;
+}
+
+BMPImage *ref_resize(const BMPImage *src, int new_width, int new_height)
+{
+    if (new_width <= 0 || new_height <= 0)
+        return NULL;
+    int src_width = src->dib.biWidth;
+    int src_height = height_of(src);
+    int bpp = bytes_per_pixel(src);
+    size_t srcStride = row_size(src_width, src->dib.biBitCount);
+    size_t dstStride = row_size(new_width, src->dib.biBitCount);
+    BMPImage *dst = ref_new_image(src, new_width, new_height);
+    if (!dst)
+        return NULL;
+
+    for (int y = 0; y < new_height; y++)
+    {
+        int src_y = (int)(((int64_t)y * src_height) / new_height);
+        for (int x = 0; x < new_width; x++)
+        {
+            int src_x = (int)(((int64_t)x * src_width) / new_width);
+            for (int c = 0; c < bpp; c++)
+                dst->data[(size_t)y * dstStride + (size_t)x * bpp + c] = src->data[(size_t)src_y * srcStride + (size_t)src_x * bpp + c];
+        }
+    }
+    return dst;
+}
+
+BMPImage *ref_crop(const BMPImage *src, int x, int y, int width, int height)
+{
+    if (width <= 0 || height <= 0 || x < 0 || y < 0 || x + width > src->dib.biWidth || y + height > height_of(src))
+        return NULL;
+    int bpp = bytes_per_pixel(src);
+    size_t srcStride = row_size(src->dib.biWidth, src->dib.biBitCount);
+    size_t dstStride = row_size(width, src->dib.biBitCount);
+    BMPImage *dst = ref_new_image(src, width, height);
+    if (!dst)
+        return NULL;
+
+    for (int row = 0; row < height; row++)
+        for (int col = 0; col < width * bpp; col++)
+            dst->data[(size_t)row * dstStride + col] = src->data[(size_t)(y + row) * srcStride + (size_t)x * bpp + col];
+    return dst;
+}
+
+// Address of carrier byte i: channel bytes of the pixels in visual order
+// (top row first), row padding skipped
+static unsigned char *carrier_byte(const BMPImage *img, uint64_t i)
+{
+    int bpp = bytes_per_pixel(img);
+    uint64_t row_bytes = (uint64_t)img->dib.biWidth * bpp;
+    int row = (int)(i / row_bytes);
+    int stored = img->dib.biHeight > 0 ? height_of(img) - 1 - row : row;
+    return img->data + (size_t)stored * row_size(img->dib.biWidth, img->dib.biBitCount) + (size_t)(i % row_bytes);
+}
+
+// Payload bit i: a 32-bit little-endian length, then the message bytes,
+// each byte most significant bit first
+static int payload_bit(uint32_t len, const char *message, uint64_t i)
+{
+    uint64_t byte = i / 8;
+    unsigned char v = byte < 4 ? (unsigned char)(len >> (8 * byte)) : (unsigned char)message[byte - 4];
+    return (v >> (7 - i % 8)) & 1;
+}
+
+int ref_embed(BMPImage *img, const char *message, int use_msb)
+{
+    uint32_t len = (uint32_t)strlen(message);
+    uint64_t usable = (uint64_t)img->dib.biWidth * height_of(img) * bytes_per_pixel(img);
+    uint64_t bits = 32 + (uint64_t)len * 8;
+    if (bits > usable)
+        return -1;
+
+    unsigned char mask = use_msb ? 0x80 : 0x01;
+    for (uint64_t i = 0; i < bits; i++)
+    {
+        unsigned char *p = carrier_byte(img, i);
+        *p = payload_bit(len, message, i) ? (unsigned char)(*p | mask) : (unsigned char)(*p & ~mask);
+    }
+    return 0;
+}
+
+char *ref_extract(const BMPImage *img, int use_msb, uint32_t *length)
+{
+    uint64_t usable = (uint64_t)img->dib.biWidth * height_of(img) * bytes_per_pixel(img);
+    unsigned char mask = use_msb ? 0x80 : 0x01;
+    if (usable < 32)
+        return NULL;
+
+    unsigned char header[4] = {0, 0, 0, 0};
+    for (uint64_t i = 0; i < 32; i++)
+        if (*carrier_byte(img, i) & mask)
+            header[i / 8] |= (unsigned char)(1 << (7 - i % 8));
+    uint32_t len = header[0] | (header[1] << 8) | (header[2] << 16) | ((uint32_t)header[3] << 24);
+    if ((uint64_t)len * 8 > usable - 32)
+        return NULL;
+
+    char *msg = (char *)calloc((size_t)len + 1, 1);
+    if (!msg)
+        return NULL;
+    for (uint64_t i = 0; i < (uint64_t)len * 8; i++)
+        if (*carrier_byte(img, 32 + i) & mask)
+            msg[i / 8] |= (char)(1 << (7 - i % 8));
+    *length = len;
+    return msg;
+}
+
+void ref_apply_lut(BMPImage *img, const img_lut *lut)
+{
+    size_t stride = row_size(img->dib.biWidth, img->dib.biBitCount);
+    int bpp = bytes_per_pixel(img);
+    for (int y = 0; y < height_of(img); y++)
+        for (int x = 0; x < img->dib.biWidth; x++)
+            for (int c = 0; c < 3; c++)
+            {
+                unsigned char *p = img->data + (size_t)y * stride + (size_t)x * bpp + c;
+                *p = lut->table[c][*p];
+            }
+}
+
+void ref_grayscale(BMPImage *img)
+{
+    size_t stride = row_size(img->dib.biWidth, img->dib.biBitCount);
+    int bpp = bytes_per_pixel(img);
+    for (int y = 0; y < height_of(img); y++)
+    {
+        for (int x = 0; x < img->dib.biWidth; x++)
+        {
+            unsigned char *p = img->data + (size_t)y * stride + (size_t)x * bpp;
+            // BT.601 luma in 8.8 fixed point, rounded
+            unsigned char g = (unsigned char)((29 * p[0] + 150 * p[1] + 77 * p[2] + 128) >> 8);
+            p[0] = g;
+            p[1] = g;
+            p[2] = g;
+        }
+    }
+}
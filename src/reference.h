@@ -0,0 +1,36 @@
+#ifndef REFERENCE_H
+#define REFERENCE_H
+
+// Reference kernels for the differential tests (src/test.c); built into
+// the test program only. Each is the plainest serial code for what the
+// library computes: one pixel, one byte at a time, no tables, blocking,
+// SIMD or threads. The optimized kernels must match them byte for byte,
+// row padding included, so change both together. ref_rotate is the
+// original rotate_bmp itself; ref_affine rounds the exact coordinate the
+// same way.
+//
+// Images are allocated with malloc like the legacy API's (free_bmp), with
+// zeroed padding; functions returning an image give NULL for arguments the
+// library would reject.
+
+#include "../include/image.h"
+
+BMPImage *ref_new_image(const BMPImage *tmpl, int width, int height);
+
+void ref_fill_rect(BMPImage *img, const unsigned char color[3], int x, int y, int width, int height);
+BMPImage *ref_affine(const BMPImage *src, const double m[6]);
+BMPImage *ref_rotate(const BMPImage *src, double angle_degrees);
+BMPImage *ref_scale(const BMPImage *src, double factor);
+BMPImage *ref_resize(const BMPImage *src, int new_width, int new_height);
+BMPImage *ref_crop(const BMPImage *src, int x, int y, int width, int height);
+
+// 0 on success, -1 when the message does not fit
+int ref_embed(BMPImage *img, const char *message, int use_msb);
+// malloc'ed message of *length bytes plus a terminator, NULL when the
+// declared length does not fit
+char *ref_extract(const BMPImage *img, int use_msb, uint32_t *length);
+
+void ref_apply_lut(BMPImage *img, const img_lut *lut);
+void ref_grayscale(BMPImage *img);
+
+#endif
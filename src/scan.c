@@ -0,0 +1,198 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "image_internal.h"
+#include "../include/scan.h"
+#include "../include/threadpool.h"
+
+// Payload carrier bytes read per call when extracting a message
+#define SCAN_CHUNK 65536
+
+// Where the carrier bytes of an image lie in its file: the channel bytes
+// of its pixels in visual order (top row first), row padding skipped, as
+// img_embed writes them
+typedef struct {
+    FILE *file;
+    uint64_t offset;    // of the stored pixel rows
+    size_t stride;
+    int height;
+    int bottom_up;
+    uint64_t row_bytes; // carrier bytes per row
+    uint64_t bytes_read;
+} Carrier;
+
+// Reads carrier bytes first .. first + count - 1, one read per row they touch
+static int read_carrier(Carrier *c, uint64_t first, size_t count, unsigned char *buf)
+{
+    while (count > 0)
+    {
+        uint64_t row = first / c->row_bytes;
+        uint64_t col = first % c->row_bytes;
+        size_t n = (c->row_bytes - col < count) ? (size_t)(c->row_bytes - col) : count;
+        uint64_t stored = c->bottom_up ? (uint64_t)c->height - 1 - row : row;
+        if (fseek(c->file, (long)(c->offset + stored * c->stride + col), SEEK_SET) != 0 ||
+            fread(buf, 1, n, c->file) != n)
+            return 0;
+        c->bytes_read += n;
+        buf += n;
+        first += n;
+        count -= n;
+    }
+    return 1;
+}
+
+static img_status scan_open(imgctx *ctx, const char *path, FILE *file, Carrier *c, uint64_t *usable)
+{
+    BMPImage head;
+    size_t got = fread(&head.header, 1, sizeof(BMPHeader), file);
+    got += fread(&head.dib, 1, sizeof(DIBHeader), file);
+    c->bytes_read = got;
+    if (got != sizeof(BMPHeader) + sizeof(DIBHeader) || head.header.bfType != 0x4D42)
+        return img_fail(ctx, IMG_ERR_FORMAT, "%s is not a BMP file", path);
+    if (head.dib.biSize < sizeof(DIBHeader) || head.dib.biWidth <= 0 || head.dib.biHeight == 0 ||
+        head.dib.biHeight == INT32_MIN || head.header.bfOffBits < sizeof(BMPHeader) + head.dib.biSize)
+        return img_fail(ctx, IMG_ERR_FORMAT, "%s: invalid header", path);
+
+    // Pixels as img_load keeps them: uncompressed, or 32-bit bit fields in BGRA order
+    int bits = head.dib.biBitCount;
+    int stored = (bits == 24 || bits == 32) &&
+                 (head.dib.biCompression == 0 || (head.dib.biCompression == 3 && img_plain_bitfields(file, &head)));
+    if (!stored)
+        return img_fail(ctx, IMG_ERR_UNSUPPORTED, "scan: %s: only 24-bit or 32-bit BMP supported", path);
+
+    c->file = file;
+    c->offset = head.header.bfOffBits;
+    c->stride = img_row_size(head.dib.biWidth, bits);
+    c->height = img_height(&head);
+    c->bottom_up = head.dib.biHeight > 0;
+    c->row_bytes = (uint64_t)head.dib.biWidth * (uint64_t)(bits / 8);
+    *usable = c->row_bytes * (uint64_t)c->height;
+    return IMG_OK;
+}
+
+// Bits of carrier bytes, most significant first in each output byte
+static void gather_bits(const unsigned char *carrier, size_t count, uint64_t first_bit, int use_msb,
+                        unsigned char *out)
+{
+    unsigned char mask = use_msb ? 0x80 : 0x01;
+    for (size_t i = 0; i < count; i++)
+    {
+        uint64_t bit = first_bit + i;
+        if (carrier[i] & mask)
+            out[bit / 8] |= (unsigned char)(1 << (7 - bit % 8));
+    }
+}
+
+static img_status scan_impl(imgctx *ctx, const char *path, FILE *file, int use_msb, uint32_t *length,
+                            char **message, Carrier *c)
+{
+    uint64_t usable = 0;
+    img_status status = scan_open(ctx, path, file, c, &usable);
+    if (status != IMG_OK)
+        return status;
+    if (usable < 32)
+        return img_fail(ctx, IMG_ERR_CAPACITY, "scan: %s: image too small to contain length header", path);
+
+    // The little-endian length prefix is the first 32 carrier bytes
+    unsigned char carrier[32];
+    unsigned char len_bytes[4] = {0, 0, 0, 0};
+    if (!read_carrier(c, 0, 32, carrier))
+        return img_fail(ctx, IMG_ERR_FORMAT, "%s: truncated pixel data", path);
+    gather_bits(carrier, 32, 0, use_msb, len_bytes);
+    uint32_t msg_len = (uint32_t)len_bytes[0] | ((uint32_t)len_bytes[1] << 8) | ((uint32_t)len_bytes[2] << 16) |
+                       ((uint32_t)len_bytes[3] << 24);
+    if ((uint64_t)msg_len * 8ULL > usable - 32ULL)
+        return img_fail(ctx, IMG_ERR_CAPACITY, "scan: %s: declared message length %u exceeds capacity", path,
+                        msg_len);
+    *length = msg_len;
+    if (!message)
+        return IMG_OK;
+
+    char *msg = (char *)img_alloc(ctx, (size_t)msg_len + 1);
+    unsigned char *chunk = (unsigned char *)malloc(SCAN_CHUNK);
+    if (!msg || !chunk)
+    {
+        img_release(ctx, msg);
+        free(chunk);
+        return img_fail(ctx, IMG_ERR_NOMEM, "out of memory");
+    }
+    memset(msg, 0, (size_t)msg_len + 1);
+    uint64_t bits = (uint64_t)msg_len * 8ULL;
+    for (uint64_t done = 0; done < bits;)
+    {
+        size_t n = (bits - done < SCAN_CHUNK) ? (size_t)(bits - done) : SCAN_CHUNK;
+        if (!read_carrier(c, 32 + done, n, chunk))
+        {
+            img_release(ctx, msg);
+            free(chunk);
+            return img_fail(ctx, IMG_ERR_FORMAT, "%s: truncated pixel data", path);
+        }
+        gather_bits(chunk, n, done, use_msb, (unsigned char *)msg);
+        done += n;
+    }
+    free(chunk);
+    *message = msg;
+    return IMG_OK;
+}
+
+img_status scan_file(imgctx *ctx, const char *path, int use_msb, uint32_t *length, char **message)
+{
+    if (!ctx || !path || !length)
+        return ctx ? img_fail(ctx, IMG_ERR_ARG, "scan_file: missing argument") : IMG_ERR_ARG;
+
+    ProfScope scope;
+    prof_begin(&scope, PROF_SCAN);
+
+    FILE *file = fopen(path, "rb");
+    if (!file)
+    {
+        prof_end(&scope);
+        return img_fail(ctx, IMG_ERR_IO, "cannot open %s", path);
+    }
+    Carrier c;
+    memset(&c, 0, sizeof(c));
+    img_status status = scan_impl(ctx, path, file, use_msb, length, message, &c);
+    fclose(file);
+
+    prof_io(PROF_SCAN, c.bytes_read, 0);
+    prof_end(&scope);
+    return status;
+}
+
+typedef struct {
+    ScanResult *results;
+    int use_msb;
+    int read_messages;
+} ScanJob;
+
+static void scan_range(void *arg, int begin, int end)
+{
+    ScanJob *job = (ScanJob *)arg;
+
+    // A context per task: contexts are not shared between threads
+    imgctx ctx;
+    img_ctx_init(&ctx, NULL, NULL);
+    for (int i = begin; i < end; i++)
+    {
+        ScanResult *r = &job->results[i];
+        r->length = 0;
+        r->message = NULL;
+        r->status = scan_file(&ctx, r->path, job->use_msb, &r->length, job->read_messages ? &r->message : NULL);
+    }
+}
+
+void scan_files(ThreadPool *pool, ScanResult *results, int count, int use_msb, int read_messages)
+{
+    // One file per task: the time goes to opening and seeking, not pixels
+    ScanJob job = {results, use_msb, read_messages};
+    tp_parallel_for(pool, count, 1, scan_range, &job);
+}
+
+void scan_free_results(ScanResult *results, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        free(results[i].message);
+        results[i].message = NULL;
+    }
+}
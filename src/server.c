@@ -0,0 +1,330 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../include/server.h"
+
+#ifdef _WIN32
+
+int server_run(const char *socket_path, int nthreads, size_t cache_bytes, ThumbCache *thumbs,
+               MemoCache *memo)
+{
+    (void)socket_path;
+    (void)nthreads;
+    (void)cache_bytes;
+    (void)thumbs;
+    (void)memo;
+    fprintf(stderr, "Server mode needs Unix domain sockets and is not available on Windows.\n");
+    return 1;
+}
+
+#else
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "../include/commands.h"
+#include "../include/imgcache.h"
+#include "../include/profile.h"
+#include "../include/threadpool.h"
+
+// Shared by all connections
+typedef struct {
+    ThreadPool *pool;
+    ImageCache *cache;
+    ThumbCache *thumbs;
+    MemoCache *memo;
+    pthread_mutex_t lock;   // guards the client list below
+    pthread_cond_t idle;    // signalled when the last client leaves
+    int *clients;           // sockets of connected clients
+    int nclients;
+    int capacity;
+} Server;
+
+// One connection
+typedef struct {
+    Server *srv;
+    int fd;
+} Client;
+
+// One command line executed on the worker pool
+typedef struct {
+    Session *session;
+    char *line;
+    FILE *out;
+    int rc;
+} Request;
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    stop_requested = 1;
+}
+
+static int add_client(Server *srv, int fd)
+{
+    pthread_mutex_lock(&srv->lock);
+    if (srv->nclients == srv->capacity)
+    {
+        int cap = srv->capacity ? srv->capacity * 2 : 16;
+        int *grown = (int *)realloc(srv->clients, (size_t)cap * sizeof(int));
+        if (!grown)
+        {
+            pthread_mutex_unlock(&srv->lock);
+            return -1;
+        }
+        srv->clients = grown;
+        srv->capacity = cap;
+    }
+    srv->clients[srv->nclients++] = fd;
+    pthread_mutex_unlock(&srv->lock);
+    return 0;
+}
+
+static void remove_client(Server *srv, int fd)
+{
+    pthread_mutex_lock(&srv->lock);
+    for (int i = 0; i < srv->nclients; i++)
+    {
+        if (srv->clients[i] == fd)
+        {
+            srv->clients[i] = srv->clients[--srv->nclients];
+            break;
+        }
+    }
+    if (srv->nclients == 0)
+        pthread_cond_broadcast(&srv->idle);
+    pthread_mutex_unlock(&srv->lock);
+}
+
+static void run_request(void *arg)
+{
+    Request *req = (Request *)arg;
+    req->rc = session_execute(req->session, req->line, req->out);
+}
+
+// Connection thread: reads lines and hands each one to the pool
+static void *client_main(void *arg)
+{
+    Client *client = (Client *)arg;
+    Server *srv = client->srv;
+    int fd = client->fd;
+    free(client);
+
+    FILE *in = fdopen(fd, "r");
+    int out_fd = dup(fd);
+    FILE *out = (out_fd >= 0) ? fdopen(out_fd, "w") : NULL;
+    imgctx *ctx = img_ctx_create(NULL, srv->pool);
+    char *line = (char *)malloc(SESSION_LINE_MAX);
+
+    if (in && out && ctx && line)
+    {
+        Session session;
+        session_init(&session, ctx, srv->cache);
+        session.thumbs = srv->thumbs;
+        session.memo = srv->memo;
+        session.peer_fd = out_fd;
+
+        fprintf(out, "Image Utility server ready.\n> ");
+        fflush(out);
+
+        while (fgets(line, SESSION_LINE_MAX, in))
+        {
+            // strip newline
+            line[strcspn(line, "\r\n")] = 0;
+
+            Request req = {&session, line, out, 0};
+            tp_call(srv->pool, run_request, &req);
+            if (req.rc)
+                break;
+
+            fprintf(out, "> ");
+            if (fflush(out) != 0)
+                break;
+        }
+        session_free(&session);
+    }
+
+    remove_client(srv, fd);
+    free(line);
+    img_ctx_destroy(ctx);
+    if (out)
+        fclose(out);
+    else if (out_fd >= 0)
+        close(out_fd);
+    if (in)
+        fclose(in);
+    else
+        close(fd);
+    return NULL;
+}
+
+// Creates the listening socket, refusing to steal one a live server owns
+static int open_listener(const char *socket_path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "Socket path too long: %s\n", socket_path);
+        return -1;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        perror("socket");
+        return -1;
+    }
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+    {
+        fprintf(stderr, "A server is already listening on %s\n", socket_path);
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    unlink(socket_path); // stale socket from an earlier run
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 64) != 0)
+    {
+        perror(socket_path);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int server_run(const char *socket_path, int nthreads, size_t cache_bytes, ThumbCache *thumbs,
+               MemoCache *memo)
+{
+    // SIGINT and SIGTERM stay blocked everywhere but inside the pselect of
+    // the accept loop: threads started from here inherit the mask, and a
+    // signal arriving between the stop check and the wait ends the wait
+    sigset_t stop_signals, wait_mask;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, &wait_mask);
+
+    Server srv;
+    memset(&srv, 0, sizeof(srv));
+    pthread_mutex_init(&srv.lock, NULL);
+    pthread_cond_init(&srv.idle, NULL);
+
+    srv.pool = tp_create(nthreads);
+    srv.cache = imgcache_create(cache_bytes);
+    srv.thumbs = thumbs;
+    srv.memo = memo;
+    if (!srv.pool || !srv.cache)
+    {
+        fprintf(stderr, "Failed to start worker pool.\n");
+        tp_destroy(srv.pool);
+        imgcache_destroy(srv.cache);
+        pthread_sigmask(SIG_SETMASK, &wait_mask, NULL);
+        return 1;
+    }
+
+    int listener = open_listener(socket_path);
+    if (listener < 0)
+    {
+        tp_destroy(srv.pool);
+        imgcache_destroy(srv.cache);
+        pthread_sigmask(SIG_SETMASK, &wait_mask, NULL);
+        return 1;
+    }
+    // A connection pselect reported may be gone by the time of accept
+    fcntl(listener, F_SETFL, fcntl(listener, F_GETFL) | O_NONBLOCK);
+
+    // Clients hanging up must not kill the server; signals end the wait
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &sa, NULL);
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    printf("Serving on %s with %d workers, %.0f MiB image cache.\n",
+           socket_path, tp_size(srv.pool), cache_bytes / 1048576.0);
+    fflush(stdout);
+
+    while (!stop_requested)
+    {
+        fd_set ready;
+        FD_ZERO(&ready);
+        FD_SET(listener, &ready);
+        if (pselect(listener + 1, &ready, NULL, NULL, NULL, &wait_mask) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("pselect");
+            break;
+        }
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED || errno == EAGAIN || errno == EWOULDBLOCK)
+                continue;
+            perror("accept");
+            break;
+        }
+
+        Client *client = (Client *)malloc(sizeof(Client));
+        pthread_t tid;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (!client || add_client(&srv, fd) != 0)
+        {
+            free(client);
+            close(fd);
+        }
+        else
+        {
+            client->srv = &srv;
+            client->fd = fd;
+            if (pthread_create(&tid, &attr, client_main, client) != 0)
+            {
+                remove_client(&srv, fd);
+                free(client);
+                close(fd);
+            }
+        }
+        pthread_attr_destroy(&attr);
+    }
+
+    close(listener);
+    unlink(socket_path);
+
+    // Wake clients blocked in reads and wait for their sessions to end
+    pthread_mutex_lock(&srv.lock);
+    for (int i = 0; i < srv.nclients; i++)
+        shutdown(srv.clients[i], SHUT_RD);
+    while (srv.nclients > 0)
+        pthread_cond_wait(&srv.idle, &srv.lock);
+    pthread_mutex_unlock(&srv.lock);
+
+    tp_destroy(srv.pool);
+    imgcache_destroy(srv.cache);
+    free(srv.clients);
+    pthread_cond_destroy(&srv.idle);
+    pthread_mutex_destroy(&srv.lock);
+    pthread_sigmask(SIG_SETMASK, &wait_mask, NULL);
+    printf("Server stopped.\n");
+    return 0;
+}
+
+#endif
@@ -0,0 +1,460 @@
+#define _GNU_SOURCE // memfd_create
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "image_internal.h"
+#include "../include/shm.h"
+
+#ifdef _WIN32
+
+void img_unmap_storage(BMPImage *img)
+{
+    (void)img;
+}
+
+img_status img_shm_create(imgctx *ctx, int width, int height, int bits_per_pixel, BMPImage **out)
+{
+    (void)width;
+    (void)height;
+    (void)bits_per_pixel;
+    (void)out;
+    return img_fail(ctx, IMG_ERR_UNSUPPORTED, "shared memory images are not available on Windows");
+}
+
+img_status img_shm_export(imgctx *ctx, BMPImage *image, int *fd)
+{
+    (void)image;
+    (void)fd;
+    return img_fail(ctx, IMG_ERR_UNSUPPORTED, "shared memory images are not available on Windows");
+}
+
+img_status img_shm_import(imgctx *ctx, int fd, BMPImage **out)
+{
+    (void)fd;
+    (void)out;
+    return img_fail(ctx, IMG_ERR_UNSUPPORTED, "shared memory images are not available on Windows");
+}
+
+img_status img_shm_open(imgctx *ctx, const char *path, BMPImage **out)
+{
+    (void)path;
+    (void)out;
+    return img_fail(ctx, IMG_ERR_UNSUPPORTED, "shared memory images are not available on Windows");
+}
+
+img_status img_map_file(FILE *file, uint64_t offset, size_t size, BMPImage *img)
+{
+    (void)file;
+    (void)offset;
+    (void)size;
+    (void)img;
+    return IMG_ERR_UNSUPPORTED;
+}
+
+int img_shm_path(const BMPImage *image, char *buf, size_t len)
+{
+    (void)image;
+    (void)buf;
+    (void)len;
+    return -1;
+}
+
+int img_shm_send_fd(int sock, int fd, const char *payload)
+{
+    (void)sock;
+    (void)fd;
+    (void)payload;
+    return -1;
+}
+
+int img_shm_recv_fd(int sock, int *fd)
+{
+    (void)sock;
+    (void)fd;
+    return -1;
+}
+
+#else
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "../include/threadpool.h"
+
+#define HEADERS_SIZE (sizeof(BMPHeader) + sizeof(DIBHeader))
+
+void img_unmap_storage(BMPImage *img)
+{
+    munmap(img->mapping, img->mapping_size);
+    if (img->mapping_fd >= 0)
+        close(img->mapping_fd);
+    img_init_storage(img);
+}
+
+img_status img_map_file(FILE *file, uint64_t offset, size_t size, BMPImage *img)
+{
+    // The file must hold the whole range, or touching the end would fault
+    struct stat st;
+    int fd = fileno(file);
+    if (fd < 0 || fstat(fd, &st) != 0 || (uint64_t)st.st_size < offset + size)
+        return IMG_ERR_UNSUPPORTED;
+
+    // Private: writes to the pixels stay in this process and never reach the file
+    size_t length = (size_t)(offset + size);
+    void *base = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED)
+        return IMG_ERR_UNSUPPORTED;
+    img->mapping = base;
+    img->mapping_size = length;
+    img->mapping_fd = -1;
+    img->data = (unsigned char *)base + offset;
+    return IMG_OK;
+}
+
+// New anonymous segment of the given size; returns its descriptor or -1
+static int create_segment(size_t size)
+{
+#ifdef MFD_ALLOW_SEALING
+    int fd = memfd_create("imagetool-bmp", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+#else
+    // POSIX shm: create under a unique name and unlink it straight away
+    static tp_mutex name_lock = TP_MUTEX_INIT;
+    static unsigned counter = 0;
+    char name[64];
+    tp_mutex_lock(&name_lock);
+    snprintf(name, sizeof(name), "/imagetool-%ld-%u", (long)getpid(), counter++);
+    tp_mutex_unlock(&name_lock);
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd >= 0)
+        shm_unlink(name);
+#endif
+    if (fd < 0)
+        return -1;
+
+    if (ftruncate(fd, (off_t)size) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+#ifdef F_SEAL_SHRINK
+    // Importers map the whole segment; it must not shrink under them
+    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW);
+#endif
+    return fd;
+}
+
+// Writes the BMP headers of img at the start of its segment. The pixels
+// stay where they are: an imported segment may hold them at any offset
+// past the headers, not only at IMG_SHM_PIXEL_OFFSET.
+static void write_segment_headers(BMPImage *img)
+{
+    unsigned char *base = (unsigned char *)img->mapping;
+    uint32_t offset = (uint32_t)(img->data - base);
+    BMPHeader header = img->header;
+    DIBHeader dib = img->dib;
+    header.bfOffBits = offset;
+    header.bfSize = offset + dib.biSizeImage;
+    dib.biSize = sizeof(DIBHeader);
+
+    memcpy(base, &header, sizeof(BMPHeader));
+    memcpy(base + sizeof(BMPHeader), &dib, sizeof(DIBHeader));
+    memset(base + HEADERS_SIZE, 0, offset - HEADERS_SIZE);
+}
+
+// Whether fd is a shared memory segment rather than an ordinary file,
+// whose pages must not be written through
+static int is_segment(int fd, const struct stat *st)
+{
+#ifdef F_GET_SEALS
+    // memfd and tmpfs (/dev/shm) objects support seals, disk files do not
+    (void)st;
+    return fcntl(fd, F_GET_SEALS) >= 0;
+#else
+    (void)fd;
+    return !S_ISREG(st->st_mode);
+#endif
+}
+
+// Creates and maps a segment for size bytes of pixels
+static img_status map_new_segment(imgctx *ctx, size_t pixel_bytes, void **base, size_t *size, int *fd)
+{
+    *size = IMG_SHM_PIXEL_OFFSET + pixel_bytes;
+    *fd = create_segment(*size);
+    if (*fd < 0)
+        return img_fail(ctx, IMG_ERR_NOMEM, "cannot create shared memory segment of %zu bytes", *size);
+
+    *base = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+    if (*base == MAP_FAILED)
+    {
+        close(*fd);
+        return img_fail(ctx, IMG_ERR_NOMEM, "cannot map shared memory segment of %zu bytes", *size);
+    }
+    return IMG_OK;
+}
+
+img_status img_shm_create(imgctx *ctx, int width, int height, int bits_per_pixel, BMPImage **out)
+{
+    if (!ctx || !out || width <= 0 || height <= 0 || (bits_per_pixel != 24 && bits_per_pixel != 32))
+        return ctx ? img_fail(ctx, IMG_ERR_ARG, "img_shm_create: bad dimensions or depth") : IMG_ERR_ARG;
+
+    uint64_t pixel_bytes = (uint64_t)img_row_size(width, bits_per_pixel) * (uint64_t)height;
+    if (pixel_bytes > 0xFFFFFFFFULL)
+        return img_fail(ctx, IMG_ERR_UNSUPPORTED, "image of %dx%d exceeds the BMP size limit", width, height);
+
+    ProfScope scope;
+    prof_begin(&scope, PROF_SHM);
+
+    BMPImage *img = (BMPImage *)img_alloc(ctx, sizeof(BMPImage));
+    if (!img)
+    {
+        prof_end(&scope);
+        return img_fail(ctx, IMG_ERR_NOMEM, "out of memory");
+    }
+    memset(img, 0, sizeof(BMPImage));
+    img_init_storage(img);
+    img->header.bfType = 0x4D42; // 'BM'
+    img->header.bfOffBits = IMG_SHM_PIXEL_OFFSET;
+    img->header.bfSize = IMG_SHM_PIXEL_OFFSET + (uint32_t)pixel_bytes;
+    img->dib.biSize = sizeof(DIBHeader);
+    img->dib.biWidth = width;
+    img->dib.biHeight = height;
+    img->dib.biPlanes = 1;
+    img->dib.biBitCount = (uint16_t)bits_per_pixel;
+    img->dib.biSizeImage = (uint32_t)pixel_bytes;
+
+    img_status st = map_new_segment(ctx, (size_t)pixel_bytes, &img->mapping, &img->mapping_size, &img->mapping_fd);
+    if (st != IMG_OK)
+    {
+        img_release(ctx, img);
+        prof_end(&scope);
+        return st;
+    }
+    // A fresh segment reads as zeros: the image starts black
+    img->data = (unsigned char *)img->mapping + IMG_SHM_PIXEL_OFFSET;
+    write_segment_headers(img);
+
+    prof_pixels(PROF_SHM, img_pixel_count(img));
+    prof_end(&scope);
+    *out = img;
+    return IMG_OK;
+}
+
+img_status img_shm_export(imgctx *ctx, BMPImage *image, int *fd)
+{
+    if (!ctx || !image || !image->data)
+        return ctx ? img_fail(ctx, IMG_ERR_ARG, "img_shm_export: missing argument") : IMG_ERR_ARG;
+
+    ProfScope scope;
+    prof_begin(&scope, PROF_SHM);
+
+    // Pixels not yet in a segment move into a new one
+    if (image->mapping_fd < 0)
+    {
+        void *base;
+        size_t size;
+        int seg;
+        img_status st = map_new_segment(ctx, image->dib.biSizeImage, &base, &size, &seg);
+        if (st != IMG_OK)
+        {
+            prof_end(&scope);
+            return st;
+        }
+        memcpy((unsigned char *)base + IMG_SHM_PIXEL_OFFSET, image->data, image->dib.biSizeImage);
+        prof_pixels(PROF_SHM, img_pixel_count(image));
+
+        if (image->mapping)
+        {
+            img_unmap_storage(image);
+        }
+        else
+        {
+            prof_free(image->dib.biSizeImage);
+            img_release(ctx, image->data);
+        }
+        image->mapping = base;
+        image->mapping_size = size;
+        image->mapping_fd = seg;
+        image->data = (unsigned char *)base + IMG_SHM_PIXEL_OFFSET;
+    }
+
+    // Headers may have changed since the segment was created
+    write_segment_headers(image);
+
+    prof_end(&scope);
+    if (!fd)
+        return IMG_OK;
+    *fd = fcntl(image->mapping_fd, F_DUPFD_CLOEXEC, 0);
+    if (*fd < 0)
+        return img_fail(ctx, IMG_ERR_IO, "cannot duplicate shared memory descriptor");
+    return IMG_OK;
+}
+
+img_status img_shm_import(imgctx *ctx, int fd, BMPImage **out)
+{
+    if (!ctx || fd < 0 || !out)
+    {
+        if (fd >= 0)
+            close(fd);
+        return ctx ? img_fail(ctx, IMG_ERR_ARG, "img_shm_import: missing argument") : IMG_ERR_ARG;
+    }
+
+    ProfScope scope;
+    prof_begin(&scope, PROF_SHM);
+
+    struct stat st;
+    img_status status = IMG_OK;
+    void *base = MAP_FAILED;
+    size_t size = 0;
+    int shared = 0;
+    BMPImage *img = NULL;
+
+    if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < HEADERS_SIZE)
+    {
+        status = img_fail(ctx, IMG_ERR_FORMAT, "shared segment too small for BMP headers");
+        goto fail;
+    }
+    size = (size_t)st.st_size;
+
+    // A plain BMP file is mapped privately, like img_load does, so pixel
+    // writes never reach it; only segments are shared
+    shared = is_segment(fd, &st);
+    base = mmap(NULL, size, PROT_READ | PROT_WRITE, shared ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED)
+    {
+        status = img_fail(ctx, IMG_ERR_IO, "cannot map shared segment");
+        goto fail;
+    }
+
+    img = (BMPImage *)img_alloc(ctx, sizeof(BMPImage));
+    if (!img)
+    {
+        status = img_fail(ctx, IMG_ERR_NOMEM, "out of memory");
+        goto fail;
+    }
+    img_init_storage(img);
+    img->hash = 0; // other processes may write the pixels
+    memcpy(&img->header, base, sizeof(BMPHeader));
+    memcpy(&img->dib, (unsigned char *)base + sizeof(BMPHeader), sizeof(DIBHeader));
+
+    // The headers come from another process: check they describe pixels
+    // this library handles and that those fit the segment
+    if (img->header.bfType != 0x4D42 || img->dib.biWidth <= 0 || img->dib.biHeight == 0 ||
+        img->dib.biHeight == INT32_MIN || (img->dib.biBitCount != 24 && img->dib.biBitCount != 32) ||
+        img->dib.biCompression != 0 ||
+        (uint64_t)img_row_size(img->dib.biWidth, img->dib.biBitCount) * (uint64_t)img_height(img) >
+            img->dib.biSizeImage ||
+        (uint64_t)img->header.bfOffBits + img->dib.biSizeImage > size || img->header.bfOffBits < HEADERS_SIZE)
+    {
+        status = img_fail(ctx, IMG_ERR_FORMAT, "shared segment does not hold a valid BMP");
+        goto fail;
+    }
+
+    img->data = (unsigned char *)base + img->header.bfOffBits;
+    img->mapping = base;
+    img->mapping_size = size;
+    img->mapping_fd = shared ? fd : -1;
+    if (!shared)
+        close(fd);
+
+    prof_pixels(PROF_SHM, img_pixel_count(img));
+    prof_end(&scope);
+    *out = img;
+    return IMG_OK;
+
+fail:
+    img_release(ctx, img);
+    if (base != MAP_FAILED)
+        munmap(base, size);
+    close(fd);
+    prof_end(&scope);
+    return status;
+}
+
+img_status img_shm_open(imgctx *ctx, const char *path, BMPImage **out)
+{
+    if (!ctx || !path || !out)
+        return ctx ? img_fail(ctx, IMG_ERR_ARG, "img_shm_open: missing argument") : IMG_ERR_ARG;
+
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0)
+        return img_fail(ctx, IMG_ERR_IO, "cannot open %s", path);
+    return img_shm_import(ctx, fd, out);
+}
+
+int img_shm_path(const BMPImage *image, char *buf, size_t len)
+{
+    if (!image || image->mapping_fd < 0)
+        return -1;
+    int n = snprintf(buf, len, "/proc/%ld/fd/%d", (long)getpid(), image->mapping_fd);
+    return (n > 0 && (size_t)n < len) ? 0 : -1;
+}
+
+int img_shm_send_fd(int sock, int fd, const char *payload)
+{
+    size_t plen = payload ? strlen(payload) : 0;
+    char dummy = '\n';
+    struct iovec iov;
+    iov.iov_base = plen ? (void *)payload : &dummy;
+    iov.iov_len = plen ? plen : 1;
+
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    return (sendmsg(sock, &msg, 0) == (ssize_t)iov.iov_len) ? 0 : -1;
+}
+
+int img_shm_recv_fd(int sock, int *fd)
+{
+    char data[64];
+    struct iovec iov;
+    iov.iov_base = data;
+    iov.iov_len = sizeof(data);
+
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) <= 0)
+        return -1;
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+            cmsg->cmsg_len == CMSG_LEN(sizeof(int)))
+        {
+            memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+            return 0;
+        }
+    }
+    return -1;
+}
+
+#endif
@@ -0,0 +1,172 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "image_internal.h"
+#include "../include/threadpool.h"
+
+// Histogram of each channel. Every band counts into four sub-histograms
+// per channel, taking consecutive pixels in turn, so runs of equal values
+// (flat areas are common) do not stall on increments of the same counter.
+// Bands are summed once they are all done.
+
+#define SUB_HISTS 4
+
+// Bands per worker, so uneven rows still balance
+#define BANDS_PER_THREAD 4
+
+typedef struct {
+    uint64_t hist[4][256];
+} BandCounts;
+
+typedef struct {
+    const BMPImage *img;
+    size_t stride;
+    int channels;
+    int height;
+    int bands;
+    BandCounts *counts;
+} StatsJob;
+
+static void count_band(const StatsJob *job, int band)
+{
+    int y0 = (int)((int64_t)job->height * band / job->bands);
+    int y1 = (int)((int64_t)job->height * (band + 1) / job->bands);
+    int width = job->img->dib.biWidth;
+    int bpp = job->img->dib.biBitCount / 8;
+    int nch = job->channels;
+
+    // 32-bit counters: a band holds far fewer than 2^32 pixels
+    uint32_t (*sub)[4][256] = (uint32_t(*)[4][256])calloc(SUB_HISTS, sizeof(*sub));
+    if (!sub)
+        return;
+
+    for (int y = y0; y < y1; y++)
+    {
+        // Only width * bpp bytes of each padded row are pixels
+        const unsigned char *p = job->img->data + (size_t)y * job->stride;
+        int x = 0;
+        if (bpp == 3)
+        {
+            for (; x + SUB_HISTS <= width; x += SUB_HISTS, p += 3 * SUB_HISTS)
+            {
+                sub[0][0][p[0]]++;
+                sub[0][1][p[1]]++;
+                sub[0][2][p[2]]++;
+                sub[1][0][p[3]]++;
+                sub[1][1][p[4]]++;
+                sub[1][2][p[5]]++;
+                sub[2][0][p[6]]++;
+                sub[2][1][p[7]]++;
+                sub[2][2][p[8]]++;
+                sub[3][0][p[9]]++;
+                sub[3][1][p[10]]++;
+                sub[3][2][p[11]]++;
+            }
+        }
+        else
+        {
+            for (; x + SUB_HISTS <= width; x += SUB_HISTS, p += 4 * SUB_HISTS)
+            {
+                for (int k = 0; k < SUB_HISTS; k++)
+                {
+                    sub[k][0][p[4 * k + 0]]++;
+                    sub[k][1][p[4 * k + 1]]++;
+                    sub[k][2][p[4 * k + 2]]++;
+                    sub[k][3][p[4 * k + 3]]++;
+                }
+            }
+        }
+        for (; x < width; x++, p += bpp)
+        {
+            for (int c = 0; c < nch; c++)
+                sub[0][c][p[c]]++;
+        }
+    }
+
+    BandCounts *out = &job->counts[band];
+    for (int c = 0; c < nch; c++)
+        for (int v = 0; v < 256; v++)
+            out->hist[c][v] = (uint64_t)sub[0][c][v] + sub[1][c][v] + sub[2][c][v] + sub[3][c][v];
+    free(sub);
+}
+
+static void count_bands(void *arg, int begin, int end)
+{
+    for (int band = begin; band < end; band++)
+        count_band((const StatsJob *)arg, band);
+}
+
+img_status img_compute_stats(imgctx *ctx, const BMPImage *image, img_stats *out)
+{
+    if (!ctx || !image || !image->data || !out)
+        return ctx ? img_fail(ctx, IMG_ERR_ARG, "img_compute_stats: missing argument") : IMG_ERR_ARG;
+
+    int bits = image->dib.biBitCount;
+    if ((bits != 24 && bits != 32) || image->dib.biCompression != 0)
+        return img_fail(ctx, IMG_ERR_UNSUPPORTED, "stats: only 24-bit or 32-bit BMP supported");
+
+    ProfScope scope;
+    prof_begin(&scope, PROF_STATS);
+
+    StatsJob job;
+    job.img = image;
+    job.stride = img_row_size(image->dib.biWidth, bits);
+    job.channels = bits / 8;
+    job.height = img_height(image);
+    job.bands = (tp_size(ctx->pool) + 1) * BANDS_PER_THREAD;
+    if (job.bands > job.height)
+        job.bands = job.height;
+    job.counts = (BandCounts *)calloc((size_t)job.bands, sizeof(BandCounts));
+    if (!job.counts)
+    {
+        prof_end(&scope);
+        return img_fail(ctx, IMG_ERR_NOMEM, "out of memory");
+    }
+
+    tp_parallel_for(ctx->pool, job.bands, 1, count_bands, &job);
+
+    // Reduce the bands, then derive the moments from the histograms
+    memset(out, 0, sizeof(*out));
+    out->channels = job.channels;
+    out->pixels = img_pixel_count(image);
+    for (int b = 0; b < job.bands; b++)
+        for (int c = 0; c < job.channels; c++)
+            for (int v = 0; v < 256; v++)
+                out->histogram[c][v] += job.counts[b].hist[c][v];
+    free(job.counts);
+
+    for (int c = 0; c < job.channels; c++)
+    {
+        const uint64_t *h = out->histogram[c];
+        uint64_t total = 0;
+        double sum = 0.0, sumsq = 0.0;
+        int lo = 255, hi = 0;
+        for (int v = 0; v < 256; v++)
+        {
+            if (!h[v])
+                continue;
+            if (v < lo)
+                lo = v;
+            hi = v;
+            total += h[v];
+            sum += (double)v * (double)h[v];
+            sumsq += (double)v * (double)v * (double)h[v];
+        }
+        // A band that ran out of memory leaves counts missing
+        if (total != out->pixels)
+        {
+            prof_end(&scope);
+            return img_fail(ctx, IMG_ERR_NOMEM, "out of memory");
+        }
+        double mean = sum / (double)total;
+        double var = sumsq / (double)total - mean * mean;
+        out->min[c] = (unsigned char)lo;
+        out->max[c] = (unsigned char)hi;
+        out->mean[c] = mean;
+        out->stddev[c] = (var > 0.0) ? sqrt(var) : 0.0;
+    }
+
+    prof_pixels(PROF_STATS, out->pixels);
+    prof_end(&scope);
+    return IMG_OK;
+}
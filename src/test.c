@@ -1,8 +1,20 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <assert.h>
+#include <math.h>
 #include "../include/image.h"
+#include "../include/history.h"
+#include "../include/profile.h"
+#include "../include/threadpool.h"
+#include "../include/imgcache.h"
+#include "../include/shm.h"
+#include "../include/thumbcache.h"
+#include "../include/memo.h"
+#include "../include/plan.h"
+#include "../include/scan.h"
+#include "reference.h"
 
 // Helper: check if file exists
 int file_exists(const char *filename) {
@@ -11,6 +23,90 @@ int file_exists(const char *filename) {
     return 0;
 }
 
+// Helper: reference source-over blend, rounded to nearest
+static int blend_ref(int src, int dst, int alpha) {
+    return (int)((src * alpha + dst * (255 - alpha)) / 255.0 + 0.5);
+}
+
+// Helper: writes a BMP with a 40-byte header, then extra (palette or bit
+// masks) and the pixel data, as stored
+static void write_raw_bmp(const char *path, int w, int h, int bits, int comp,
+                          const void *extra, size_t extra_size, const void *data, size_t size) {
+    BMPHeader hdr = {0x4D42, 0, 0, 0, 0};
+    DIBHeader dib;
+    memset(&dib, 0, sizeof(dib));
+    hdr.bfOffBits = (uint32_t)(sizeof(hdr) + sizeof(dib) + extra_size);
+    hdr.bfSize = (uint32_t)(hdr.bfOffBits + size);
+    dib.biSize = sizeof(dib);
+    dib.biWidth = w;
+    dib.biHeight = h;
+    dib.biPlanes = 1;
+    dib.biBitCount = (uint16_t)bits;
+    dib.biCompression = (uint32_t)comp;
+    dib.biSizeImage = (uint32_t)size;
+    FILE *f = fopen(path, "wb");
+    assert(f);
+    fwrite(&hdr, sizeof(hdr), 1, f);
+    fwrite(&dib, sizeof(dib), 1, f);
+    if (extra_size)
+        fwrite(extra, 1, extra_size, f);
+    fwrite(data, 1, size, f);
+    fclose(f);
+}
+
+// Helper: xorshift64, so every run tests the same cases
+static uint64_t diff_state = 0x9E3779B97F4A7C15ULL;
+static uint32_t diff_rand(uint32_t n) {
+    diff_state ^= diff_state << 13;
+    diff_state ^= diff_state >> 7;
+    diff_state ^= diff_state << 17;
+    return (uint32_t)((diff_state >> 16) % n);
+}
+static double diff_real(double lo, double hi) {
+    return lo + (hi - lo) * diff_rand(1u << 24) / (double)(1u << 24);
+}
+
+// Helper: exact copy of a malloc'ed image, padding included
+static BMPImage *diff_copy(const BMPImage *src) {
+    BMPImage *dst = ref_new_image(src, src->dib.biWidth, abs(src->dib.biHeight));
+    assert(dst);
+    memcpy(dst->data, src->data, src->dib.biSizeImage);
+    return dst;
+}
+
+// Helper: got must equal the reference byte for byte; reports the first difference
+static void diff_expect(int test_case, const char *what, const BMPImage *want, const BMPImage *got) {
+    assert(want && got);
+    if (got->dib.biWidth != want->dib.biWidth || got->dib.biHeight != want->dib.biHeight ||
+        got->dib.biBitCount != want->dib.biBitCount || got->dib.biSizeImage != want->dib.biSizeImage) {
+        printf("[FAIL] case %d %s: %dx%dx%d, reference %dx%dx%d\n", test_case, what, got->dib.biWidth,
+               got->dib.biHeight, got->dib.biBitCount, want->dib.biWidth, want->dib.biHeight, want->dib.biBitCount);
+        exit(1);
+    }
+    for (uint32_t i = 0; i < want->dib.biSizeImage; i++) {
+        if (got->data[i] != want->data[i]) {
+            printf("[FAIL] case %d %s (%dx%d, %d bpp): byte %u is %d, reference %d\n", test_case, what,
+                   want->dib.biWidth, want->dib.biHeight, want->dib.biBitCount, i, got->data[i], want->data[i]);
+            exit(1);
+        }
+    }
+}
+
+// Helper: 1 when two files hold the same bytes
+static int files_equal(const char *a, const char *b) {
+    FILE *fa = fopen(a, "rb"), *fb = fopen(b, "rb");
+    int same = fa && fb;
+    while (same) {
+        int ca = fgetc(fa), cb = fgetc(fb);
+        same = (ca == cb);
+        if (ca == EOF)
+            break;
+    }
+    if (fa) fclose(fa);
+    if (fb) fclose(fb);
+    return same;
+}
+
 int main() {
     printf("=== Running Image Utility Tests ===\n");
 
@@ -39,6 +135,41 @@ int main() {
            rot->dib.biWidth, rot->dib.biHeight);
     free_bmp(rot);
 
+    // Every pixel, ties included, comes from where the original rotate_bmp
+    // took it: round() of the coordinate computed about the centre. An even
+    // width and odd height put the centre on half a pixel in y only, so at
+    // 90 degrees whole columns of source x fall on negative .5 ties.
+    BMPImage *full = load_bmp("test/blackbuck.bmp");
+    assert(full != NULL);
+    BMPImage *tie = crop_bmp(full, 13, 21, 76, 101);
+    assert(tie != NULL);
+    free_bmp(full);
+    for (uint32_t i = 0; i < tie->dib.biSizeImage; i++)
+        tie->data[i] = (unsigned char)(i % 251 + 1); // no black source pixels
+    const double rangles[4] = {90, 180, 270, 33};
+    for (int a = 0; a < 4; a++) {
+        rot = rotate_bmp(tie, rangles[a]);
+        assert(rot != NULL);
+        int rw = tie->dib.biWidth, rh = abs(tie->dib.biHeight);
+        size_t rstride = ((size_t)rw * 3 + 3) & ~(size_t)3;
+        double rad = rangles[a] * 3.14159265358979323846 / 180.0, cosA = cos(rad), sinA = sin(rad);
+        double cx = rw / 2.0, cy = rh / 2.0;
+        for (int y = 0; y < rh; y++) {
+            for (int x = 0; x < rw; x++) {
+                int sxi = (int)round(cosA * (x - cx) + sinA * (y - cy) + cx);
+                int syi = (int)round(-sinA * (x - cx) + cosA * (y - cy) + cy);
+                const unsigned char *got = rot->data + y * rstride + x * 3;
+                if (sxi >= 0 && sxi < rw && syi >= 0 && syi < rh)
+                    assert(memcmp(got, tie->data + syi * rstride + sxi * 3, 3) == 0);
+                else
+                    assert(got[0] == 0 && got[1] == 0 && got[2] == 0);
+            }
+        }
+        free_bmp(rot);
+    }
+    free_bmp(tie);
+    printf("[PASS] Rotate rounds like the original at 90, 180, 270 and 33 degrees\n");
+
     // 5. Scale
     BMPImage *sc = scale_bmp(img, 0.5);
     assert(sc != NULL);
@@ -58,7 +189,7 @@ int main() {
     BMPImage *cr = crop_bmp(img, 0, 0, 50, 50);
     assert(cr != NULL);
     assert(cr->dib.biWidth == 50 && abs(cr->dib.biHeight) == 50);
-    assert(save_bmp("test/croped_save.bmp", rot) == 0);
+    assert(save_bmp("test/croped_save.bmp", cr) == 0);
     printf("[PASS] Crop produced 50x50 image\n");
     free_bmp(cr);
 
@@ -75,7 +206,1082 @@ int main() {
     printf("[PASS] Steganography embed/extract: \"%s\"\n", msg);
     free_message(msg);
 
-    // 9. Clean up
+    // 9. Profiling counters
+    prof_enable(1);
+    BMPImage *prof_img = load_bmp("test/blackbuck.bmp");
+    assert(prof_img != NULL);
+    const ProfRecord *lr = prof_get(PROF_LOAD);
+    assert(lr->calls == 1);
+    assert(lr->bytes_read >= prof_img->dib.biSizeImage);
+    assert(lr->bytes_allocated == prof_img->dib.biSizeImage);
+    assert(lr->pixels == (uint64_t)prof_img->dib.biWidth * abs(prof_img->dib.biHeight));
+    free_bmp(prof_img);
+    prof_enable(0);
+    printf("[PASS] Profiling recorded load (%llu bytes read)\n",
+           (unsigned long long)lr->bytes_read);
+
+    // 10. Context API with a thread pool matches the serial legacy API
+    ThreadPool *pool = tp_create(4);
+    assert(pool != NULL);
+    imgctx *ctx = img_ctx_create(NULL, pool);
+    assert(ctx != NULL);
+    BMPImage *src = NULL;
+    assert(img_load(ctx, "test/blackbuck.bmp", &src) == IMG_OK);
+    BMPImage *par = NULL;
+    assert(img_rotate(ctx, src, 33, &par) == IMG_OK);
+    BMPImage *ser = rotate_bmp(src, 33);
+    assert(ser != NULL);
+    assert(memcmp(par->data, ser->data, ser->dib.biSizeImage) == 0);
+    free_bmp(ser);
+    img_free(ctx, par);
+
+    BMPImage *none = NULL;
+    assert(img_load(ctx, "test/missing.bmp", &none) == IMG_ERR_IO && none == NULL);
+    assert(img_ctx_status(ctx) == IMG_ERR_IO);
+    assert(img_crop(ctx, src, 500, 500, 50, 50, &none) == IMG_ERR_BOUNDS);
+    img_ctx_clear_error(ctx);
+    assert(img_ctx_status(ctx) == IMG_OK);
+    img_free(ctx, src);
+    img_ctx_destroy(ctx);
+    tp_destroy(pool);
+    printf("[PASS] Context API with thread pool\n");
+
+    // 11. Image cache serves repeated loads from memory
+    ImageCache *cache = imgcache_create(16 * 1024 * 1024);
+    assert(cache != NULL);
+    imgctx *cctx = img_ctx_create(NULL, NULL);
+    BMPImage *first = NULL, *second = NULL;
+    assert(imgcache_load(cache, cctx, "test/blackbuck.bmp", &first) == IMG_OK);
+    assert(imgcache_load(cache, cctx, "test/blackbuck.bmp", &second) == IMG_OK);
+    assert(first != second && first->data != second->data);
+    assert(memcmp(first->data, second->data, first->dib.biSizeImage) == 0);
+    // Another spelling of the same file is the same entry
+    BMPImage *third = NULL;
+    assert(imgcache_load(cache, cctx, "./test/../test/blackbuck.bmp", &third) == IMG_OK);
+    img_free(cctx, third);
+    uint64_t hits, misses;
+    imgcache_stats(cache, &hits, &misses, NULL);
+    assert(hits == 2 && misses == 1);
+
+    // A same-size file renamed over the cached one within the same second
+    assert(img_save(cctx, "test/cache_swap.bmp", first) == IMG_OK);
+    first->data[0] ^= 0xFF;
+    assert(img_save(cctx, "test/cache_swap.tmp", first) == IMG_OK);
+    img_free(cctx, second);
+    assert(imgcache_load(cache, cctx, "test/cache_swap.bmp", &second) == IMG_OK);
+    img_free(cctx, second);
+#ifdef _WIN32
+    remove("test/cache_swap.bmp"); // rename does not replace on Windows
+#endif
+    assert(rename("test/cache_swap.tmp", "test/cache_swap.bmp") == 0);
+    assert(imgcache_load(cache, cctx, "test/cache_swap.bmp", &second) == IMG_OK);
+    assert(second->data[0] == first->data[0]);
+    imgcache_stats(cache, &hits, &misses, NULL);
+    assert(hits == 2 && misses == 3);
+    remove("test/cache_swap.bmp");
+    img_free(cctx, first);
+    img_free(cctx, second);
+    img_ctx_destroy(cctx);
+    imgcache_destroy(cache);
+    printf("[PASS] Image cache hit on second load, miss after the file changed\n");
+
+    // 12. Shared memory export is visible through a second mapping
+#ifndef _WIN32
+    imgctx *sctx = img_ctx_create(NULL, NULL);
+    BMPImage *local = NULL, *mapped = NULL;
+    assert(img_load(sctx, "test/blackbuck.bmp", &local) == IMG_OK);
+    BMPImage *copy = NULL;
+    assert(img_clone(sctx, local, &copy) == IMG_OK);
+    assert(img_shm_export(sctx, local, NULL) == IMG_OK && local->mapping_fd >= 0);
+    assert(memcmp(local->data, copy->data, copy->dib.biSizeImage) == 0);
+    char shm_path[64];
+    assert(img_shm_path(local, shm_path, sizeof(shm_path)) == 0);
+    assert(img_shm_open(sctx, shm_path, &mapped) == IMG_OK);
+    assert(mapped->dib.biWidth == local->dib.biWidth && mapped->data != local->data);
+    local->data[0] ^= 0xFF;
+    assert(mapped->data[0] == local->data[0]);
+    assert(img_save(sctx, "test/output_save.bmp", mapped) == IMG_OK);
+    img_free(sctx, mapped);
+    assert(img_load(sctx, "test/output_save.bmp", &mapped) == IMG_OK);
+    assert(memcmp(mapped->data, local->data, local->dib.biSizeImage) == 0);
+    img_free(sctx, mapped);
+
+    // A segment written by another program with its pixels at offset 54
+    // keeps them there when re-exported
+    BMPImage *seg = NULL;
+    int sw = local->dib.biWidth, sh = abs(local->dib.biHeight);
+    assert(img_shm_create(sctx, sw, sh, 24, &seg) == IMG_OK);
+    unsigned char *raw = (unsigned char *)seg->mapping;
+    BMPHeader *raw_hdr = (BMPHeader *)raw;
+    raw_hdr->bfOffBits = (uint32_t)(sizeof(BMPHeader) + sizeof(DIBHeader));
+    memcpy(raw + raw_hdr->bfOffBits, copy->data, copy->dib.biSizeImage);
+    assert(img_shm_path(seg, shm_path, sizeof(shm_path)) == 0);
+    assert(img_shm_open(sctx, shm_path, &mapped) == IMG_OK && mapped->mapping_fd >= 0);
+    assert(img_shm_export(sctx, mapped, NULL) == IMG_OK);
+    assert(raw_hdr->bfOffBits == sizeof(BMPHeader) + sizeof(DIBHeader));
+    assert(memcmp(mapped->data, copy->data, copy->dib.biSizeImage) == 0);
+    img_free(sctx, mapped);
+
+    // Headers outside what the library handles are refused
+    ((DIBHeader *)(raw + sizeof(BMPHeader)))->biBitCount = 8;
+    assert(img_shm_open(sctx, shm_path, &mapped) == IMG_ERR_FORMAT);
+    ((DIBHeader *)(raw + sizeof(BMPHeader)))->biBitCount = 24;
+    ((DIBHeader *)(raw + sizeof(BMPHeader)))->biHeight = INT32_MIN;
+    assert(img_shm_open(sctx, shm_path, &mapped) == IMG_ERR_FORMAT);
+    img_free(sctx, seg);
+
+    // An ordinary file is mapped privately: writes never reach it
+    assert(img_shm_open(sctx, "test/blackbuck.bmp", &mapped) == IMG_OK && mapped->mapping_fd < 0);
+    mapped->data[0] ^= 0xFF;
+    img_free(sctx, mapped);
+    assert(img_load(sctx, "test/blackbuck.bmp", &mapped) == IMG_OK);
+    assert(memcmp(mapped->data, copy->data, copy->dib.biSizeImage) == 0);
+    img_free(sctx, mapped);
+
+    img_free(sctx, local);
+    img_free(sctx, copy);
+    img_ctx_destroy(sctx);
+    printf("[PASS] Shared memory export and import\n");
+#endif
+
+    // 13. Thumbnail cache persists across reopen
+    imgctx *tctx = img_ctx_create(NULL, NULL);
+    // A zero budget evicts whatever earlier runs left behind
+    ThumbCache *thumbs = thumbcache_open("test/thumbs", 0);
+    assert(thumbs != NULL);
+    thumbcache_close(thumbs);
+    thumbs = thumbcache_open("test/thumbs", 1024 * 1024);
+    assert(thumbs != NULL);
+    BMPImage *t1 = NULL, *t2 = NULL;
+    int hit = 1;
+    assert(thumbcache_get(thumbs, tctx, "test/blackbuck.bmp", 64, &t1, &hit) == IMG_OK);
+    assert(t1->dib.biWidth <= 64 && abs(t1->dib.biHeight) <= 64);
+    thumbcache_close(thumbs);
+    thumbs = thumbcache_open("test/thumbs", 1024 * 1024);
+    assert(thumbcache_get(thumbs, tctx, "test/blackbuck.bmp", 64, &t2, &hit) == IMG_OK && hit);
+    assert(t2->dib.biWidth == t1->dib.biWidth && t2->dib.biHeight == t1->dib.biHeight);
+    assert(memcmp(t1->data, t2->data, t1->dib.biSizeImage) == 0);
+    img_free(tctx, t2);
+    // Another spelling of the same file shares the thumbnail
+    assert(thumbcache_get(thumbs, tctx, "./test/../test/blackbuck.bmp", 64, &t2, &hit) == IMG_OK && hit);
+    size_t tentries = 0;
+    thumbcache_stats(thumbs, NULL, NULL, NULL, &tentries);
+    assert(tentries == 1);
+    img_free(tctx, t2);
+
+    // A second cache on the same directory, as another process would open
+    // it, never writes over this one's thumbnail files
+    BMPImage *other = NULL, *t3 = NULL;
+    assert(img_load(tctx, "test/blackbuck.bmp", &other) == IMG_OK);
+    for (uint32_t i = 0; i < other->dib.biSizeImage; i++)
+        other->data[i] ^= 0xFF;
+    assert(img_save(tctx, "test/thumb_other.bmp", other) == IMG_OK);
+    ThumbCache *peer = thumbcache_open("test/thumbs", 1024 * 1024);
+    assert(peer != NULL);
+    assert(thumbcache_get(thumbs, tctx, "test/blackbuck.bmp", 32, &t2, &hit) == IMG_OK && !hit);
+    assert(thumbcache_get(peer, tctx, "test/thumb_other.bmp", 32, &t3, &hit) == IMG_OK && !hit);
+    img_free(tctx, t3);
+    assert(thumbcache_get(thumbs, tctx, "test/blackbuck.bmp", 32, &t3, &hit) == IMG_OK && hit);
+    assert(memcmp(t2->data, t3->data, t2->dib.biSizeImage) == 0);
+    thumbcache_close(peer);
+    remove("test/thumb_other.bmp");
+    img_free(tctx, other);
+    img_free(tctx, t3);
+    thumbcache_close(thumbs);
+    img_free(tctx, t1);
+    img_free(tctx, t2);
+    img_ctx_destroy(tctx);
+    printf("[PASS] Thumbnail cache hit after reopen, through another path and beside another cache\n");
+
+    // 14. Result cache replays a transform chain without recomputing
+    imgctx *mctx = img_ctx_create(NULL, NULL);
+    MemoCache *memo = memo_create(64 * 1024 * 1024, NULL);
+    BMPImage *msrc = NULL, *m1 = NULL, *m2 = NULL;
+    assert(img_load(mctx, "test/blackbuck.bmp", &msrc) == IMG_OK && msrc->hash == 0);
+    uint64_t mhash = img_content_hash(msrc);
+    assert(mhash != 0 && msrc->hash == 0);
+    MemoOp chain[2] = {{MEMO_CROP, {10, 20, 200, 150}, 0.0}, {MEMO_RESIZE, {64, 48, 0, 0}, 0.0}};
+    assert(memo_apply_chain(memo, mctx, msrc, chain, 2, &m1) == IMG_OK);
+    assert(memo_apply_chain(memo, mctx, msrc, chain, 2, &m2) == IMG_OK);
+    assert(m1->hash == m2->hash && m1->dib.biWidth == 64 && m2->dib.biHeight == 48);
+    assert(msrc->hash == mhash);
+    assert(memcmp(m1->data, m2->data, m1->dib.biSizeImage) == 0);
+    uint64_t mhits, mmisses;
+    memo_stats(memo, &mhits, NULL, &mmisses, NULL);
+    assert(mhits == 1 && mmisses == 2);
+    img_free(mctx, m1);
+    img_free(mctx, m2);
+    img_free(mctx, msrc);
+    memo_destroy(memo);
+    img_ctx_destroy(mctx);
+    printf("[PASS] Result cache hit on repeated chain\n");
+
+    // 15. Statistics ignore row padding and match with and without a pool
+    ThreadPool *spool = tp_create(3);
+    imgctx *pctx = img_ctx_create(NULL, spool);
+    imgctx *qctx = img_ctx_create(NULL, NULL);
+    BMPImage *sfull = NULL, *odd = NULL;
+    assert(img_load(pctx, "test/blackbuck.bmp", &sfull) == IMG_OK);
+    static img_stats sa, sb;
+    assert(img_compute_stats(pctx, sfull, &sa) == IMG_OK);
+    assert(img_compute_stats(qctx, sfull, &sb) == IMG_OK);
+    assert(memcmp(sa.histogram, sb.histogram, sizeof(sa.histogram)) == 0 && sa.pixels == 512 * 512);
+    assert(img_resize(pctx, sfull, 37, 13, &odd) == IMG_OK);
+    unsigned char scol[3] = {200, 100, 7};
+    assert(img_fill(pctx, odd, scol) == IMG_OK);
+    assert(img_compute_stats(pctx, odd, &sa) == IMG_OK);
+    assert(sa.histogram[2][200] == 37 * 13 && sa.histogram[0][7] == 37 * 13);
+    assert(sa.min[1] == 100 && sa.max[1] == 100 && sa.mean[1] == 100.0 && sa.stddev[1] == 0.0);
+    img_free(pctx, odd);
+    img_free(pctx, sfull);
+    img_ctx_destroy(qctx);
+    img_ctx_destroy(pctx);
+    tp_destroy(spool);
+    printf("[PASS] Image statistics\n");
+
+    // 16. Tone curves: a composed table equals the passes one by one
+    imgctx *lctx = img_ctx_create(NULL, NULL);
+    BMPImage *lsrc = NULL, *la = NULL, *lb = NULL;
+    assert(img_load(lctx, "test/blackbuck.bmp", &lsrc) == IMG_OK);
+    assert(img_resize(lctx, lsrc, 37, 13, &la) == IMG_OK);
+    assert(img_clone(lctx, la, &lb) == IMG_OK);
+    img_lut both, step;
+    img_lut_identity(&both);
+    img_lut_brightness(&both, 10);
+    img_lut_contrast(&both, 1.5);
+    img_lut_gamma(&both, 0.8);
+    assert(img_apply_lut(lctx, la, &both) == IMG_OK);
+    img_lut_identity(&step);
+    img_lut_brightness(&step, 10);
+    assert(img_apply_lut(lctx, lb, &step) == IMG_OK);
+    img_lut_identity(&step);
+    img_lut_contrast(&step, 1.5);
+    assert(img_apply_lut(lctx, lb, &step) == IMG_OK);
+    img_lut_identity(&step);
+    img_lut_gamma(&step, 0.8);
+    assert(img_apply_lut(lctx, lb, &step) == IMG_OK);
+    assert(memcmp(la->data, lb->data, la->dib.biSizeImage) == 0);
+    img_free(lctx, lb);
+
+    // The saturating-add path: every colour byte shifted, padding untouched
+    assert(img_clone(lctx, la, &lb) == IMG_OK);
+    img_lut_identity(&step);
+    img_lut_brightness(&step, 40);
+    assert(img_apply_lut(lctx, lb, &step) == IMG_OK);
+    size_t lstride = la->dib.biSizeImage / 13;
+    for (size_t i = 0; i < la->dib.biSizeImage; i++)
+    {
+        int expect = (i % lstride < 37 * 3) ? (la->data[i] + 40 > 255 ? 255 : la->data[i] + 40) : la->data[i];
+        assert(lb->data[i] == expect);
+    }
+    assert(img_grayscale(lctx, lb) == IMG_OK);
+    assert(lb->data[0] == lb->data[1] && lb->data[1] == lb->data[2]);
+    img_free(lctx, lb);
+    img_free(lctx, la);
+    img_free(lctx, lsrc);
+    img_ctx_destroy(lctx);
+    printf("[PASS] Tone curves\n");
+
+    // 17. Filters: fixed-point convolution against a direct sum, blurs with and without a pool
+    ThreadPool *fpool = tp_create(3);
+    imgctx *fctx = img_ctx_create(NULL, fpool);
+    imgctx *gctx = img_ctx_create(NULL, NULL);
+    BMPImage *fsrc = NULL, *fsmall = NULL, *fa = NULL, *fb = NULL;
+    assert(img_load(fctx, "test/blackbuck.bmp", &fsrc) == IMG_OK);
+    assert(img_resize(fctx, fsrc, 37, 13, &fsmall) == IMG_OK);
+    const float one[1] = {1.0f};
+    assert(img_convolve(fctx, fsmall, one, 1, one, 1, &fa) == IMG_OK);
+    assert(memcmp(fa->data, fsmall->data, fsmall->dib.biSizeImage) == 0);
+    img_free(fctx, fa);
+    const float tri[3] = {0.25f, 0.5f, 0.25f};
+    const float edge[3] = {-0.5f, 1.5f, 0.0f};
+    assert(img_convolve(fctx, fsmall, tri, 3, edge, 3, &fa) == IMG_OK);
+    size_t fstride = fsmall->dib.biSizeImage / 13;
+    for (int y = 0; y < 13; y++)
+    {
+        for (int i = 0; i < 37 * 3; i++)
+        {
+            double acc = 0.0;
+            for (int v = 0; v < 3; v++)
+            {
+                int yy = y + v - 1 < 0 ? 0 : y + v - 1 > 12 ? 12 : y + v - 1;
+                for (int h = 0; h < 3; h++)
+                {
+                    int xx = i / 3 + h - 1 < 0 ? 0 : i / 3 + h - 1 > 36 ? 36 : i / 3 + h - 1;
+                    acc += edge[v] * tri[h] * fsmall->data[yy * fstride + xx * 3 + i % 3];
+                }
+            }
+            acc = acc < 0.0 ? 0.0 : acc > 255.0 ? 255.0 : acc;
+            assert(fabs(fa->data[y * fstride + i] - acc) <= 1.0);
+        }
+    }
+    img_free(fctx, fa);
+    assert(img_gaussian_blur(fctx, fsrc, 4.0, &fa) == IMG_OK);
+    assert(img_gaussian_blur(gctx, fsrc, 4.0, &fb) == IMG_OK);
+    assert(memcmp(fa->data, fb->data, fa->dib.biSizeImage) == 0);
+    img_free(fctx, fa);
+    img_free(gctx, fb);
+    assert(img_unsharp_mask(fctx, fsmall, 1.0, 0.0, 0, &fa) == IMG_OK);
+    assert(memcmp(fa->data, fsmall->data, fsmall->dib.biSizeImage) == 0);
+    img_free(fctx, fa);
+    unsigned char fcol[3] = {9, 180, 255};
+    assert(img_fill(fctx, fsmall, fcol) == IMG_OK);
+    assert(img_box_blur(fctx, fsmall, 5, &fa) == IMG_OK);
+    assert(memcmp(fa->data, fsmall->data, fsmall->dib.biSizeImage) == 0);
+    img_free(fctx, fa);
+    img_free(fctx, fsmall);
+    img_free(fctx, fsrc);
+    img_ctx_destroy(gctx);
+    img_ctx_destroy(fctx);
+    tp_destroy(fpool);
+    printf("[PASS] Filters\n");
+
+    // 18. Overlay: 32-bit alpha and 24-bit opacity blends, clipped at the edges
+    imgctx *octx = img_ctx_create(NULL, NULL);
+    unsigned char opix[11 * 5 * 4], dpix[9 * 6 * 4], dref[9 * 6 * 4];
+    BMPImage osrc, odst;
+    memset(&osrc, 0, sizeof(osrc));
+    osrc.dib.biWidth = 11;
+    osrc.dib.biHeight = 5;
+    osrc.dib.biBitCount = 32;
+    osrc.data = opix;
+    osrc.mapping_fd = -1;
+    odst = osrc;
+    odst.dib.biWidth = 9;
+    odst.dib.biHeight = 6;
+    odst.data = dpix;
+    // Source rows: opaque, transparent, then mixed alpha
+    for (int i = 0; i < (int)sizeof(opix); i++)
+        opix[i] = (unsigned char)((i % 4 != 3) ? i * 37 : (i < 44) ? 255 : (i < 88) ? 0 : i * 7);
+    for (int i = 0; i < (int)sizeof(dpix); i++)
+        dpix[i] = (unsigned char)(i * 11 + 5);
+    memcpy(dref, dpix, sizeof(dpix));
+    for (int op = 200; op <= 255; op += 55)
+    {
+        for (int y = 2; y < 6; y++)
+        {
+            for (int x = 0; x < 9; x++)
+            {
+                const unsigned char *sp = opix + ((y - 2) * 11 + x + 2) * 4;
+                unsigned char *dp = dref + (y * 9 + x) * 4;
+                int a = (int)(sp[3] * op / 255.0 + 0.5);
+                for (int c = 0; c < 4; c++)
+                    dp[c] = (unsigned char)blend_ref(c == 3 ? 255 : sp[c], dp[c], a);
+            }
+        }
+        assert(img_overlay(octx, &odst, &osrc, -2, 2, op) == IMG_OK);
+        assert(memcmp(dpix, dref, sizeof(dpix)) == 0);
+    }
+
+    BMPImage *obase = NULL, *otop = NULL, *ocopy = NULL;
+    assert(img_load(octx, "test/blackbuck.bmp", &obase) == IMG_OK);
+    assert(img_resize(octx, obase, 20, 20, &otop) == IMG_OK);
+    img_free(octx, obase);
+    assert(img_load(octx, "test/blackbuck.bmp", &obase) == IMG_OK);
+    assert(img_clone(octx, obase, &ocopy) == IMG_OK);
+    assert(img_overlay(octx, obase, otop, 500, -4, 128) == IMG_OK);
+    size_t ostride = obase->dib.biSizeImage / 512, tstride = otop->dib.biSizeImage / 20;
+    for (int y = 0; y < 16; y++)
+        for (int i = 0; i < 12 * 3; i++)
+            assert(obase->data[y * ostride + 500 * 3 + i] ==
+                   blend_ref(otop->data[(y + 4) * tstride + i], ocopy->data[y * ostride + 500 * 3 + i], 128));
+    assert(memcmp(obase->data + 16 * ostride, ocopy->data + 16 * ostride, ostride * (512 - 16)) == 0);
+    img_free(octx, ocopy);
+    img_free(octx, otop);
+    img_free(octx, obase);
+    img_ctx_destroy(octx);
+    printf("[PASS] Overlay blending\n");
+
+    // 19. Palettized, 16-bit and RLE files load as 24-bit
+    imgctx *dctx = img_ctx_create(NULL, NULL);
+    BMPImage *dimg = NULL;
+    const unsigned char pal[16][4] = {{0, 0, 0, 0}, {10, 20, 30, 0}, {40, 50, 60, 0}, {255, 128, 1, 0}};
+    const unsigned char px4[2][4] = {{0x12, 0x30, 0x10, 0}, {0x33, 0x21, 0x00, 0}}; // 5 pixels per row
+    write_raw_bmp("test/decode.bmp", 5, 2, 4, 0, pal, sizeof(pal), px4, sizeof(px4));
+    assert(img_load(dctx, "test/decode.bmp", &dimg) == IMG_OK);
+    assert(dimg->dib.biBitCount == 24 && dimg->dib.biCompression == 0 && dimg->dib.biSizeImage == 2 * 16);
+    assert(memcmp(dimg->data, pal[1], 3) == 0 && memcmp(dimg->data + 3, pal[2], 3) == 0);
+    assert(memcmp(dimg->data + 4 * 3, pal[1], 3) == 0 && memcmp(dimg->data + 16 + 3, pal[3], 3) == 0);
+    assert(dimg->data[15] == 0);
+    img_free(dctx, dimg);
+
+    const unsigned char px1[2][4] = {{0xA5, 0x80, 0, 0}, {0xFF, 0x00, 0, 0}}; // 9 pixels per row
+    write_raw_bmp("test/decode.bmp", 9, 2, 1, 0, pal, 2 * 4, px1, sizeof(px1));
+    assert(img_load(dctx, "test/decode.bmp", &dimg) == IMG_OK);
+    for (int x = 0; x < 9; x++)
+        assert(memcmp(dimg->data + 3 * x, pal[(x < 8) ? (0xA5 >> (7 - x)) & 1 : 1], 3) == 0);
+    assert(memcmp(dimg->data + 28 + 3 * 7, pal[1], 3) == 0 && memcmp(dimg->data + 28 + 3 * 8, pal[0], 3) == 0);
+    img_free(dctx, dimg);
+
+    const uint32_t masks565[3] = {0xF800, 0x07E0, 0x001F};
+    const uint16_t px16[2] = {0xF800, 0x07FF}; // red; green + blue
+    write_raw_bmp("test/decode.bmp", 2, 1, 16, 3, masks565, sizeof(masks565), px16, sizeof(px16));
+    assert(img_load(dctx, "test/decode.bmp", &dimg) == IMG_OK);
+    const unsigned char want16[6] = {0, 0, 255, 255, 255, 0};
+    assert(memcmp(dimg->data, want16, 6) == 0);
+    img_free(dctx, dimg);
+
+    // RLE8: run, delta, absolute run, end of line, end of bitmap
+    const unsigned char rle[] = {3, 1, 0, 2, 1, 1, 0, 3, 2, 3, 1, 0, 0, 0, 2, 2, 0, 1};
+    write_raw_bmp("test/decode.bmp", 7, 3, 8, 1, pal, sizeof(pal), rle, sizeof(rle));
+    assert(img_load(dctx, "test/decode.bmp", &dimg) == IMG_OK);
+    const int want_rle[3][7] = {{1, 1, 1, 0, 0, 0, 0}, {0, 0, 0, 0, 2, 3, 1}, {2, 2, 0, 0, 0, 0, 0}};
+    for (int y = 0; y < 3; y++)
+        for (int x = 0; x < 7; x++)
+            assert(memcmp(dimg->data + y * 24 + 3 * x, pal[want_rle[y][x]], 3) == 0);
+    img_free(dctx, dimg);
+
+    // A stream cut short by the end of the file, though biSizeImage claims
+    // all of it, decodes as far as it goes
+    write_raw_bmp("test/decode.bmp", 7, 3, 8, 1, pal, sizeof(pal), rle, 6);
+    FILE *df = fopen("test/decode.bmp", "r+b");
+    assert(df != NULL);
+    uint32_t claimed = sizeof(rle);
+    assert(fseek(df, (long)(sizeof(BMPHeader) + offsetof(DIBHeader, biSizeImage)), SEEK_SET) == 0);
+    assert(fwrite(&claimed, sizeof(claimed), 1, df) == 1);
+    fclose(df);
+    assert(img_load(dctx, "test/decode.bmp", &dimg) == IMG_OK);
+    for (int y = 0; y < 3; y++)
+        for (int x = 0; x < 7; x++)
+            assert(memcmp(dimg->data + y * 24 + 3 * x, pal[y == 0 && x < 3 ? 1 : 0], 3) == 0);
+    img_free(dctx, dimg);
+
+    // Overlong rows: runs, deltas and absolute runs past the end of a row
+    // are clipped, even when they add up to more than INT_MAX columns
+    size_t nruns = 8500000, rlen = 2 * nruns + 12;
+    unsigned char *longrle = (unsigned char *)malloc(rlen);
+    assert(longrle != NULL);
+    for (size_t i = 0; i < nruns; i++)
+    {
+        longrle[2 * i] = 255;
+        longrle[2 * i + 1] = (i == 0) ? 1 : 2;
+    }
+    const unsigned char rle_tail[12] = {0, 2, 255, 0, 0, 3, 3, 3, 3, 0, 0, 0};
+    memcpy(longrle + 2 * nruns, rle_tail, sizeof(rle_tail));
+    write_raw_bmp("test/decode.bmp", 4, 4, 8, 1, pal, sizeof(pal), longrle, rlen);
+    free(longrle);
+    assert(img_load(dctx, "test/decode.bmp", &dimg) == IMG_OK);
+    for (int y = 0; y < 4; y++)
+        for (int x = 0; x < 4; x++)
+            assert(memcmp(dimg->data + y * 12 + 3 * x, pal[y == 0 ? 1 : 0], 3) == 0);
+    img_free(dctx, dimg);
+    remove("test/decode.bmp");
+    img_ctx_destroy(dctx);
+    printf("[PASS] Indexed and RLE decoding\n");
+
+    // 20. Compact output: exact palette round trip, RLE8, and quantizing
+    imgctx *ectx = img_ctx_create(NULL, NULL);
+    BMPImage *eimg = NULL, *eback = NULL;
+    assert(img_load(ectx, "test/blackbuck.bmp", &eimg) == IMG_OK);
+    BMPImage *esmall = NULL;
+    assert(img_resize(ectx, eimg, 61, 23, &esmall) == IMG_OK);
+    img_free(ectx, eimg);
+    eimg = esmall;
+    assert(img_save_ex(ectx, "test/compact.bmp", eimg, IMG_SAVE_PALETTE | IMG_SAVE_RLE) == IMG_OK);
+    assert(img_load(ectx, "test/compact.bmp", &eback) == IMG_OK);
+    assert(eback->dib.biSizeImage == eimg->dib.biSizeImage); // too many colours: written as is
+    img_free(ectx, eback);
+
+    // Quantized: at most 256 colours, each pixel close to its original
+    assert(img_save_ex(ectx, "test/compact.bmp", eimg, IMG_SAVE_QUANTIZE) == IMG_OK);
+    assert(img_load(ectx, "test/compact.bmp", &eback) == IMG_OK);
+    size_t estride = eimg->dib.biSizeImage / 23;
+    long err = 0;
+    for (int y = 0; y < 23; y++)
+        for (int i = 0; i < 61 * 3; i++)
+            err += labs((long)eimg->data[y * estride + i] - eback->data[y * estride + i]);
+    assert(err / (61 * 23 * 3) < 8);
+    img_free(ectx, eback);
+
+    // Few colours: the palette is exact and RLE8 shrinks the file
+    unsigned char ecol[3] = {12, 34, 56};
+    assert(img_fill(ectx, eimg, ecol) == IMG_OK);
+    for (int i = 0; i < 20; i++)
+        eimg->data[5 * estride + 3 * i + i % 3] = (unsigned char)(i * 13);
+    assert(img_save_ex(ectx, "test/compact.bmp", eimg, IMG_SAVE_PALETTE | IMG_SAVE_RLE) == IMG_OK);
+    FILE *ef = fopen("test/compact.bmp", "rb");
+    assert(ef);
+    fseek(ef, 0, SEEK_END);
+    assert(ftell(ef) < (long)eimg->dib.biSizeImage / 4);
+    fclose(ef);
+    assert(img_load(ectx, "test/compact.bmp", &eback) == IMG_OK);
+    assert(memcmp(eback->data, eimg->data, eimg->dib.biSizeImage) == 0);
+    img_free(ectx, eback);
+    remove("test/compact.bmp");
+    img_free(ectx, eimg);
+    img_ctx_destroy(ectx);
+    printf("[PASS] Palettized and RLE8 output\n");
+
+    // 21. V5 headers, 32-bit bit fields and mapped loading of large files
+    imgctx *vctx = img_ctx_create(NULL, NULL);
+    unsigned char vpix[3 * 2 * 4];
+    for (int i = 0; i < (int)sizeof(vpix); i++)
+        vpix[i] = (unsigned char)(i * 29 + 3);
+    BMPImage vimg;
+    memset(&vimg, 0, sizeof(vimg));
+    vimg.header.bfType = 0x4D42;
+    vimg.dib.biSize = sizeof(DIBHeader);
+    vimg.dib.biWidth = 3;
+    vimg.dib.biHeight = -2;
+    vimg.dib.biPlanes = 1;
+    vimg.dib.biBitCount = 32;
+    vimg.dib.biSizeImage = sizeof(vpix);
+    vimg.data = vpix;
+    vimg.mapping_fd = -1;
+    assert(img_save_ex(vctx, "test/v5.bmp", &vimg, IMG_SAVE_V5) == IMG_OK);
+    BMPImage *vback = NULL;
+    assert(img_load(vctx, "test/v5.bmp", &vback) == IMG_OK);
+    assert(vback->dib.biBitCount == 32 && vback->dib.biCompression == 0 && vback->dib.biHeight == -2);
+    assert(memcmp(vback->data, vpix, sizeof(vpix)) == 0);
+    FILE *vf = fopen("test/v5.bmp", "rb");
+    BMPHeader vh;
+    DIBHeader vd;
+    assert(vf && fread(&vh, sizeof(vh), 1, vf) == 1 && fread(&vd, sizeof(vd), 1, vf) == 1);
+    fclose(vf);
+    assert(vd.biSize == 124 && vd.biCompression == 3 && vh.bfOffBits == 14 + 124);
+    img_free(vctx, vback);
+
+    // Bytes in red, green, blue, unused order: swapped into BGR, 24-bit
+    const uint32_t rgbx[3] = {0x000000FF, 0x0000FF00, 0x00FF0000};
+    write_raw_bmp("test/v5.bmp", 3, -2, 32, 3, rgbx, sizeof(rgbx), vpix, sizeof(vpix));
+    assert(img_load(vctx, "test/v5.bmp", &vback) == IMG_OK);
+    assert(vback->dib.biBitCount == 24);
+    for (int i = 0; i < 3; i++)
+        assert(vback->data[12 + 3 * i] == vpix[12 + 4 * i + 2] && vback->data[12 + 3 * i + 2] == vpix[12 + 4 * i]);
+    img_free(vctx, vback);
+    remove("test/v5.bmp");
+
+    // Files of 64 MB and more map their pixels; saving over the source is safe
+    BMPImage *vsrc = NULL, *vbig = NULL;
+    assert(img_load(vctx, "test/blackbuck.bmp", &vsrc) == IMG_OK);
+    assert(img_resize(vctx, vsrc, 4800, 4700, &vbig) == IMG_OK);
+    assert(img_save(vctx, "test/big.bmp", vbig) == IMG_OK);
+    img_free(vctx, vbig);
+    assert(img_load(vctx, "test/big.bmp", &vbig) == IMG_OK);
+#ifndef _WIN32
+    assert(vbig->mapping && vbig->mapping_fd < 0);
+#endif
+    assert(img_embed(vctx, vbig, "mapped", 0) == IMG_OK);
+    assert(img_save(vctx, "test/big.bmp", vbig) == IMG_OK);
+    BMPImage *vagain = NULL;
+    assert(img_load(vctx, "test/big.bmp", &vagain) == IMG_OK);
+    assert(memcmp(vagain->data, vbig->data, vbig->dib.biSizeImage) == 0);
+
+    // Saving another image over a file that is still mapped leaves the
+    // mapping's pixels alone
+    BMPImage *vother = NULL;
+    uint64_t vhash = img_content_hash(vagain);
+    assert(img_clone(vctx, vbig, &vother) == IMG_OK);
+    assert(img_embed(vctx, vother, "other", 0) == IMG_OK);
+    assert(img_save(vctx, "test/big.bmp", vother) == IMG_OK);
+    assert(img_content_hash(vagain) == vhash);
+    img_free(vctx, vother);
+    assert(!file_exists("test/big.bmp.part"));
+    img_free(vctx, vagain);
+    img_free(vctx, vbig);
+    img_free(vctx, vsrc);
+    remove("test/big.bmp");
+    img_ctx_destroy(vctx);
+    printf("[PASS] V5 headers and large files\n");
+
+    // 22. Tiled storage: round trip, and tiled rotate/affine match the row-major kernels
+    imgctx *ictx = img_ctx_create(NULL, NULL);
+    static unsigned char tpix[150 * 4 * 70];
+    for (int i = 0; i < (int)sizeof(tpix); i++)
+        tpix[i] = (unsigned char)(rand() & 0xFF);
+    const int tsizes[3][3] = {{131, -70, 24}, {67, 65, 32}, {150, 1, 24}};
+    const double tshear[6] = {1.0, 0.3, -12.0, 0.2, 0.9, 5.5};
+    for (int k = 0; k < 3; k++)
+    {
+        int tw = tsizes[k][0], th = tsizes[k][1], tbits = tsizes[k][2];
+        size_t tsize = (((size_t)tw * tbits + 31) / 32) * 4 * (size_t)(th < 0 ? -th : th);
+        write_raw_bmp("test/tiled.bmp", tw, th, tbits, 0, NULL, 0, tpix, tsize);
+        BMPImage *tsrc = NULL, *tback = NULL, *tref = NULL;
+        img_tiled *tiles = NULL, *tout = NULL;
+        assert(img_load(ictx, "test/tiled.bmp", &tsrc) == IMG_OK);
+        for (size_t y = 0; y < tsize; y += tsize / (th < 0 ? -th : th))
+            memset(tsrc->data + y + (size_t)tw * tbits / 8, 0, tsize / (th < 0 ? -th : th) - (size_t)tw * tbits / 8);
+        assert(img_to_tiled(ictx, tsrc, &tiles) == IMG_OK);
+        assert(tiles->tiles_x == (tw + IMG_TILE - 1) / IMG_TILE);
+        assert(img_from_tiled(ictx, tiles, &tback) == IMG_OK);
+        assert(tback->dib.biHeight == th && memcmp(tback->data, tsrc->data, tsize) == 0);
+        img_free(ictx, tback);
+
+        const double angles[4] = {0.0, 33.0, 90.0, 200.0};
+        for (int a = 0; a < 5; a++)
+        {
+            if (a < 4)
+            {
+                assert(img_rotate(ictx, tsrc, angles[a], &tref) == IMG_OK);
+                assert(img_tiled_rotate(ictx, tiles, angles[a], &tout) == IMG_OK);
+            }
+            else
+            {
+                assert(img_affine(ictx, tsrc, tshear, &tref) == IMG_OK);
+                assert(img_tiled_affine(ictx, tiles, tshear, &tout) == IMG_OK);
+            }
+            assert(img_from_tiled(ictx, tout, &tback) == IMG_OK);
+            assert(memcmp(tback->data, tref->data, tsize) == 0);
+            img_free(ictx, tback);
+            img_free(ictx, tref);
+            img_free_tiled(ictx, tout);
+        }
+        img_free_tiled(ictx, tiles);
+        img_free(ictx, tsrc);
+    }
+    remove("test/tiled.bmp");
+    img_ctx_destroy(ictx);
+    printf("[PASS] Tiled storage and tiled rotate/affine\n");
+
+    // 23. Copy-on-write history: local edits cost their tiles, undo/redo restore exactly
+    imgctx *hctx = img_ctx_create(NULL, NULL);
+    BMPImage *himg = NULL, *hstep = NULL;
+    assert(img_load(hctx, "test/blackbuck.bmp", &himg) == IMG_OK);
+    size_t hsize = himg->dib.biSizeImage;
+    unsigned char *horig = malloc(hsize);
+    assert(horig);
+    memcpy(horig, himg->data, hsize);
+    History *hist = history_create((size_t)64 << 20);
+    int hundo, hredo;
+    size_t hbytes, hbase;
+    assert(history_record(hist, hctx, himg, NULL) == IMG_OK);
+    history_stats(hist, &hundo, &hredo, &hbase);
+    assert(hundo == 0 && hredo == 0 && hbase == (size_t)himg->dib.biWidth * (size_t)abs(himg->dib.biHeight) * 3);
+
+    // A 10x10 fill inside one tile adds one tile
+    const unsigned char hred[3] = {255, 0, 0};
+    int hrect[4] = {70, 70, 10, 10};
+    assert(img_fill_rect(hctx, himg, hred, hrect[0], hrect[1], hrect[2], hrect[3]) == IMG_OK);
+    assert(history_record(hist, hctx, himg, hrect) == IMG_OK);
+    history_stats(hist, &hundo, &hredo, &hbytes);
+    assert(hundo == 1 && hbytes == hbase + IMG_TILE * IMG_TILE * 3);
+    unsigned char *hfilled = malloc(hsize);
+    assert(hfilled);
+    memcpy(hfilled, himg->data, hsize);
+
+    // An embed touches the first rows only; recording an unchanged image adds nothing
+    assert(img_embed(hctx, himg, "undo me", 0) == IMG_OK);
+    assert(history_record(hist, hctx, himg, NULL) == IMG_OK);
+    assert(history_record(hist, hctx, himg, NULL) == IMG_OK);
+    history_stats(hist, &hundo, &hredo, &hbytes);
+    assert(hundo == 2 && hbytes < hbase + (size_t)(himg->dib.biWidth / IMG_TILE + 2) * IMG_TILE * IMG_TILE * 3);
+
+    assert(history_undo(hist, hctx, &hstep) == IMG_OK);
+    assert(memcmp(hstep->data, hfilled, hsize) == 0);
+    img_free(hctx, hstep);
+    assert(history_undo(hist, hctx, &hstep) == IMG_OK);
+    assert(memcmp(hstep->data, horig, hsize) == 0 && hstep->dib.biHeight == himg->dib.biHeight);
+    img_free(hctx, hstep);
+    assert(history_undo(hist, hctx, &hstep) == IMG_ERR_ARG);
+    assert(history_redo(hist, hctx, &hstep) == IMG_OK);
+    assert(memcmp(hstep->data, hfilled, hsize) == 0);
+
+    // A new change drops the redo step; a crop changes the geometry
+    BMPImage *hcrop = NULL;
+    assert(img_crop(hctx, hstep, 5, 5, 100, 50, &hcrop) == IMG_OK);
+    assert(history_record(hist, hctx, hcrop, NULL) == IMG_OK);
+    history_stats(hist, &hundo, &hredo, &hbytes);
+    assert(hundo == 2 && hredo == 0);
+    assert(history_redo(hist, hctx, &hstep) == IMG_ERR_ARG);
+    img_free(hctx, hcrop);
+    img_free(hctx, hstep);
+
+    // Over the limit the oldest versions go; an image larger than it clears everything
+    history_destroy(hist);
+    hist = history_create(hbase + IMG_TILE * IMG_TILE * 3);
+    assert(history_record(hist, hctx, himg, NULL) == IMG_OK);
+    assert(img_fill_rect(hctx, himg, hred, 0, 0, 1, 1) == IMG_OK);
+    assert(history_record(hist, hctx, himg, NULL) == IMG_OK);
+    assert(img_fill_rect(hctx, himg, hred, 200, 100, 1, 1) == IMG_OK);
+    assert(history_record(hist, hctx, himg, NULL) == IMG_OK);
+    history_stats(hist, &hundo, &hredo, &hbytes);
+    assert(hundo == 1 && hbytes <= hbase + IMG_TILE * IMG_TILE * 3);
+    history_destroy(hist);
+    hist = history_create(1000);
+    assert(history_record(hist, hctx, himg, NULL) == IMG_OK);
+    history_stats(hist, &hundo, &hredo, &hbytes);
+    assert(hundo == 0 && hbytes == 0);
+    history_destroy(hist);
+    free(horig);
+    free(hfilled);
+    img_free(hctx, himg);
+    img_ctx_destroy(hctx);
+    printf("[PASS] Copy-on-write undo/redo history\n");
+
+    // 24. Differential tests: every kernel variant equals the plain reference kernels (src/reference.c)
+    //     byte for byte, on random images of odd widths, both row orders, 24 and 32 bits
+    ThreadPool *dpool = tp_create(4);
+    imgctx *dser = img_ctx_create(NULL, NULL);
+    imgctx *dpar = img_ctx_create(NULL, dpool);
+    MemoCache *dmemo = memo_create(16 * 1024 * 1024, NULL);
+    assert(dpool && dser && dpar && dmemo);
+    imgctx *dctxs[2] = {dser, dpar};
+    for (int dc = 0; dc < 300; dc++) {
+        BMPImage dtmpl;
+        memset(&dtmpl, 0, sizeof(dtmpl));
+        dtmpl.header.bfType = 0x4D42;
+        dtmpl.header.bfOffBits = sizeof(BMPHeader) + sizeof(DIBHeader);
+        dtmpl.dib.biSize = sizeof(DIBHeader);
+        dtmpl.dib.biPlanes = 1;
+        dtmpl.dib.biBitCount = diff_rand(2) ? 32 : 24;
+        dtmpl.dib.biHeight = diff_rand(2) ? -1 : 1;
+        int dw = 1 + 2 * (int)diff_rand(100);
+        int dh = 1 + (int)diff_rand(150);
+        BMPImage *dsrc = ref_new_image(&dtmpl, dw, dh);
+        assert(dsrc);
+        for (uint32_t i = 0; i < dsrc->dib.biSizeImage; i++)
+            dsrc->data[i] = (unsigned char)diff_rand(256);
+        BMPImage *dwant, *dgot, *dwork;
+
+        // Rotation at any angle or a multiple of 90, then a shear, through
+        // the serial and pooled row-major kernels, the legacy API, the
+        // result cache and the tiled kernels
+        double dangle = diff_rand(3) ? diff_real(-720.0, 720.0) : 90.0 * ((int)diff_rand(9) - 4);
+        dwant = ref_rotate(dsrc, dangle);
+        for (int k = 0; k < 2; k++) {
+            assert(img_rotate(dctxs[k], dsrc, dangle, &dgot) == IMG_OK);
+            diff_expect(dc, k ? "rotate (pool)" : "rotate", dwant, dgot);
+            img_free(dctxs[k], dgot);
+        }
+        dgot = rotate_bmp(dsrc, dangle);
+        diff_expect(dc, "rotate_bmp", dwant, dgot);
+        free_bmp(dgot);
+        MemoOp dop = {MEMO_ROTATE, {0, 0, 0, 0}, dangle};
+        for (int k = 0; k < 2; k++) {
+            int dhit;
+            assert(memo_apply(dmemo, dser, dsrc, &dop, &dgot, &dhit) == IMG_OK && dhit == k);
+            diff_expect(dc, "memo rotate", dwant, dgot);
+            img_free(dser, dgot);
+        }
+        img_tiled *dtiles, *dtout;
+        assert(img_to_tiled(dpar, dsrc, &dtiles) == IMG_OK);
+        assert(img_tiled_rotate(dpar, dtiles, dangle, &dtout) == IMG_OK);
+        assert(img_from_tiled(dpar, dtout, &dgot) == IMG_OK);
+        diff_expect(dc, "tiled rotate", dwant, dgot);
+        img_free(dpar, dgot);
+        img_free_tiled(dpar, dtout);
+        free_bmp(dwant);
+
+        // A large translation sends whole rows past the fixed-point range
+        double dm[6] = {diff_real(0.5, 2.0), diff_real(-1.0, 1.0), diff_real(-50.0, 50.0),
+                        diff_real(-1.0, 1.0), diff_real(0.5, 2.0), diff_real(-50.0, 50.0)};
+        if (diff_rand(8) == 0)
+            dm[2] = diff_rand(2) ? 3e9 : -3e9;
+        dwant = ref_affine(dsrc, dm);
+        for (int k = 0; k < 2; k++) {
+            assert(img_affine(dctxs[k], dsrc, dm, &dgot) == IMG_OK);
+            diff_expect(dc, k ? "affine (pool)" : "affine", dwant, dgot);
+            img_free(dctxs[k], dgot);
+        }
+        assert(img_tiled_affine(dser, dtiles, dm, &dtout) == IMG_OK);
+        assert(img_from_tiled(dser, dtout, &dgot) == IMG_OK);
+        diff_expect(dc, "tiled affine", dwant, dgot);
+        img_free(dser, dgot);
+        img_free_tiled(dser, dtout);
+        img_free_tiled(dpar, dtiles);
+        free_bmp(dwant);
+
+        // Scale, resize and crop
+        double dfactor = diff_real(0.05, 3.0);
+        dwant = ref_scale(dsrc, dfactor);
+        if (dwant) {
+            for (int k = 0; k < 2; k++) {
+                assert(img_scale(dctxs[k], dsrc, dfactor, &dgot) == IMG_OK);
+                diff_expect(dc, k ? "scale (pool)" : "scale", dwant, dgot);
+                img_free(dctxs[k], dgot);
+            }
+            dgot = scale_bmp(dsrc, dfactor);
+            diff_expect(dc, "scale_bmp", dwant, dgot);
+            free_bmp(dgot);
+            free_bmp(dwant);
+        } else {
+            assert(img_scale(dser, dsrc, dfactor, &dgot) == IMG_ERR_ARG);
+        }
+        int drw = 1 + (int)diff_rand(250), drh = 1 + (int)diff_rand(250);
+        dwant = ref_resize(dsrc, drw, drh);
+        for (int k = 0; k < 2; k++) {
+            assert(img_resize(dctxs[k], dsrc, drw, drh, &dgot) == IMG_OK);
+            diff_expect(dc, k ? "resize (pool)" : "resize", dwant, dgot);
+            img_free(dctxs[k], dgot);
+        }
+        dgot = resize_bmp(dsrc, drw, drh);
+        diff_expect(dc, "resize_bmp", dwant, dgot);
+        free_bmp(dgot);
+        free_bmp(dwant);
+        int dx = (int)diff_rand(dw), dy = (int)diff_rand(dh);
+        int dcw = 1 + (int)diff_rand(dw - dx), dch = 1 + (int)diff_rand(dh - dy);
+        dwant = ref_crop(dsrc, dx, dy, dcw, dch);
+        for (int k = 0; k < 2; k++) {
+            assert(img_crop(dctxs[k], dsrc, dx, dy, dcw, dch, &dgot) == IMG_OK);
+            diff_expect(dc, k ? "crop (pool)" : "crop", dwant, dgot);
+            img_free(dctxs[k], dgot);
+        }
+        MemoOp dcrop = {MEMO_CROP, {dx, dy, dcw, dch}, 0.0};
+        assert(memo_apply(dmemo, dpar, dsrc, &dcrop, &dgot, NULL) == IMG_OK);
+        diff_expect(dc, "memo crop", dwant, dgot);
+        img_free(dpar, dgot);
+        free_bmp(dwant);
+        assert(img_crop(dser, dsrc, dx, dy, dw - dx + 1, dch, &dgot) == IMG_ERR_BOUNDS);
+
+        // In-place kernels: fill, fill_rect, tone tables and grayscale
+        unsigned char dcolor[3] = {(unsigned char)diff_rand(256), (unsigned char)diff_rand(256),
+                                   (unsigned char)diff_rand(256)};
+        dwant = diff_copy(dsrc);
+        ref_fill_rect(dwant, dcolor, 0, 0, dw, dh);
+        for (int k = 0; k < 2; k++) {
+            dwork = diff_copy(dsrc);
+            assert(img_fill(dctxs[k], dwork, dcolor) == IMG_OK);
+            diff_expect(dc, k ? "fill (pool)" : "fill", dwant, dwork);
+            free_bmp(dwork);
+        }
+        dwork = diff_copy(dsrc);
+        fill_bmp(dwork, dcolor);
+        diff_expect(dc, "fill_bmp", dwant, dwork);
+        free_bmp(dwork);
+        free_bmp(dwant);
+        dwant = diff_copy(dsrc);
+        ref_fill_rect(dwant, dcolor, dx, dy, dcw, dch);
+        for (int k = 0; k < 2; k++) {
+            dwork = diff_copy(dsrc);
+            assert(img_fill_rect(dctxs[k], dwork, dcolor, dx, dy, dcw, dch) == IMG_OK);
+            diff_expect(dc, k ? "fill_rect (pool)" : "fill_rect", dwant, dwork);
+            free_bmp(dwork);
+        }
+        free_bmp(dwant);
+
+        // Tone chains, and a plain brightness shift (the SSE2 path)
+        img_lut dlut;
+        img_lut_identity(&dlut);
+        if (diff_rand(3) == 0) {
+            img_lut_brightness(&dlut, (int)diff_rand(161) - 80);
+        } else {
+            for (int n = 1 + (int)diff_rand(4); n > 0; n--) {
+                switch (diff_rand(4)) {
+                case 0: img_lut_brightness(&dlut, (int)diff_rand(161) - 80); break;
+                case 1: img_lut_contrast(&dlut, diff_real(0.2, 3.0)); break;
+                case 2: img_lut_gamma(&dlut, diff_real(0.3, 3.0)); break;
+                default: img_lut_levels(&dlut, (int)diff_rand(100), 155 + (int)diff_rand(101),
+                                        (int)diff_rand(100), 155 + (int)diff_rand(101)); break;
+                }
+            }
+        }
+        dwant = diff_copy(dsrc);
+        ref_apply_lut(dwant, &dlut);
+        for (int k = 0; k < 2; k++) {
+            dwork = diff_copy(dsrc);
+            assert(img_apply_lut(dctxs[k], dwork, &dlut) == IMG_OK);
+            diff_expect(dc, k ? "lut (pool)" : "lut", dwant, dwork);
+            free_bmp(dwork);
+        }
+        free_bmp(dwant);
+        dwant = diff_copy(dsrc);
+        ref_grayscale(dwant);
+        for (int k = 0; k < 2; k++) {
+            dwork = diff_copy(dsrc);
+            assert(img_grayscale(dctxs[k], dwork) == IMG_OK);
+            diff_expect(dc, k ? "grayscale (pool)" : "grayscale", dwant, dwork);
+            free_bmp(dwork);
+        }
+        free_bmp(dwant);
+
+        // Steganography in both bit positions; the length sometimes exceeds
+        // the capacity, and a random image declares a random length
+        int dmsb = (int)diff_rand(2);
+        uint64_t dcap = (uint64_t)dw * dh * (dtmpl.dib.biBitCount / 8);
+        uint32_t dlen = (uint32_t)diff_rand((uint32_t)(dcap / 8) + 2);
+        char *dmsg = malloc((size_t)dlen + 1);
+        assert(dmsg);
+        for (uint32_t i = 0; i < dlen; i++)
+            dmsg[i] = (char)(1 + diff_rand(255));
+        dmsg[dlen] = '\0';
+        uint32_t dwant_len = 0;
+        char *dwant_msg = ref_extract(dsrc, dmsb, &dwant_len);
+        char *dgot_msg = NULL;
+        assert((img_extract(dser, dsrc, dmsb, &dgot_msg) == IMG_OK) == (dwant_msg != NULL));
+        assert(!dwant_msg || memcmp(dwant_msg, dgot_msg, (size_t)dwant_len + 1) == 0);
+        img_free_message(dser, dgot_msg);
+        free(dwant_msg);
+        dwant = diff_copy(dsrc);
+        int dfits = ref_embed(dwant, dmsg, dmsb) == 0;
+        dwork = diff_copy(dsrc);
+        assert((img_embed(dpar, dwork, dmsg, dmsb) == IMG_OK) == dfits);
+        diff_expect(dc, "embed", dwant, dwork);
+        free_bmp(dwork);
+        if (dfits) {
+            dwork = diff_copy(dsrc);
+            assert(embed_message(dwork, dmsg, dmsb) == 0);
+            diff_expect(dc, "embed_message", dwant, dwork);
+            dwant_msg = ref_extract(dwant, dmsb, &dwant_len);
+            assert(dwant_msg && dwant_len == dlen && memcmp(dwant_msg, dmsg, dlen) == 0);
+            dgot_msg = extract_message(dwork, dmsb);
+            assert(dgot_msg && memcmp(dgot_msg, dmsg, (size_t)dlen + 1) == 0);
+            free_message(dgot_msg);
+            free(dwant_msg);
+            free_bmp(dwork);
+        }
+        free_bmp(dwant);
+        free(dmsg);
+        free_bmp(dsrc);
+    }
+    memo_destroy(dmemo);
+    img_ctx_destroy(dpar);
+    img_ctx_destroy(dser);
+    tp_destroy(dpool);
+    printf("[PASS] Differential tests against the reference kernels (300 cases)\n");
+
+    // 25. Memory-budget planner: every strategy writes the same file, the
+    //     fastest one within the budget is chosen
+    ThreadPool *ppool = tp_create(4);
+    imgctx *bctx = img_ctx_create(NULL, ppool);
+    assert(bctx);
+    const struct { int w, h, bits; } pfiles[2] = {{301, 203, 24}, {130, -77, 32}};
+    MemoOp pchains[3][3] = {
+        {{MEMO_CROP, {3, 5, 60, 40}, 0.0}, {MEMO_SCALE, {0, 0, 0, 0}, 0.7}, {MEMO_RESIZE, {97, 61, 0, 0}, 0.0}},
+        {{MEMO_ROTATE, {0, 0, 0, 0}, 33.0}, {MEMO_CROP, {1, 2, 100, 50}, 0.0}, {MEMO_SCALE, {0, 0, 0, 0}, 0.6}},
+        {{MEMO_SCALE, {0, 0, 0, 0}, 0.25}, {MEMO_ROTATE, {0, 0, 0, 0}, 90.0}, {MEMO_RESIZE, {40, 40, 0, 0}, 0.0}}};
+    int plens[3] = {3, 3, 0};
+    char ppath[64];
+    for (int f = 0; f < 2; f++) {
+        size_t pstride = ((size_t)pfiles[f].w * pfiles[f].bits + 31) / 32 * 4;
+        size_t psize = pstride * abs(pfiles[f].h);
+        unsigned char *ppix = malloc(psize);
+        assert(ppix);
+        for (size_t i = 0; i < psize; i++)
+            ppix[i] = (unsigned char)diff_rand(256);
+        write_raw_bmp("test/plan_in.bmp", pfiles[f].w, pfiles[f].h, pfiles[f].bits, 0, NULL, 0, ppix, psize);
+        free(ppix);
+        for (int c = 0; c < 3; c++) {
+            Plan plan;
+            assert(plan_make(bctx, "test/plan_in.bmp", pchains[c], plens[c], PLAN_UNAVAILABLE, &plan) == IMG_OK);
+            assert(plan.strategy == PLAN_MEMORY);
+            assert((plan.peak[PLAN_STREAM] == PLAN_UNAVAILABLE) == (c == 1));
+            assert(plan_run(bctx, &plan, "test/plan_in.bmp", pchains[c], plens[c], "test/plan_memory.bmp", NULL) == IMG_OK);
+            for (int st = PLAN_MAPPED; st < PLAN_COUNT; st++) {
+                if (plan.peak[st] == PLAN_UNAVAILABLE)
+                    continue;
+                Plan forced = plan;
+                forced.strategy = (PlanStrategy)st;
+                snprintf(ppath, sizeof(ppath), "test/plan_%s.bmp", plan_strategy_name(forced.strategy));
+                assert(plan_run(bctx, &forced, "test/plan_in.bmp", pchains[c], plens[c], ppath, "test") == IMG_OK);
+                assert(files_equal("test/plan_memory.bmp", ppath));
+                remove(ppath);
+            }
+
+            // Each budget between the estimates picks the first strategy that fits
+            for (int st = 0; st < PLAN_COUNT; st++) {
+                if (plan.peak[st] == PLAN_UNAVAILABLE)
+                    continue;
+                Plan bounded;
+                assert(plan_make(bctx, "test/plan_in.bmp", pchains[c], plens[c], plan.peak[st], &bounded) == IMG_OK);
+                assert((int)bounded.strategy <= st && bounded.peak[bounded.strategy] <= plan.peak[st]);
+                for (int k = 0; k < (int)bounded.strategy; k++)
+                    assert(bounded.peak[k] > plan.peak[st]);
+            }
+        }
+        // Shrinking chains fit in less memory than their source
+        Plan small;
+        assert(plan_make(bctx, "test/plan_in.bmp", pchains[0], 3, psize, &small) == IMG_OK);
+        assert(small.strategy == PLAN_MAPPED && small.width == 97 && small.height == 61);
+        assert(plan_make(bctx, "test/plan_in.bmp", pchains[0], 3, small.peak[PLAN_STREAM], &small) == IMG_OK);
+        assert(small.strategy == PLAN_STREAM);
+        assert(plan_make(bctx, "test/plan_in.bmp", pchains[1], 3, 100, &small) == IMG_ERR_NOMEM);
+        assert(small.strategy == PLAN_COUNT);
+    }
+    MemoOp pbad = {MEMO_CROP, {0, 0, 1000, 10}, 0.0};
+    Plan pfail;
+    assert(plan_make(bctx, "test/plan_in.bmp", &pbad, 1, PLAN_UNAVAILABLE, &pfail) == IMG_ERR_BOUNDS);
+    remove("test/plan_in.bmp");
+    remove("test/plan_memory.bmp");
+    img_ctx_destroy(bctx);
+    tp_destroy(ppool);
+    printf("[PASS] Memory-budget planner\n");
+
+    // 26. Header-only steganography scan agrees with img_extract on the loaded image
+    imgctx *sctx2 = img_ctx_create(NULL, NULL);
+    ThreadPool *spool2 = tp_create(4);
+    enum { SCAN_FILES = 40 };
+    ScanResult sres[SCAN_FILES + 2];
+    char spaths[SCAN_FILES][32];
+    int smsb[SCAN_FILES];
+    for (int k = 0; k < SCAN_FILES; k++) {
+        BMPImage stmpl;
+        memset(&stmpl, 0, sizeof(stmpl));
+        stmpl.header.bfType = 0x4D42;
+        stmpl.header.bfOffBits = sizeof(BMPHeader) + sizeof(DIBHeader);
+        stmpl.dib.biSize = sizeof(DIBHeader);
+        stmpl.dib.biPlanes = 1;
+        stmpl.dib.biBitCount = diff_rand(2) ? 32 : 24;
+        stmpl.dib.biHeight = diff_rand(2) ? -1 : 1;
+        // Narrow images spread the length prefix over several rows
+        int sw = (k % 3 == 0) ? 1 + (int)diff_rand(5) : 1 + 2 * (int)diff_rand(60);
+        BMPImage *simg = ref_new_image(&stmpl, sw, 1 + (int)diff_rand(60));
+        assert(simg);
+        for (uint32_t i = 0; i < simg->dib.biSizeImage; i++)
+            simg->data[i] = (unsigned char)diff_rand(256);
+        smsb[k] = (int)diff_rand(2);
+        if (k % 4 != 3) {
+            uint64_t scap = (uint64_t)sw * abs(simg->dib.biHeight) * (simg->dib.biBitCount / 8);
+            uint32_t slen = scap >= 32 ? (uint32_t)diff_rand((uint32_t)((scap - 32) / 8) + 1) : 0;
+            char *smsg = malloc((size_t)slen + 1);
+            assert(smsg);
+            for (uint32_t i = 0; i < slen; i++)
+                smsg[i] = (char)(1 + diff_rand(255));
+            smsg[slen] = '\0';
+            assert(img_embed(sctx2, simg, smsg, smsb[k]) == (scap >= 32 ? IMG_OK : IMG_ERR_CAPACITY));
+            free(smsg);
+        }
+        snprintf(spaths[k], sizeof(spaths[k]), "test/scan_%d.bmp", k);
+        assert(img_save_ex(sctx2, spaths[k], simg, (k % 2) ? IMG_SAVE_V5 : 0) == IMG_OK);
+        free_bmp(simg);
+        sres[k].path = spaths[k];
+    }
+    write_raw_bmp("test/scan_8bit.bmp", 4, 4, 8, 0, NULL, 0, spaths[0], 16);
+    sres[SCAN_FILES].path = "test/scan_8bit.bmp";
+    sres[SCAN_FILES + 1].path = "test/missing.bmp";
+    for (int msb = 0; msb < 2; msb++) {
+        scan_files(spool2, sres, SCAN_FILES + 2, msb, 1);
+        for (int k = 0; k < SCAN_FILES; k++) {
+            BMPImage *sload = NULL;
+            char *sext = NULL;
+            assert(img_load(sctx2, spaths[k], &sload) == IMG_OK);
+            img_status sst = img_extract(sctx2, sload, msb, &sext);
+            assert(sres[k].status == sst);
+            if (sst == IMG_OK) {
+                assert(memcmp(sres[k].message, sext, (size_t)sres[k].length + 1) == 0);
+            }
+            img_free_message(sctx2, sext);
+            img_free(sctx2, sload);
+        }
+        assert(sres[SCAN_FILES].status == IMG_ERR_UNSUPPORTED);
+        assert(sres[SCAN_FILES + 1].status == IMG_ERR_IO);
+        scan_free_results(sres, SCAN_FILES + 2);
+    }
+    for (int k = 0; k < SCAN_FILES; k++)
+        remove(spaths[k]);
+    remove("test/scan_8bit.bmp");
+
+    // A large file costs its headers and the 32 bytes of the length prefix
+    BMPImage *sbig = load_bmp("test/blackbuck.bmp");
+    assert(sbig && embed_message(sbig, "found me", 1) == 0);
+    assert(save_bmp("test/scan_big.bmp", sbig) == 0);
+    prof_reset();
+    prof_enable(1);
+    uint32_t slength = 0;
+    char *sfound = NULL;
+    assert(scan_file(sctx2, "test/scan_big.bmp", 1, &slength, NULL) == IMG_OK && slength == 8);
+    assert(prof_get(PROF_SCAN)->bytes_read == sizeof(BMPHeader) + sizeof(DIBHeader) + 32);
+    assert(scan_file(sctx2, "test/scan_big.bmp", 1, &slength, &sfound) == IMG_OK);
+    assert(strcmp(sfound, "found me") == 0);
+    assert(prof_get(PROF_SCAN)->bytes_read < 1000 && prof_get(PROF_SCAN)->bytes_read < sbig->dib.biSizeImage);
+    prof_enable(0);
+    img_free_message(sctx2, sfound);
+    free_bmp(sbig);
+    remove("test/scan_big.bmp");
+    tp_destroy(spool2);
+    img_ctx_destroy(sctx2);
+    printf("[PASS] Header-only steganography scan\n");
+
+    // 27. Clean up
     free_bmp(img);
 
     printf("=== All tests passed! ===\n");
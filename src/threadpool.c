@@ -0,0 +1,374 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include "../include/threadpool.h"
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+// Condition variables and threads, per platform
+#ifdef _WIN32
+typedef CONDITION_VARIABLE tp_cond;
+typedef HANDLE tp_thread;
+
+static void cond_init(tp_cond *c) { InitializeConditionVariable(c); }
+static void cond_destroy(tp_cond *c) { (void)c; }
+static void cond_wait(tp_cond *c, tp_mutex *m) { SleepConditionVariableSRW(c, m, INFINITE, 0); }
+static void cond_signal(tp_cond *c) { WakeConditionVariable(c); }
+static void cond_broadcast(tp_cond *c) { WakeAllConditionVariable(c); }
+void tp_mutex_init(tp_mutex *m) { InitializeSRWLock(m); }
+void tp_mutex_destroy(tp_mutex *m) { (void)m; }
+void tp_mutex_lock(tp_mutex *m) { AcquireSRWLockExclusive(m); }
+void tp_mutex_unlock(tp_mutex *m) { ReleaseSRWLockExclusive(m); }
+
+static int cpu_count(void)
+{
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+}
+#else
+typedef pthread_cond_t tp_cond;
+typedef pthread_t tp_thread;
+
+static void cond_init(tp_cond *c) { pthread_cond_init(c, NULL); }
+static void cond_destroy(tp_cond *c) { pthread_cond_destroy(c); }
+static void cond_wait(tp_cond *c, tp_mutex *m) { pthread_cond_wait(c, m); }
+static void cond_signal(tp_cond *c) { pthread_cond_signal(c); }
+static void cond_broadcast(tp_cond *c) { pthread_cond_broadcast(c); }
+void tp_mutex_init(tp_mutex *m) { pthread_mutex_init(m, NULL); }
+void tp_mutex_destroy(tp_mutex *m) { pthread_mutex_destroy(m); }
+void tp_mutex_lock(tp_mutex *m) { pthread_mutex_lock(m); }
+void tp_mutex_unlock(tp_mutex *m) { pthread_mutex_unlock(m); }
+
+static int cpu_count(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return (n > 0) ? (int)n : 1;
+}
+#endif
+
+// Queued unit of work
+typedef struct Task
+{
+    void (*fn)(void *arg);
+    void *arg;
+    struct Task *next;
+} Task;
+
+struct ThreadPool
+{
+    tp_mutex lock;
+    tp_cond wake;     // signalled when a task is queued or on shutdown
+    Task *head;
+    Task *tail;
+    int shutdown;
+    int nthreads;
+    tp_thread *threads;
+};
+
+// Pops the next task; blocks until one is available or the pool stops
+static Task *next_task(ThreadPool *pool)
+{
+    tp_mutex_lock(&pool->lock);
+    while (!pool->head && !pool->shutdown)
+        cond_wait(&pool->wake, &pool->lock);
+
+    Task *t = pool->head;
+    if (t)
+    {
+        pool->head = t->next;
+        if (!pool->head)
+            pool->tail = NULL;
+    }
+    tp_mutex_unlock(&pool->lock);
+    return t;
+}
+
+// Worker loop: run tasks until shutdown and the queue is empty
+#ifdef _WIN32
+static DWORD WINAPI worker_main(LPVOID p)
+#else
+static void *worker_main(void *p)
+#endif
+{
+    ThreadPool *pool = (ThreadPool *)p;
+    Task *t;
+    while ((t = next_task(pool)) != NULL)
+    {
+        t->fn(t->arg);
+        free(t);
+    }
+#ifdef _WIN32
+    return 0;
+#else
+    return NULL;
+#endif
+}
+
+ThreadPool *tp_create(int nthreads)
+{
+    if (nthreads <= 0)
+        nthreads = cpu_count();
+
+    ThreadPool *pool = (ThreadPool *)calloc(1, sizeof(ThreadPool));
+    if (!pool)
+        return NULL;
+    pool->threads = (tp_thread *)calloc((size_t)nthreads, sizeof(tp_thread));
+    if (!pool->threads)
+    {
+        free(pool);
+        return NULL;
+    }
+
+    tp_mutex_init(&pool->lock);
+    cond_init(&pool->wake);
+
+    // Start as many workers as we can; a partially started pool still works
+    for (int i = 0; i < nthreads; i++)
+    {
+#ifdef _WIN32
+        pool->threads[i] = CreateThread(NULL, 0, worker_main, pool, 0, NULL);
+        if (!pool->threads[i])
+            break;
+#else
+        if (pthread_create(&pool->threads[i], NULL, worker_main, pool) != 0)
+            break;
+#endif
+        pool->nthreads++;
+    }
+
+    if (pool->nthreads == 0)
+    {
+        cond_destroy(&pool->wake);
+        tp_mutex_destroy(&pool->lock);
+        free(pool->threads);
+        free(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+void tp_destroy(ThreadPool *pool)
+{
+    if (!pool)
+        return;
+
+    tp_mutex_lock(&pool->lock);
+    pool->shutdown = 1;
+    cond_broadcast(&pool->wake);
+    tp_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->nthreads; i++)
+    {
+#ifdef _WIN32
+        WaitForSingleObject(pool->threads[i], INFINITE);
+        CloseHandle(pool->threads[i]);
+#else
+        pthread_join(pool->threads[i], NULL);
+#endif
+    }
+
+    cond_destroy(&pool->wake);
+    tp_mutex_destroy(&pool->lock);
+    free(pool->threads);
+    free(pool);
+}
+
+int tp_size(const ThreadPool *pool)
+{
+    return pool ? pool->nthreads : 0;
+}
+
+int tp_submit(ThreadPool *pool, void (*fn)(void *arg), void *arg)
+{
+    if (!pool || !fn)
+        return -1;
+
+    Task *t = (Task *)malloc(sizeof(Task));
+    if (!t)
+        return -1;
+    t->fn = fn;
+    t->arg = arg;
+    t->next = NULL;
+
+    tp_mutex_lock(&pool->lock);
+    if (pool->shutdown)
+    {
+        tp_mutex_unlock(&pool->lock);
+        free(t);
+        return -1;
+    }
+    if (pool->tail)
+        pool->tail->next = t;
+    else
+        pool->head = t;
+    pool->tail = t;
+    cond_signal(&pool->wake);
+    tp_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+// Completion flag of one tp_call; lives on the caller's stack
+typedef struct
+{
+    void (*fn)(void *arg);
+    void *arg;
+    int done;
+    tp_mutex lock;
+    tp_cond finished;
+} CallJob;
+
+static void call_task(void *arg)
+{
+    CallJob *job = (CallJob *)arg;
+    job->fn(job->arg);
+    tp_mutex_lock(&job->lock);
+    job->done = 1;
+    cond_signal(&job->finished);
+    tp_mutex_unlock(&job->lock);
+}
+
+void tp_call(ThreadPool *pool, void (*fn)(void *arg), void *arg)
+{
+    CallJob job;
+    job.fn = fn;
+    job.arg = arg;
+    job.done = 0;
+    tp_mutex_init(&job.lock);
+    cond_init(&job.finished);
+
+    if (tp_submit(pool, call_task, &job) != 0)
+        call_task(&job);
+
+    tp_mutex_lock(&job.lock);
+    while (!job.done)
+        cond_wait(&job.finished, &job.lock);
+    tp_mutex_unlock(&job.lock);
+
+    cond_destroy(&job.finished);
+    tp_mutex_destroy(&job.lock);
+}
+
+// Shared state of one tp_parallel_for call. It is reference counted because
+// helper tasks may only be dequeued after the caller has already returned.
+typedef struct
+{
+    void (*fn)(void *arg, int begin, int end);
+    void *arg;
+    int count;
+    int chunk;
+    int next;        // first unclaimed index
+    int done;        // finished chunks
+    int total;       // number of chunks
+    int refs;        // caller + queued helpers
+    tp_mutex lock;
+    tp_cond finished;
+} ForJob;
+
+// Claims and runs chunks until none are left
+static void run_chunks(ForJob *job)
+{
+    for (;;)
+    {
+        tp_mutex_lock(&job->lock);
+        int begin = job->next;
+        if (begin >= job->count)
+        {
+            tp_mutex_unlock(&job->lock);
+            return;
+        }
+        int end = (job->count - begin > job->chunk) ? begin + job->chunk : job->count;
+        job->next = end;
+        tp_mutex_unlock(&job->lock);
+
+        job->fn(job->arg, begin, end);
+
+        tp_mutex_lock(&job->lock);
+        if (++job->done == job->total)
+            cond_broadcast(&job->finished);
+        tp_mutex_unlock(&job->lock);
+    }
+}
+
+// Drops one reference and frees the job with the last one
+static void release_job(ForJob *job)
+{
+    tp_mutex_lock(&job->lock);
+    int last = (--job->refs == 0);
+    tp_mutex_unlock(&job->lock);
+    if (last)
+    {
+        cond_destroy(&job->finished);
+        tp_mutex_destroy(&job->lock);
+        free(job);
+    }
+}
+
+static void helper_task(void *arg)
+{
+    ForJob *job = (ForJob *)arg;
+    run_chunks(job);
+    release_job(job);
+}
+
+void tp_parallel_for(ThreadPool *pool, int count, int grain,
+                     void (*fn)(void *arg, int begin, int end), void *arg)
+{
+    if (count <= 0)
+        return;
+    if (grain < 1)
+        grain = 1;
+
+    int nthreads = tp_size(pool);
+
+    // A few chunks per thread keeps the load balanced
+    int chunk = (count + nthreads * 4 - 1) / (nthreads * 4 > 0 ? nthreads * 4 : 1);
+    if (chunk < grain)
+        chunk = grain;
+    int total = (count + chunk - 1) / chunk;
+
+    ForJob *job = NULL;
+    if (nthreads > 0 && total > 1)
+        job = (ForJob *)calloc(1, sizeof(ForJob));
+
+    // Serial fallback
+    if (!job)
+    {
+        fn(arg, 0, count);
+        return;
+    }
+
+    job->fn = fn;
+    job->arg = arg;
+    job->count = count;
+    job->chunk = chunk;
+    job->total = total;
+    job->refs = 1;
+    tp_mutex_init(&job->lock);
+    cond_init(&job->finished);
+
+    int helpers = (total - 1 < nthreads) ? total - 1 : nthreads;
+    for (int i = 0; i < helpers; i++)
+    {
+        tp_mutex_lock(&job->lock);
+        job->refs++;
+        tp_mutex_unlock(&job->lock);
+        if (tp_submit(pool, helper_task, job) != 0)
+        {
+            tp_mutex_lock(&job->lock);
+            job->refs--;
+            tp_mutex_unlock(&job->lock);
+            break;
+        }
+    }
+
+    // The caller works too, then waits for chunks claimed by helpers
+    run_chunks(job);
+    tp_mutex_lock(&job->lock);
+    while (job->done < job->total)
+        cond_wait(&job->finished, &job->lock);
+    tp_mutex_unlock(&job->lock);
+    release_job(job);
+}
@@ -0,0 +1,671 @@
+#define _POSIX_C_SOURCE 200809L // mkdir
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <direct.h>
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+#include "image_internal.h"
+#include "../include/imgcache.h"
+#include "../include/thumbcache.h"
+#include "../include/threadpool.h"
+
+#ifndef S_ISDIR
+#define S_ISDIR(m) (((m) & S_IFMT) == S_IFDIR)
+#endif
+
+#define INDEX_MAGIC "ITC2"
+#define TRAILER_MAGIC "ITT1"
+#define PATH_MAX_LEN 4096
+
+// Attempts at finding an unused random thumbnail name
+#define NAME_ATTEMPTS 16
+
+// A changed index is written at most this often, and on close
+#define FLUSH_INTERVAL_NS 5000000000ULL
+
+// Hash buckets on open; doubled whenever the entries outnumber them
+#define MIN_BUCKETS 64
+
+// Thumbnails are written by img_save, so pixels follow the two headers
+#define THUMB_PIXEL_OFFSET (sizeof(BMPHeader) + sizeof(DIBHeader))
+
+// Index file layout: IndexHeader, then count records (most recently used
+// first), each followed by path_len bytes of source path
+typedef struct {
+    char magic[4];
+    uint32_t count;
+    uint64_t reserved; // was the next thumbnail id; ids are random now
+} IndexHeader;
+
+typedef struct {
+    FileIdentity source;
+    uint64_t id;        // names the thumbnail file
+    int32_t width;      // thumbnail dimensions, to allocate before reading
+    int32_t height;
+    uint32_t max_side;
+    uint32_t bytes;     // size of the thumbnail file, trailer included
+    uint16_t bpp;
+    uint16_t reserved;
+    uint32_t path_len;
+} IndexRecord;
+
+// Appended to every thumbnail file after the pixels. Other processes may
+// share the directory, so a hit checks the file still belongs to the entry.
+typedef struct {
+    char magic[4];
+    uint32_t max_side;
+    uint64_t key;        // entry_key of the source path
+    FileIdentity source;
+} ThumbTrailer;
+
+typedef struct ThumbEntry
+{
+    char *path;              // canonical source path (see imgcache_canonical_path)
+    IndexRecord rec;
+    uint64_t key;            // hash of path and max_side
+    struct ThumbEntry *prev; // towards most recently used
+    struct ThumbEntry *next; // towards least recently used
+    struct ThumbEntry *chain; // next in the same bucket
+} ThumbEntry;
+
+struct ThumbCache
+{
+    tp_mutex lock;
+    tp_mutex flush_lock; // orders index writes; taken before lock
+    char *dir;
+    ThumbEntry *head; // most recently used
+    ThumbEntry *tail; // least recently used
+    ThumbEntry **buckets;
+    size_t bucket_count; // a power of two
+    size_t entries;
+    size_t bytes;
+    size_t budget;
+    uint64_t serial; // mixed into random thumbnail ids
+    uint64_t hits;
+    uint64_t misses;
+    int dirty;           // index on disk is out of date
+    uint64_t flushed_ns; // last index write (prof_now_ns)
+};
+
+static void thumb_file(const ThumbCache *cache, uint64_t id, char *buf, size_t len)
+{
+    snprintf(buf, len, "%s/%016llx.bmp", cache->dir, (unsigned long long)id);
+}
+
+static uint64_t entry_key(const char *path, int max_side)
+{
+    return img_hash_bytes(path, strlen(path), (uint64_t)(uint32_t)max_side);
+}
+
+static int make_dir(const char *dir)
+{
+#ifdef _WIN32
+    if (_mkdir(dir) == 0)
+        return 0;
+#else
+    if (mkdir(dir, 0755) == 0)
+        return 0;
+#endif
+    struct stat st;
+    return (stat(dir, &st) == 0 && S_ISDIR(st.st_mode)) ? 0 : -1;
+}
+
+// Takes an entry out of the LRU list (lock held)
+static void unlink_entry(ThumbCache *cache, ThumbEntry *e)
+{
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        cache->head = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        cache->tail = e->prev;
+    e->prev = e->next = NULL;
+    cache->bytes -= e->rec.bytes;
+    cache->entries--;
+}
+
+// Puts an entry at the most recently used end (lock held)
+static void push_front(ThumbCache *cache, ThumbEntry *e)
+{
+    e->prev = NULL;
+    e->next = cache->head;
+    if (cache->head)
+        cache->head->prev = e;
+    cache->head = e;
+    if (!cache->tail)
+        cache->tail = e;
+    cache->bytes += e->rec.bytes;
+    cache->entries++;
+}
+
+// Appends an entry at the least recently used end (lock held)
+static void push_back(ThumbCache *cache, ThumbEntry *e)
+{
+    e->next = NULL;
+    e->prev = cache->tail;
+    if (cache->tail)
+        cache->tail->next = e;
+    cache->tail = e;
+    if (!cache->head)
+        cache->head = e;
+    cache->bytes += e->rec.bytes;
+    cache->entries++;
+}
+
+// Adds an entry to its bucket, growing the table when it is full (lock held)
+static void table_insert(ThumbCache *cache, ThumbEntry *e)
+{
+    if (cache->entries > cache->bucket_count)
+    {
+        // On allocation failure the chains just get longer
+        size_t count = cache->bucket_count * 2;
+        ThumbEntry **buckets = (ThumbEntry **)calloc(count, sizeof(ThumbEntry *));
+        if (buckets)
+        {
+            for (size_t i = 0; i < cache->bucket_count; i++)
+            {
+                while (cache->buckets[i])
+                {
+                    ThumbEntry *moved = cache->buckets[i];
+                    cache->buckets[i] = moved->chain;
+                    moved->chain = buckets[moved->key & (count - 1)];
+                    buckets[moved->key & (count - 1)] = moved;
+                }
+            }
+            free(cache->buckets);
+            cache->buckets = buckets;
+            cache->bucket_count = count;
+        }
+    }
+    ThumbEntry **slot = &cache->buckets[e->key & (cache->bucket_count - 1)];
+    e->chain = *slot;
+    *slot = e;
+}
+
+static void table_remove(ThumbCache *cache, ThumbEntry *e)
+{
+    ThumbEntry **link = &cache->buckets[e->key & (cache->bucket_count - 1)];
+    while (*link != e)
+        link = &(*link)->chain;
+    *link = e->chain;
+}
+
+// Drops an entry onto the *dead list, whose files drop_files deletes
+// once the lock is released (lock held)
+static void evict(ThumbCache *cache, ThumbEntry *e, ThumbEntry **dead)
+{
+    table_remove(cache, e);
+    unlink_entry(cache, e);
+    e->next = *dead;
+    *dead = e;
+    cache->dirty = 1;
+}
+
+// Deletes the files of evicted entries and frees them (lock not held).
+// Ids are never reused, so no new entry can own one of these files.
+static void drop_files(ThumbCache *cache, ThumbEntry *dead)
+{
+    while (dead)
+    {
+        ThumbEntry *e = dead;
+        dead = e->next;
+        char file[PATH_MAX_LEN + 32];
+        thumb_file(cache, e->rec.id, file, sizeof(file));
+        remove(file);
+        free(e->path);
+        free(e);
+    }
+}
+
+// Evicts from the cold end until the budget holds, sparing keep (lock held)
+static void trim(ThumbCache *cache, const ThumbEntry *keep, ThumbEntry **dead)
+{
+    while (cache->bytes > cache->budget && cache->tail && cache->tail != keep)
+        evict(cache, cache->tail, dead);
+}
+
+// Entry for a canonical path (lock held)
+static ThumbEntry *find_entry(ThumbCache *cache, const char *path, int max_side)
+{
+    uint64_t key = entry_key(path, max_side);
+    for (ThumbEntry *e = cache->buckets[key & (cache->bucket_count - 1)]; e; e = e->chain)
+    {
+        if (e->key == key && e->rec.max_side == (uint32_t)max_side && strcmp(e->path, path) == 0)
+            return e;
+    }
+    return NULL;
+}
+
+// Reads the index of an earlier run; anything unreadable is ignored
+static void load_index(ThumbCache *cache)
+{
+    char file[PATH_MAX_LEN + 32];
+    snprintf(file, sizeof(file), "%s/index", cache->dir);
+    FILE *f = fopen(file, "rb");
+    if (!f)
+        return;
+
+    IndexHeader hdr;
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 || memcmp(hdr.magic, INDEX_MAGIC, 4) != 0)
+    {
+        fclose(f);
+        return;
+    }
+
+    for (uint32_t i = 0; i < hdr.count; i++)
+    {
+        IndexRecord rec;
+        if (fread(&rec, sizeof(rec), 1, f) != 1 || rec.path_len == 0 || rec.path_len >= PATH_MAX_LEN)
+            break;
+        ThumbEntry *e = (ThumbEntry *)calloc(1, sizeof(ThumbEntry));
+        char *path = (char *)malloc(rec.path_len + 1);
+        if (!e || !path || fread(path, 1, rec.path_len, f) != rec.path_len)
+        {
+            free(e);
+            free(path);
+            break;
+        }
+        path[rec.path_len] = '\0';
+        e->path = path;
+        e->rec = rec;
+        e->key = entry_key(path, (int)rec.max_side);
+        push_back(cache, e);
+        table_insert(cache, e);
+    }
+    fclose(f);
+}
+
+// Copies the index as it goes to disk (lock held); NULL when out of memory
+static unsigned char *snapshot_index(ThumbCache *cache, size_t *size)
+{
+    size_t total = sizeof(IndexHeader);
+    for (ThumbEntry *e = cache->head; e; e = e->next)
+        total += sizeof(IndexRecord) + e->rec.path_len;
+    unsigned char *buf = (unsigned char *)malloc(total);
+    if (!buf)
+        return NULL;
+
+    IndexHeader hdr;
+    memcpy(hdr.magic, INDEX_MAGIC, 4);
+    hdr.count = (uint32_t)cache->entries;
+    hdr.reserved = 0;
+    memcpy(buf, &hdr, sizeof(hdr));
+    size_t at = sizeof(hdr);
+    for (ThumbEntry *e = cache->head; e; e = e->next)
+    {
+        memcpy(buf + at, &e->rec, sizeof(e->rec));
+        memcpy(buf + at + sizeof(e->rec), e->path, e->rec.path_len);
+        at += sizeof(e->rec) + e->rec.path_len;
+    }
+    *size = total;
+    return buf;
+}
+
+// Replaces the index through a temporary file. Returns 1 on success.
+static int write_index(ThumbCache *cache, const unsigned char *buf, size_t size)
+{
+    char tmp[PATH_MAX_LEN + 32];
+    char file[PATH_MAX_LEN + 32];
+    snprintf(tmp, sizeof(tmp), "%s/index.tmp", cache->dir);
+    snprintf(file, sizeof(file), "%s/index", cache->dir);
+
+    FILE *f = fopen(tmp, "wb");
+    if (!f)
+        return 0;
+    int ok = fwrite(buf, 1, size, f) == size;
+    if (fclose(f) != 0 || !ok)
+    {
+        remove(tmp);
+        return 0;
+    }
+#ifdef _WIN32
+    remove(file); // rename does not replace on Windows
+#endif
+    return rename(tmp, file) == 0;
+}
+
+// Writes the index if it changed. The records are copied under the lock
+// and written without it; flush_lock makes the newest copy land last.
+static void flush_index(ThumbCache *cache)
+{
+    tp_mutex_lock(&cache->flush_lock);
+    tp_mutex_lock(&cache->lock);
+    unsigned char *buf = NULL;
+    size_t size = 0;
+    if (cache->dirty)
+        buf = snapshot_index(cache, &size);
+    if (buf)
+        cache->dirty = 0;
+    cache->flushed_ns = prof_now_ns();
+    tp_mutex_unlock(&cache->lock);
+
+    if (buf && !write_index(cache, buf, size))
+    {
+        tp_mutex_lock(&cache->lock);
+        cache->dirty = 1;
+        tp_mutex_unlock(&cache->lock);
+    }
+    free(buf);
+    tp_mutex_unlock(&cache->flush_lock);
+}
+
+// Flushes a changed index once FLUSH_INTERVAL_NS has passed since the last write
+static void flush_if_due(ThumbCache *cache)
+{
+    uint64_t now = prof_now_ns();
+    tp_mutex_lock(&cache->lock);
+    int due = cache->dirty && now - cache->flushed_ns >= FLUSH_INTERVAL_NS;
+    if (due)
+        cache->flushed_ns = now; // one thread flushes, the others go on
+    tp_mutex_unlock(&cache->lock);
+    if (due)
+        flush_index(cache);
+}
+
+ThumbCache *thumbcache_open(const char *dir, size_t budget_bytes)
+{
+    if (!dir || strlen(dir) >= PATH_MAX_LEN)
+        return NULL;
+    ThumbCache *cache = (ThumbCache *)calloc(1, sizeof(ThumbCache));
+    size_t len = strlen(dir);
+    char *copy = (char *)malloc(len + 1);
+    ThumbEntry **buckets = (ThumbEntry **)calloc(MIN_BUCKETS, sizeof(ThumbEntry *));
+    if (!cache || !copy || !buckets)
+    {
+        free(cache);
+        free(copy);
+        free(buckets);
+        return NULL;
+    }
+    memcpy(copy, dir, len + 1);
+    tp_mutex_init(&cache->lock);
+    tp_mutex_init(&cache->flush_lock);
+    cache->dir = copy;
+    cache->buckets = buckets;
+    cache->bucket_count = MIN_BUCKETS;
+    cache->budget = budget_bytes;
+    cache->flushed_ns = prof_now_ns();
+    load_index(cache);
+    ThumbEntry *dead = NULL;
+    trim(cache, NULL, &dead);
+    drop_files(cache, dead);
+    return cache;
+}
+
+void thumbcache_close(ThumbCache *cache)
+{
+    if (!cache)
+        return;
+    flush_index(cache);
+    while (cache->head)
+    {
+        ThumbEntry *e = cache->head;
+        cache->head = e->next;
+        free(e->path);
+        free(e);
+    }
+    tp_mutex_destroy(&cache->lock);
+    tp_mutex_destroy(&cache->flush_lock);
+    free(cache->buckets);
+    free(cache->dir);
+    free(cache);
+}
+
+// Hit path: allocates from the indexed dimensions and fills the pixels
+// with one read straight from the thumbnail file
+static img_status read_thumb(ThumbCache *cache, imgctx *ctx, const IndexRecord *rec, uint64_t key, BMPImage **out)
+{
+    char file[PATH_MAX_LEN + 32];
+    thumb_file(cache, rec->id, file, sizeof(file));
+    FILE *f = fopen(file, "rb");
+    if (!f)
+        return img_fail(ctx, IMG_ERR_IO, "cannot open %s", file);
+
+    BMPImage *img = NULL;
+    img_status st = img_new_image(ctx, PROF_THUMB, NULL, rec->width, rec->height < 0 ? -rec->height : rec->height,
+                                  rec->bpp, &img);
+    if (st != IMG_OK)
+    {
+        fclose(f);
+        return st;
+    }
+    if (rec->height < 0)
+        img->dib.biHeight = rec->height;
+
+    size_t size = img->dib.biSizeImage;
+    ThumbTrailer trailer;
+    if (THUMB_PIXEL_OFFSET + size + sizeof(trailer) != rec->bytes ||
+        fseek(f, (long)THUMB_PIXEL_OFFSET, SEEK_SET) != 0 || fread(img->data, 1, size, f) != size ||
+        fread(&trailer, sizeof(trailer), 1, f) != 1 || memcmp(trailer.magic, TRAILER_MAGIC, 4) != 0 ||
+        trailer.key != key || trailer.max_side != rec->max_side || !imgcache_same_file(&trailer.source, &rec->source))
+    {
+        fclose(f);
+        img_free(ctx, img);
+        return img_fail(ctx, IMG_ERR_FORMAT, "thumbnail %s is damaged", file);
+    }
+    fclose(f);
+    prof_io(PROF_THUMB, size, 0);
+    *out = img;
+    return IMG_OK;
+}
+
+// Miss path: decodes the source and shrinks it to fit max_side
+static img_status make_thumb(imgctx *ctx, const char *filename, int max_side, BMPImage **out)
+{
+    BMPImage *full = NULL;
+    img_status st = img_load(ctx, filename, &full);
+    if (st != IMG_OK)
+        return st;
+
+    int w = full->dib.biWidth;
+    int h = img_height(full);
+    int longest = (w > h) ? w : h;
+    if (longest <= max_side)
+    {
+        *out = full;
+        return IMG_OK;
+    }
+
+    double f = (double)max_side / (double)longest;
+    int tw = (int)(w * f + 0.5);
+    int th = (int)(h * f + 0.5);
+    st = img_resize(ctx, full, tw > 0 ? tw : 1, th > 0 ? th : 1, out);
+    img_free(ctx, full);
+    return st;
+}
+
+// Claims an unused thumbnail file under a random id, so processes sharing
+// the directory never write to each other's files. Returns 0 on success.
+static int claim_thumb_file(ThumbCache *cache, uint64_t serial, uint64_t *id, char *file, size_t len)
+{
+    struct {
+        uint64_t now_ns;
+        uint64_t serial;
+        int64_t pid;
+        int attempt;
+    } seed;
+    memset(&seed, 0, sizeof(seed));
+    seed.now_ns = prof_now_ns();
+    seed.serial = serial;
+    seed.pid = (int64_t)getpid();
+    for (seed.attempt = 0; seed.attempt < NAME_ATTEMPTS; seed.attempt++)
+    {
+        *id = img_hash_bytes(&seed, sizeof(seed), (uint64_t)(uintptr_t)cache);
+        thumb_file(cache, *id, file, len);
+        FILE *f = fopen(file, "wbx"); // fails if the name is taken
+        if (f)
+        {
+            fclose(f);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Writes a new thumbnail file without the lock, then lists it. A failed
+// write only costs the caching, not the thumbnail.
+static void store_thumb(ThumbCache *cache, const char *path, int max_side, const FileIdentity *source,
+                        uint64_t serial, const BMPImage *thumb, uint64_t bytes)
+{
+    ThumbEntry *fresh = (ThumbEntry *)calloc(1, sizeof(ThumbEntry));
+    size_t len = strlen(path);
+    char *copy = (char *)malloc(len + 1);
+    char file[PATH_MAX_LEN + 32];
+    uint64_t id;
+    if (!fresh || !copy || claim_thumb_file(cache, serial, &id, file, sizeof(file)) != 0)
+    {
+        free(fresh);
+        free(copy);
+        return;
+    }
+
+    ThumbTrailer trailer;
+    memcpy(trailer.magic, TRAILER_MAGIC, 4);
+    trailer.max_side = (uint32_t)max_side;
+    trailer.key = entry_key(path, max_side);
+    trailer.source = *source;
+
+    imgctx quiet;
+    img_ctx_init(&quiet, NULL, NULL);
+    FILE *f = NULL;
+    int ok = img_save(&quiet, file, thumb) == IMG_OK && (f = fopen(file, "ab")) != NULL &&
+             fwrite(&trailer, sizeof(trailer), 1, f) == 1;
+    if (f && fclose(f) != 0)
+        ok = 0;
+    if (!ok)
+    {
+        remove(file);
+        free(fresh);
+        free(copy);
+        return;
+    }
+    memcpy(copy, path, len + 1);
+    fresh->path = copy;
+    fresh->key = trailer.key;
+    fresh->rec.source = *source;
+    fresh->rec.id = id;
+    fresh->rec.width = thumb->dib.biWidth;
+    fresh->rec.height = thumb->dib.biHeight;
+    fresh->rec.max_side = (uint32_t)max_side;
+    fresh->rec.bytes = (uint32_t)bytes;
+    fresh->rec.bpp = thumb->dib.biBitCount;
+    fresh->rec.path_len = (uint32_t)len;
+
+    ThumbEntry *dead = NULL;
+    tp_mutex_lock(&cache->lock);
+    // Another client may have made the same thumbnail meanwhile
+    ThumbEntry *old = find_entry(cache, path, max_side);
+    if (old)
+        evict(cache, old, &dead);
+    push_front(cache, fresh);
+    table_insert(cache, fresh);
+    trim(cache, fresh, &dead);
+    cache->dirty = 1;
+    tp_mutex_unlock(&cache->lock);
+    drop_files(cache, dead);
+}
+
+img_status thumbcache_get(ThumbCache *cache, imgctx *ctx, const char *filename, int max_side,
+                          BMPImage **out, int *hit)
+{
+    if (!cache || !ctx || !filename || !out || max_side <= 0)
+        return ctx ? img_fail(ctx, IMG_ERR_ARG, "thumbcache_get: bad argument") : IMG_ERR_ARG;
+    if (hit)
+        *hit = 0;
+
+    char path[PATH_MAX_LEN];
+    FileIdentity source;
+    if (imgcache_canonical_path(filename, path, sizeof(path)) != 0 || imgcache_file_identity(path, &source) != 0)
+        return img_fail(ctx, IMG_ERR_IO, "cannot open %s", filename);
+
+    ProfScope scope;
+    prof_begin(&scope, PROF_THUMB);
+
+    // Look for a fresh entry; a stale one (file changed) is dropped
+    ThumbEntry *dead = NULL;
+    tp_mutex_lock(&cache->lock);
+    IndexRecord rec;
+    uint64_t key = 0;
+    int found = 0;
+    ThumbEntry *e = find_entry(cache, path, max_side);
+    if (e && imgcache_same_file(&e->rec.source, &source))
+    {
+        rec = e->rec;
+        key = e->key;
+        found = 1;
+        unlink_entry(cache, e);
+        push_front(cache, e);
+        cache->dirty = 1;
+    }
+    else if (e)
+    {
+        evict(cache, e, &dead);
+    }
+    tp_mutex_unlock(&cache->lock);
+    drop_files(cache, dead);
+
+    // Hit: one small read; a file lost meanwhile is simply regenerated
+    if (found)
+    {
+        if (read_thumb(cache, ctx, &rec, key, out) == IMG_OK)
+        {
+            tp_mutex_lock(&cache->lock);
+            cache->hits++;
+            tp_mutex_unlock(&cache->lock);
+            if (hit)
+                *hit = 1;
+            flush_if_due(cache);
+            prof_pixels(PROF_THUMB, img_pixel_count(*out));
+            prof_end(&scope);
+            return IMG_OK;
+        }
+        img_ctx_clear_error(ctx);
+    }
+
+    BMPImage *thumb = NULL;
+    img_status st = make_thumb(ctx, path, max_side, &thumb);
+    if (st != IMG_OK)
+    {
+        prof_end(&scope);
+        return st;
+    }
+    prof_pixels(PROF_THUMB, img_pixel_count(thumb));
+
+    // Store it unless it alone would overflow the budget
+    uint64_t bytes = THUMB_PIXEL_OFFSET + (uint64_t)thumb->dib.biSizeImage + sizeof(ThumbTrailer);
+    tp_mutex_lock(&cache->lock);
+    cache->misses++;
+    uint64_t serial = cache->serial++;
+    tp_mutex_unlock(&cache->lock);
+    if (bytes <= cache->budget && make_dir(cache->dir) == 0)
+        store_thumb(cache, path, max_side, &source, serial, thumb, bytes);
+    flush_if_due(cache);
+
+    prof_end(&scope);
+    *out = thumb;
+    return IMG_OK;
+}
+
+void thumbcache_stats(ThumbCache *cache, uint64_t *hits, uint64_t *misses, size_t *bytes, size_t *entries)
+{
+    tp_mutex_lock(&cache->lock);
+    if (hits)
+        *hits = cache->hits;
+    if (misses)
+        *misses = cache->misses;
+    if (bytes)
+        *bytes = cache->bytes;
+    if (entries)
+        *entries = cache->entries;
+    tp_mutex_unlock(&cache->lock);
+}
@@ -0,0 +1,341 @@
+#include <stdlib.h>
+#include <string.h>
+#include "image_internal.h"
+#include "../include/threadpool.h"
+
+// Tiled storage (see img_tiled in image.h). Pixel (x, y) lives in tile
+// (x / IMG_TILE, y / IMG_TILE) at row y % IMG_TILE, column x % IMG_TILE.
+
+#define TILE_PIXELS (IMG_TILE * IMG_TILE)
+
+static size_t tile_bytes(const img_tiled *t)
+{
+    return (size_t)TILE_PIXELS * (t->dib.biBitCount / 8);
+}
+
+static int tiled_height(const DIBHeader *dib)
+{
+    return (dib->biHeight > 0) ? dib->biHeight : -dib->biHeight;
+}
+
+static unsigned char *tile_at(const img_tiled *t, int tx, int ty)
+{
+    return t->data + ((size_t)ty * t->tiles_x + tx) * tile_bytes(t);
+}
+
+// Allocates a tiled image with the given headers, pixels uninitialised
+static img_status new_tiled(imgctx *ctx, ProfOp op, const BMPHeader *header, const DIBHeader *dib, img_tiled **out)
+{
+    img_tiled *t = (img_tiled *)img_alloc(ctx, sizeof(img_tiled));
+    if (!t)
+        return img_fail(ctx, IMG_ERR_NOMEM, "out of memory allocating tiled image");
+    t->header = *header;
+    t->dib = *dib;
+    t->tiles_x = (dib->biWidth + IMG_TILE - 1) / IMG_TILE;
+    t->tiles_y = (tiled_height(dib) + IMG_TILE - 1) / IMG_TILE;
+
+    uint64_t size = (uint64_t)t->tiles_x * (uint64_t)t->tiles_y * tile_bytes(t);
+    t->data = (size == (size_t)size) ? (unsigned char *)img_alloc(ctx, (size_t)size) : NULL;
+    if (!t->data)
+    {
+        img_release(ctx, t);
+        return img_fail(ctx, IMG_ERR_NOMEM, "out of memory allocating %llu bytes of tiles",
+                        (unsigned long long)size);
+    }
+    prof_alloc(op, size);
+    *out = t;
+    return IMG_OK;
+}
+
+void img_free_tiled(imgctx *ctx, img_tiled *tiled)
+{
+    if (!ctx || !tiled)
+        return;
+    prof_free((uint64_t)tiled->tiles_x * (uint64_t)tiled->tiles_y * tile_bytes(tiled));
+    img_release(ctx, tiled->data);
+    img_release(ctx, tiled);
+}
+
+static int is_tileable(const DIBHeader *dib)
+{
+    return (dib->biBitCount == 24 || dib->biBitCount == 32) && dib->biCompression == 0;
+}
+
+// ---------------------------------------------------------------------------
+// Conversion
+// ---------------------------------------------------------------------------
+
+typedef struct {
+    const BMPImage *img;
+    const img_tiled *tiled;
+    size_t stride;
+    int to_tiles; // row-major to tiles, else back
+} ConvertJob;
+
+// Copies the pixels of whole tile rows between the layouts, one image row
+// segment of IMG_TILE pixels at a time
+static void convert_rows(void *arg, int begin, int end)
+{
+    ConvertJob *job = (ConvertJob *)arg;
+    const img_tiled *t = job->tiled;
+    int width = t->dib.biWidth;
+    int height = img_height(job->img);
+    int bpp = t->dib.biBitCount / 8;
+    size_t seg = (size_t)IMG_TILE * bpp;
+
+    for (int ty = begin; ty < end; ty++)
+    {
+        for (int j = 0; j < IMG_TILE; j++)
+        {
+            int y = ty * IMG_TILE + j;
+            if (y >= height)
+            {
+                // Rows below the image in the last tile row
+                for (int tx = 0; job->to_tiles && tx < t->tiles_x; tx++)
+                    memset(tile_at(t, tx, ty) + (size_t)j * seg, 0, seg);
+                continue;
+            }
+            unsigned char *row = job->img->data + (size_t)y * job->stride;
+            for (int tx = 0; tx < t->tiles_x; tx++)
+            {
+                unsigned char *trow = tile_at(t, tx, ty) + (size_t)j * seg;
+                int x = tx * IMG_TILE;
+                size_t used = (size_t)((width - x < IMG_TILE) ? width - x : IMG_TILE) * bpp;
+                if (job->to_tiles)
+                {
+                    memcpy(trow, row + (size_t)x * bpp, used);
+                    memset(trow + used, 0, seg - used);
+                }
+                else
+                {
+                    memcpy(row + (size_t)x * bpp, trow, used);
+                }
+            }
+            if (!job->to_tiles)
+            {
+                size_t used = (size_t)width * bpp;
+                memset(row + used, 0, job->stride - used);
+            }
+        }
+    }
+}
+
+img_status img_to_tiled(imgctx *ctx, const BMPImage *src, img_tiled **out)
+{
+    if (!ctx || !src || !src->data || !out)
+        return ctx ? img_fail(ctx, IMG_ERR_ARG, "img_to_tiled: missing argument") : IMG_ERR_ARG;
+    if (!is_tileable(&src->dib))
+        return img_fail(ctx, IMG_ERR_UNSUPPORTED, "tile: only uncompressed 24-bit or 32-bit BMP supported");
+
+    ProfScope scope;
+    prof_begin(&scope, PROF_TILE);
+
+    img_tiled *t;
+    img_status status = new_tiled(ctx, PROF_TILE, &src->header, &src->dib, &t);
+    if (status == IMG_OK)
+    {
+        ConvertJob job = {src, t, img_row_size(src->dib.biWidth, src->dib.biBitCount), 1};
+        tp_parallel_for(ctx->pool, t->tiles_y, 1, convert_rows, &job);
+        prof_pixels(PROF_TILE, img_pixel_count(src));
+        *out = t;
+    }
+
+    prof_end(&scope);
+    return status;
+}
+
+img_status img_from_tiled(imgctx *ctx, const img_tiled *src, BMPImage **out)
+{
+    if (!ctx || !src || !src->data || !out)
+        return ctx ? img_fail(ctx, IMG_ERR_ARG, "img_from_tiled: missing argument") : IMG_ERR_ARG;
+    if (!is_tileable(&src->dib))
+        return img_fail(ctx, IMG_ERR_UNSUPPORTED, "tile: only uncompressed 24-bit or 32-bit BMP supported");
+
+    ProfScope scope;
+    prof_begin(&scope, PROF_TILE);
+
+    // img_new_image takes its headers from an image
+    BMPImage tmpl;
+    memset(&tmpl, 0, sizeof(tmpl));
+    tmpl.header = src->header;
+    tmpl.dib = src->dib;
+
+    BMPImage *img;
+    img_status status = img_new_image(ctx, PROF_TILE, &tmpl, tmpl.dib.biWidth, img_height(&tmpl),
+                                      tmpl.dib.biBitCount, &img);
+    if (status == IMG_OK)
+    {
+        ConvertJob job = {img, src, img_row_size(img->dib.biWidth, img->dib.biBitCount), 0};
+        tp_parallel_for(ctx->pool, src->tiles_y, 1, convert_rows, &job);
+        prof_pixels(PROF_TILE, img_pixel_count(img));
+        *out = img;
+    }
+
+    prof_end(&scope);
+    return status;
+}
+
+// ---------------------------------------------------------------------------
+// Affine resampling
+// ---------------------------------------------------------------------------
+
+typedef struct {
+    const img_tiled *src;
+    img_tiled *dst;
+    const img_map *map;
+    const size_t *row_offset; // byte offset of each source row within the tiles
+    const size_t *col_offset; // and of each column
+} TiledAffineJob;
+
+// Where an output tile's source pixels can fall
+enum { TILE_OUTSIDE, TILE_INSIDE, TILE_PARTIAL };
+
+// The map is affine, so the source coordinates of every pixel of the
+// block lie between those of its corners; a margin of 0.49 covers rounding
+static int classify(const img_map *map, int x0, int y0, int x1, int y1, int width, int height)
+{
+    int xs[4] = {x0, x1 - 1, x0, x1 - 1};
+    int ys[4] = {y0, y0, y1 - 1, y1 - 1};
+    double min_x = 1e300, max_x = -1e300, min_y = 1e300, max_y = -1e300;
+    for (int i = 0; i < 4; i++)
+    {
+        double sx = img_map_x(map, xs[i], ys[i]);
+        double sy = img_map_y(map, xs[i], ys[i]);
+        min_x = (sx < min_x) ? sx : min_x;
+        max_x = (sx > max_x) ? sx : max_x;
+        min_y = (sy < min_y) ? sy : min_y;
+        max_y = (sy > max_y) ? sy : max_y;
+    }
+    if (max_x < -0.51 || max_y < -0.51 || min_x > width - 0.49 || min_y > height - 0.49)
+        return TILE_OUTSIDE;
+    if (min_x > -0.49 && min_y > -0.49 && max_x < width - 0.51 && max_y < height - 0.51)
+        return TILE_INSIDE;
+    return TILE_PARTIAL;
+}
+
+// Copies the source pixels of one span into d. Inlined with a constant
+// bpp, and checked only for tiles whose source is partly outside.
+static inline void gather_span(unsigned char *d, const TiledAffineJob *job, const int *sx, const int *sy, int n,
+                               int bpp, int checked)
+{
+    int width = job->src->dib.biWidth;
+    int height = tiled_height(&job->src->dib);
+    for (int i = 0; i < n; i++, d += bpp)
+    {
+        if (checked && (sx[i] < 0 || sx[i] >= width || sy[i] < 0 || sy[i] >= height))
+            continue;
+        const unsigned char *s = job->src->data + job->row_offset[sy[i]] + job->col_offset[sx[i]];
+        if (bpp == 4)
+        {
+            memcpy(d, s, 4);
+        }
+        else
+        {
+            d[0] = s[0];
+            d[1] = s[1];
+            d[2] = s[2];
+        }
+    }
+}
+
+static void tiled_affine_rows(void *arg, int begin, int end)
+{
+    TiledAffineJob *job = (TiledAffineJob *)arg;
+    const img_tiled *src = job->src;
+    const img_tiled *dst = job->dst;
+    const img_map *map = job->map;
+    int width = src->dib.biWidth;
+    int height = tiled_height(&src->dib);
+    int bpp = src->dib.biBitCount / 8;
+    size_t tbytes = tile_bytes(src);
+
+    for (int ty = begin; ty < end; ty++)
+    {
+        for (int tx = 0; tx < dst->tiles_x; tx++)
+        {
+            unsigned char *tile = tile_at(dst, tx, ty);
+            int x0 = tx * IMG_TILE;
+            int y0 = ty * IMG_TILE;
+            int x1 = (width - x0 < IMG_TILE) ? width : x0 + IMG_TILE;
+            int y1 = (height - y0 < IMG_TILE) ? height : y0 + IMG_TILE;
+            int kind = classify(map, x0, y0, x1, y1, width, height);
+            if (kind != TILE_INSIDE || x1 - x0 < IMG_TILE || y1 - y0 < IMG_TILE)
+                memset(tile, 0, tbytes);
+            if (kind == TILE_OUTSIDE)
+                continue;
+
+            int checked = (kind == TILE_PARTIAL);
+            for (int y = y0; y < y1; y++)
+            {
+                int sx[IMG_TILE], sy[IMG_TILE];
+                img_affine_span(map, x0, y, x1 - x0, sx, sy);
+                unsigned char *d = tile + (size_t)(y - y0) * IMG_TILE * bpp;
+                if (bpp == 4)
+                    gather_span(d, job, sx, sy, x1 - x0, 4, checked);
+                else
+                    gather_span(d, job, sx, sy, x1 - x0, 3, checked);
+            }
+        }
+    }
+}
+
+static img_status tiled_affine_impl(imgctx *ctx, ProfOp op, const img_tiled *src, const img_map *map,
+                                    img_tiled **out)
+{
+    ProfScope scope;
+    prof_begin(&scope, op);
+
+    // The offset of source pixel (x, y) is row_offset[y] + col_offset[x]
+    int width = src->dib.biWidth;
+    int height = tiled_height(&src->dib);
+    size_t bpp = src->dib.biBitCount / 8;
+    size_t *offsets = (size_t *)malloc(((size_t)width + height) * sizeof(size_t));
+    if (!offsets)
+    {
+        prof_end(&scope);
+        return img_fail(ctx, IMG_ERR_NOMEM, "out of memory allocating tile offsets");
+    }
+    size_t *col_offset = offsets;
+    size_t *row_offset = offsets + width;
+    for (int x = 0; x < width; x++)
+        col_offset[x] = ((size_t)(x / IMG_TILE) * TILE_PIXELS + x % IMG_TILE) * bpp;
+    for (int y = 0; y < height; y++)
+        row_offset[y] = ((size_t)(y / IMG_TILE) * src->tiles_x * TILE_PIXELS + (size_t)(y % IMG_TILE) * IMG_TILE) * bpp;
+
+    img_tiled *dst;
+    img_status status = new_tiled(ctx, op, &src->header, &src->dib, &dst);
+    if (status == IMG_OK)
+    {
+        TiledAffineJob job = {src, dst, map, row_offset, col_offset};
+        tp_parallel_for(ctx->pool, dst->tiles_y, 1, tiled_affine_rows, &job);
+        prof_pixels(op, (uint64_t)width * (uint64_t)height);
+        *out = dst;
+    }
+
+    free(offsets);
+    prof_end(&scope);
+    return status;
+}
+
+img_status img_tiled_affine(imgctx *ctx, const img_tiled *src, const double m[6], img_tiled **out)
+{
+    if (!ctx || !src || !src->data || !m || !out)
+        return ctx ? img_fail(ctx, IMG_ERR_ARG, "img_tiled_affine: missing argument") : IMG_ERR_ARG;
+    if (!is_tileable(&src->dib))
+        return img_fail(ctx, IMG_ERR_UNSUPPORTED, "affine: only uncompressed 24-bit or 32-bit BMP supported");
+    img_map map = {{m[0], m[1], m[2], m[3], m[4], m[5]}, 0.0, 0.0};
+    return tiled_affine_impl(ctx, PROF_AFFINE, src, &map, out);
+}
+
+img_status img_tiled_rotate(imgctx *ctx, const img_tiled *src, double angle_degrees, img_tiled **out)
+{
+    if (!ctx || !src || !src->data || !out)
+        return ctx ? img_fail(ctx, IMG_ERR_ARG, "img_tiled_rotate: missing argument") : IMG_ERR_ARG;
+    if (!is_tileable(&src->dib))
+        return img_fail(ctx, IMG_ERR_UNSUPPORTED, "rotate: only uncompressed 24-bit or 32-bit BMP supported");
+
+    int height = tiled_height(&src->dib);
+    img_map map;
+    img_rotation_map(angle_degrees, src->dib.biWidth, height, &map);
+    return tiled_affine_impl(ctx, PROF_ROTATE, src, &map, out);
+}
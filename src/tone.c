@@ -0,0 +1,228 @@
+#include <math.h>
+#include <string.h>
+#include "image_internal.h"
+#include "../include/threadpool.h"
+
+#ifdef IMG_SSE2
+#include <emmintrin.h>
+#endif
+
+// Tone adjustments are 256-entry tables per colour channel. Each
+// img_lut_* call composes its curve after the ones already in the table,
+// so any chain of adjustments is applied with one lookup per byte.
+
+static unsigned char clamp_byte(double v)
+{
+    if (v <= 0.0)
+        return 0;
+    if (v >= 255.0)
+        return 255;
+    return (unsigned char)(v + 0.5);
+}
+
+// lut = curve after lut, on every colour channel
+static void compose(img_lut *lut, const unsigned char curve[256])
+{
+    for (int c = 0; c < 3; c++)
+        for (int v = 0; v < 256; v++)
+            lut->table[c][v] = curve[lut->table[c][v]];
+}
+
+void img_lut_identity(img_lut *lut)
+{
+    for (int c = 0; c < 3; c++)
+        for (int v = 0; v < 256; v++)
+            lut->table[c][v] = (unsigned char)v;
+}
+
+void img_lut_brightness(img_lut *lut, int delta)
+{
+    unsigned char curve[256];
+    for (int v = 0; v < 256; v++)
+        curve[v] = clamp_byte((double)(v + delta));
+    compose(lut, curve);
+}
+
+void img_lut_contrast(img_lut *lut, double factor)
+{
+    unsigned char curve[256];
+    for (int v = 0; v < 256; v++)
+        curve[v] = clamp_byte((v - 128.0) * factor + 128.0);
+    compose(lut, curve);
+}
+
+void img_lut_gamma(img_lut *lut, double gamma)
+{
+    unsigned char curve[256];
+    double inv = (gamma > 0.0) ? 1.0 / gamma : 1.0;
+    for (int v = 0; v < 256; v++)
+        curve[v] = clamp_byte(255.0 * pow(v / 255.0, inv));
+    compose(lut, curve);
+}
+
+void img_lut_levels(img_lut *lut, int in_black, int in_white, int out_black, int out_white)
+{
+    unsigned char curve[256];
+    double span = (in_white > in_black) ? (double)(in_white - in_black) : 1.0;
+    for (int v = 0; v < 256; v++)
+    {
+        double t = (v - in_black) / span;
+        if (t < 0.0)
+            t = 0.0;
+        if (t > 1.0)
+            t = 1.0;
+        curve[v] = clamp_byte(out_black + t * (out_white - out_black));
+    }
+    compose(lut, curve);
+}
+
+// Returns 1 and the offset when every channel is clamp(v + delta), the
+// case a saturating add handles 16 bytes at a time
+static int lut_is_shift(const img_lut *lut, int *delta)
+{
+    int d = (int)lut->table[0][128] - 128;
+    for (int c = 0; c < 3; c++)
+    {
+        for (int v = 0; v < 256; v++)
+        {
+            int want = v + d;
+            want = (want < 0) ? 0 : (want > 255) ? 255 : want;
+            if (lut->table[c][v] != want)
+                return 0;
+        }
+    }
+    *delta = d;
+    return 1;
+}
+
+typedef struct {
+    BMPImage *img;
+    const img_lut *lut;
+    size_t stride;
+    int shift;  // the table is a plain shift by delta
+    int delta;
+} LutJob;
+
+#ifdef IMG_SSE2
+// Saturating add/subtract over the pixel bytes of a row, stopping on a
+// pixel boundary (16 bytes = 4 pixels of 32 bits, 48 bytes = 16 of 24).
+// The alpha bytes of 32-bit rows (every fourth) get a zero offset.
+static size_t shift_row_sse2(unsigned char *row, size_t bytes, int bpp, int delta)
+{
+    unsigned char mag = (unsigned char)(delta < 0 ? -delta : delta);
+    unsigned char alpha = (bpp == 4) ? 0 : mag;
+    __m128i off = _mm_set_epi8((char)alpha, (char)mag, (char)mag, (char)mag, (char)alpha, (char)mag, (char)mag,
+                               (char)mag, (char)alpha, (char)mag, (char)mag, (char)mag, (char)alpha, (char)mag,
+                               (char)mag, (char)mag);
+    size_t end = bytes - bytes % ((bpp == 4) ? 16 : 48);
+    size_t x = 0;
+    for (; x < end; x += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(row + x));
+        v = (delta >= 0) ? _mm_adds_epu8(v, off) : _mm_subs_epu8(v, off);
+        _mm_storeu_si128((__m128i *)(row + x), v);
+    }
+    return x;
+}
+#endif
+
+static void lut_rows(void *arg, int begin, int end)
+{
+    LutJob *job = (LutJob *)arg;
+    int width = job->img->dib.biWidth;
+    int bpp = job->img->dib.biBitCount / 8;
+    size_t bytes = (size_t)width * bpp;
+    const unsigned char *tb = job->lut->table[0];
+    const unsigned char *tg = job->lut->table[1];
+    const unsigned char *tr = job->lut->table[2];
+
+    for (int y = begin; y < end; y++)
+    {
+        unsigned char *row = job->img->data + (size_t)y * job->stride;
+        size_t x = 0;
+#ifdef IMG_SSE2
+        if (job->shift)
+            x = shift_row_sse2(row, bytes, bpp, job->delta);
+#endif
+        for (; x + (size_t)bpp <= bytes; x += bpp)
+        {
+            row[x + 0] = tb[row[x + 0]];
+            row[x + 1] = tg[row[x + 1]];
+            row[x + 2] = tr[row[x + 2]];
+        }
+    }
+}
+
+img_status img_apply_lut(imgctx *ctx, BMPImage *image, const img_lut *lut)
+{
+    if (!ctx || !image || !image->data || !lut)
+        return ctx ? img_fail(ctx, IMG_ERR_ARG, "img_apply_lut: missing argument") : IMG_ERR_ARG;
+    if ((image->dib.biBitCount != 24 && image->dib.biBitCount != 32) || image->dib.biCompression != 0)
+        return img_fail(ctx, IMG_ERR_UNSUPPORTED, "tone: only 24-bit or 32-bit BMP supported");
+
+    ProfScope scope;
+    prof_begin(&scope, PROF_TONE);
+
+    LutJob job;
+    job.img = image;
+    job.lut = lut;
+    job.stride = img_row_size(image->dib.biWidth, image->dib.biBitCount);
+    job.shift = lut_is_shift(lut, &job.delta);
+    if (!job.shift || job.delta != 0)
+    {
+        tp_parallel_for(ctx->pool, img_height(image), ROW_GRAIN, lut_rows, &job);
+        image->hash = 0;
+    }
+
+    prof_pixels(PROF_TONE, img_pixel_count(image));
+    prof_end(&scope);
+    return IMG_OK;
+}
+
+// Luma weights of ITU-R BT.601 in 8.8 fixed point (sum 256)
+#define GRAY_R 77
+#define GRAY_G 150
+#define GRAY_B 29
+
+typedef struct {
+    BMPImage *img;
+    size_t stride;
+} GrayJob;
+
+static void gray_rows(void *arg, int begin, int end)
+{
+    GrayJob *job = (GrayJob *)arg;
+    int width = job->img->dib.biWidth;
+    int bpp = job->img->dib.biBitCount / 8;
+
+    for (int y = begin; y < end; y++)
+    {
+        unsigned char *p = job->img->data + (size_t)y * job->stride;
+        for (int x = 0; x < width; x++, p += bpp)
+        {
+            unsigned char g = (unsigned char)((GRAY_B * p[0] + GRAY_G * p[1] + GRAY_R * p[2] + 128) >> 8);
+            p[0] = g;
+            p[1] = g;
+            p[2] = g;
+        }
+    }
+}
+
+img_status img_grayscale(imgctx *ctx, BMPImage *image)
+{
+    if (!ctx || !image || !image->data)
+        return ctx ? img_fail(ctx, IMG_ERR_ARG, "img_grayscale: missing argument") : IMG_ERR_ARG;
+    if ((image->dib.biBitCount != 24 && image->dib.biBitCount != 32) || image->dib.biCompression != 0)
+        return img_fail(ctx, IMG_ERR_UNSUPPORTED, "grayscale: only 24-bit or 32-bit BMP supported");
+
+    ProfScope scope;
+    prof_begin(&scope, PROF_TONE);
+
+    GrayJob job = {image, img_row_size(image->dib.biWidth, image->dib.biBitCount)};
+    tp_parallel_for(ctx->pool, img_height(image), ROW_GRAIN, gray_rows, &job);
+    image->hash = 0;
+
+    prof_pixels(PROF_TONE, img_pixel_count(image));
+    prof_end(&scope);
+    return IMG_OK;
+}